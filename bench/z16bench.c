@@ -0,0 +1,228 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ * Assembler throughput benchmark.
+ *
+ * Assembles each source with the z16asm library (z16AssembleFile) several times and reports, for
+ * pass 1, pass 2, the listing and the binary output separately, the best time, lines per second,
+ * source bytes per second and the peak RSS of the process when the phase ended. Peak RSS only
+ * grows, so sources are best listed from the smallest to the largest.
+ *
+ * Lines per second depend on the host as much as on the assembler, so before the sources a fixed
+ * calibration round that does not use the assembler (filling, hashing and sorting an array of
+ * integers) is timed, best of the same repeats. Speeds are compared in lines per calibration
+ * round: a host twice as fast runs both twice as fast and its figures stay about the same. A phase
+ * that takes less than 20 ms is not checked for speed.
+ *
+ * A baseline file holds one "<source name> <phase> <lines per round> <peak RSS KB>" line per
+ * phase. With --baseline, every phase that is more than the tolerance slower (or bigger) than its
+ * baseline is reported as a regression and the exit status is 1; --save-baseline writes the
+ * current results instead. The z16asm-bench CMake target generates workloads with z16gen and
+ * runs this against bench/baseline.txt. Calibration does not make hosts alike in caches, memory
+ * or allocator (peak RSS is not normalised at all), so on a host other than the one that wrote
+ * the baseline, run z16bench once with --save-baseline and compare against that file.
+ *
+ * Usage:
+ *   z16bench [-r <repeats>] [-j <threads>] [--tolerance <pct>]
+ *            [--baseline <file> | --save-baseline <file>] <source>...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "z16asm.h"
+
+static const char *phaseNames[Z16_PHASES] = { "pass1", "pass2", "listing", "binary" };
+
+typedef struct {
+    char name[128];
+    char phase[16];
+    double linesPerRound;
+    long peakRssKb;
+} Baseline;
+
+static Baseline *baselines = NULL;
+static int baselineCount = 0;
+
+static void loadBaselines(const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if(!fp) {
+        perror("Error opening baseline file");
+        exit(1);
+    }
+    char line[512];
+    while(fgets(line, sizeof(line), fp)) {
+        Baseline b;
+        if(line[0] == '#' || sscanf(line, "%127s %15s %lf %ld", b.name, b.phase, &b.linesPerRound, &b.peakRssKb) != 4)
+            continue;
+        baselines = (Baseline *)realloc(baselines, (baselineCount + 1) * sizeof(Baseline));
+        if(!baselines) { perror("realloc"); exit(1); }
+        baselines[baselineCount++] = b;
+    }
+    fclose(fp);
+}
+
+static const Baseline *findBaseline(const char *name, const char *phase) {
+    for (int i = 0; i < baselineCount; i++)
+        if(strcmp(baselines[i].name, name) == 0 && strcmp(baselines[i].phase, phase) == 0)
+            return &baselines[i];
+    return NULL;
+}
+
+// Source name without its directory, as used in the baseline file.
+static const char *baseName(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define CALIBRATION_WORDS (1 << 18)
+
+// A phase faster than this is timed too coarsely (and too noisily) to fail on its speed.
+#define MIN_GATED_SECONDS 0.02
+
+static uint32_t calibrationSink;     // keeps the calibration work from being optimised away
+
+static int compareWords(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Best time of a calibration round: fill an array from xorshift64*, hash it (FNV-1a) and sort it.
+static double calibrate(int repeats) {
+    uint32_t *words = (uint32_t *)malloc(CALIBRATION_WORDS * sizeof(uint32_t));
+    if(!words) { perror("malloc"); exit(1); }
+    double best = 0;
+    for (int r = 0; r < repeats; r++) {
+        double start = nowSeconds();
+        uint64_t state = 1;
+        uint32_t hash = 2166136261u;
+        for (int i = 0; i < CALIBRATION_WORDS; i++) {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            words[i] = (uint32_t)((state * 0x2545F4914F6CDD1DULL) >> 32);
+            hash = (hash ^ words[i]) * 16777619u;
+        }
+        qsort(words, CALIBRATION_WORDS, sizeof(uint32_t), compareWords);
+        calibrationSink += hash + words[CALIBRATION_WORDS / 2];
+        double secs = nowSeconds() - start;
+        if(r == 0 || secs < best)
+            best = secs;
+    }
+    free(words);
+    return best;
+}
+
+int main(int argc, char **argv) {
+    int repeats = 3;
+    double tolerance = 30.0;
+    const char *baselineFile = NULL, *saveFile = NULL;
+    Z16Options options = { 0, 0, 0, 1 };
+    int first = argc;
+    for (int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            repeats = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            options.threads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+            tolerance = atof(argv[++i]);
+        else if(strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+            baselineFile = argv[++i];
+        else if(strcmp(argv[i], "--save-baseline") == 0 && i + 1 < argc)
+            saveFile = argv[++i];
+        else if(argv[i][0] == '-') {
+            first = argc;
+            break;
+        } else {
+            first = i;
+            break;
+        }
+    }
+    if(first == argc || repeats < 1 || (baselineFile && saveFile)) {
+        fprintf(stderr, "Usage: %s [-r <repeats>] [-j <threads>] [--tolerance <pct>] [--baseline <file> | --save-baseline <file>] <source>...\n", argv[0]);
+        exit(1);
+    }
+    if(baselineFile)
+        loadBaselines(baselineFile);
+    FILE *save = NULL;
+    if(saveFile) {
+        save = fopen(saveFile, "w");
+        if(!save) {
+            perror("Error opening baseline file for writing");
+            exit(1);
+        }
+    }
+    double round = calibrate(repeats);
+    printf("calibration: %.3f ms per round, best of %d\n", 1000.0 * round, repeats);
+    if(save)
+        fprintf(save, "# source phase lines-per-calibration-round peak-RSS-KB (calibration %.3f ms)\n", 1000.0 * round);
+
+    int regressions = 0;
+    for (int f = first; f < argc; f++) {
+        const char *name = baseName(argv[f]);
+        Z16Stats best, stats;
+        char error[256];
+        for (int r = 0; r < repeats; r++) {
+            if(z16AssembleFile(argv[f], &options, &stats, error, sizeof(error)) != 0) {
+                fprintf(stderr, "%s: %s", argv[f], error);
+                exit(1);
+            }
+            if(r == 0) {
+                best = stats;
+                continue;
+            }
+            for (int p = 0; p < Z16_PHASES; p++)
+                if(stats.seconds[p] < best.seconds[p])
+                    best.seconds[p] = stats.seconds[p];
+        }
+        printf("%s: %ld lines, %ld bytes, best of %d\n", name, best.lines, best.bytes, repeats);
+        printf("  %-8s %10s %14s %10s %12s %12s\n", "phase", "ms", "lines/s", "MB/s", "lines/round", "peak RSS KB");
+        for (int p = 0; p < Z16_PHASES; p++) {
+            double secs = best.seconds[p] > 0 ? best.seconds[p] : 1e-9;
+            double linesPerSecond = best.lines / secs, linesPerRound = linesPerSecond * round;
+            printf("  %-8s %10.3f %14.0f %10.1f %12.0f %12ld", phaseNames[p], 1000.0 * best.seconds[p], linesPerSecond,
+                   best.bytes / secs / 1e6, linesPerRound, best.peakRssKb[p]);
+            const Baseline *b = baselineFile ? findBaseline(name, phaseNames[p]) : NULL;
+            if(b) {
+                int slower = best.seconds[p] >= MIN_GATED_SECONDS &&
+                             linesPerRound < b->linesPerRound * (1.0 - tolerance / 100.0);
+                int bigger = best.peakRssKb[p] > b->peakRssKb * (1.0 + tolerance / 100.0);
+                printf("   %+6.1f%% vs baseline%s", 100.0 * (linesPerRound / b->linesPerRound - 1.0),
+                       (slower || bigger) ? (slower ? "  REGRESSION (speed)" : "  REGRESSION (RSS)") : "");
+                regressions += slower || bigger;
+            } else if(baselineFile) {
+                printf("   (no baseline)");
+            }
+            printf("\n");
+            if(save)
+                fprintf(save, "%s %s %.0f %ld\n", name, phaseNames[p], linesPerRound, best.peakRssKb[p]);
+        }
+    }
+    if(save)
+        fclose(save);
+    free(baselines);
+    if(regressions) {
+        printf("%d phase(s) regressed by more than %.0f%%\n", regressions, tolerance);
+        return 1;
+    }
+    return 0;
+}
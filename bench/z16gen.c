@@ -0,0 +1,178 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ * Synthetic Z16 source generator for assembler benchmarks.
+ *
+ * Writes a valid Z16 assembly program with the requested number of labels. Every label starts
+ * a block of ALU instructions and forward branches over one instruction (always in range),
+ * followed by a branch back to the label while it is still reachable and a jump on to the next
+ * label, so pass 1 defines symbols and pass 2 resolves label references throughout. The data
+ * section that follows the code holds .word (including label addresses), .byte and .asciiz
+ * lines. Options set the mix; the same seed always gives the same program.
+ *
+ * Usage:
+ *   z16gen [options] <labels> > big.asm
+ *     -i <n>     ALU instructions per block (default 1)
+ *     -b <n>     forward branches per block (default 0)
+ *     -d <n>     data lines per block (default 0)
+ *     -c <pct>   percentage of lines with a trailing comment, plus a comment line per block
+ *                when it is non-zero (default 0)
+ *     -s <seed>  random seed (default 1)
+ *     -o <file>  write to file instead of stdout
+ *   z16asm -d big.asm          # -d prints the pass 1 and pass 2 times
+ *
+ * With no options the output is the original workload: "addi", a backward branch and a jump per
+ * label.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long long rngState = 1;
+
+// xorshift64*: small, fast and the same on every platform.
+static unsigned nextRandom(unsigned n) {
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return (unsigned)((rngState * 0x2545F4914F6CDD1DULL) >> 33) % n;
+}
+
+static const char *regNames[] = { "t0", "ra", "sp", "s0", "s1", "t1", "a0", "a1" };
+
+static const char *aluOps[] = { "add", "sub", "and", "or", "xor", "slt", "sltu", "mv" };
+static const char *immOps[] = { "addi", "andi", "ori", "xori", "slli", "srli", "slti" };
+static const char *branchOps[] = { "beq", "bne", "bz", "bnz", "blt", "bge", "bltu", "bgeu" };
+
+static FILE *out;
+static int commentPct = 0;
+
+// End a line, with a trailing comment on commentPct percent of them.
+static void endLine(void) {
+    if(commentPct && (int)nextRandom(100) < commentPct)
+        fprintf(out, "    # generated line %u", nextRandom(100000));
+    fputc('\n', out);
+}
+
+static void aluInstruction(void) {
+    const char *rd = regNames[nextRandom(8)], *rs = regNames[nextRandom(8)];
+    if(nextRandom(2)) {
+        fprintf(out, "    %-5s %s, %s", aluOps[nextRandom(8)], rd, rs);
+    } else {
+        const char *op = immOps[nextRandom(7)];
+        int shift = strcmp(op, "slli") == 0 || strcmp(op, "srli") == 0;
+        int imm = shift ? (int)nextRandom(8) : (int)nextRandom(64) - 32;
+        fprintf(out, "    %-5s %s, %d", op, rd, imm);
+    }
+    endLine();
+}
+
+static void dataLine(long block, long labels) {
+    switch(nextRandom(3)) {
+    case 0:
+        fprintf(out, "    .word %u, Label_%ld, 0x%X", nextRandom(65536), (long)nextRandom((unsigned)labels), nextRandom(65536));
+        break;
+    case 1:
+        fprintf(out, "    .byte %u, %u, %u, %u", nextRandom(256), nextRandom(256), nextRandom(256), nextRandom(256));
+        break;
+    default:
+        fprintf(out, "    .asciiz \"string %ld %u\"", block, nextRandom(1000));
+        break;
+    }
+    endLine();
+}
+
+int main(int argc, char **argv) {
+    long labels = 0;
+    int insts = 1, branches = 0, dataLines = 0, custom = 0;
+    out = stdout;
+    for (int i = 1; i < argc; i++) {
+        if(argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+            const char *value = argv[++i];
+            custom = 1;
+            switch(argv[i - 1][1]) {
+            case 'i': insts = atoi(value); break;
+            case 'b': branches = atoi(value); break;
+            case 'd': dataLines = atoi(value); break;
+            case 'c': commentPct = atoi(value); break;
+            case 's': rngState = strtoull(value, NULL, 0) | 1; break;
+            case 'o':
+                out = fopen(value, "w");
+                if(!out) {
+                    perror("Error opening output file");
+                    exit(1);
+                }
+                break;
+            default:
+                labels = 0;
+                i = argc;
+                break;
+            }
+        } else {
+            labels = strtol(argv[i], NULL, 0);
+        }
+    }
+    if(labels < 1 || insts < 0 || branches < 0 || dataLines < 0) {
+        fprintf(stderr, "Usage: %s [-i insts] [-b branches] [-d data] [-c comment%%] [-s seed] [-o file] <labels>\n", argv[0]);
+        exit(1);
+    }
+    fprintf(out, "    .text\n");
+    fprintf(out, "    .org 0\n");
+    long textBytes = 0;
+    for (long i = 0; i < labels; i++) {
+        if(commentPct)
+            fprintf(out, "# block %ld\n", i);
+        fprintf(out, "Label_%ld:\n", i);
+        int blockBytes = 0;
+        for (int k = 0; k < insts; k++, blockBytes += 2) {
+            if(custom)
+                aluInstruction();
+            else
+                fprintf(out, "    addi t0, 1\n");
+        }
+        for (int k = 0; k < branches; k++, blockBytes += 4) {
+            fprintf(out, "    %-5s %s, Skip_%ld_%d", branchOps[nextRandom(8)], regNames[nextRandom(8)], i, k);
+            endLine();
+            aluInstruction();
+            fprintf(out, "Skip_%ld_%d:\n", i, k);
+        }
+        // A branch reaches 16 bytes back from its own address.
+        if(blockBytes <= 14) {
+            fprintf(out, "    bnz  t0, Label_%ld     # backward branch\n", i);
+            blockBytes += 2;
+        }
+        if(i + 1 < labels) {
+            fprintf(out, "    j    Label_%ld", i + 1);
+            if(custom)
+                endLine();
+            else
+                fputc('\n', out);
+            blockBytes += 2;
+        }
+        textBytes += blockBytes;
+    }
+    fprintf(out, "    ecall 3\n");
+    textBytes += 2;
+    if(dataLines) {
+        fprintf(out, "    .data\n");
+        fprintf(out, "    .org 0x%lX\n", (textBytes + 15) & ~15L);
+        for (long i = 0; i < labels; i++)
+            for (int k = 0; k < dataLines; k++)
+                dataLine(i, labels);
+    }
+    if(out != stdout)
+        fclose(out);
+    return 0;
+}
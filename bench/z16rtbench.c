@@ -0,0 +1,293 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ * Runtime library benchmark.
+ *
+ * Calls every routine of lib/z16rt.asm over a range of input sizes and reports the instructions
+ * executed per call (from the routine's first instruction to its return), checking each result.
+ * For every routine a driver ("jal rt_<name>" then "ecall 3") that .includes the library is
+ * assembled in memory with z16Assemble and loaded; each sample puts its arguments in registers
+ * and memory and runs the driver until the ecall. A wrong result makes the exit status 1.
+ *
+ * The driver runs in the simulator itself (z16sim.c linked as z16simlib, see z16sim.h), so the
+ * counts are those of the instructions z16asm emits as z16sim decodes and executes them.
+ *
+ * Usage:
+ *   z16rtbench [-n <samples>] <z16rt.asm>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "z16asm.h"
+#include "z16sim.h"
+
+#define MEM_SIZE  65536
+#define SRC_ADDR  0x4000        // memcpy source, strlen string
+#define DST_ADDR  0x6000        // memcpy destination, itoa buffer
+#define STACK_TOP 0xFF00
+
+enum { T0, RA, SP, S0, S1, T1, A0, A1 };
+
+static unsigned long long rngState = 1;
+
+// xorshift64*, as in z16gen.
+static unsigned nextRandom(unsigned n) {
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return (unsigned)((rngState * 0x2545F4914F6CDD1DULL) >> 33) % n;
+}
+
+// -----------------------
+// Benchmarks
+// -----------------------
+
+typedef struct {
+    const char *routine;
+    Z16Image image;
+} Driver;
+
+static uint8_t *mem;             // z16sim's guest memory
+static int16_t *regs;            // and registers
+static int failures = 0;
+
+// Assemble the driver for 'routine' and load it into the simulator.
+static void buildDriver(Driver *d, const char *routine, const char *library) {
+    char source[1024];
+    int len = snprintf(source, sizeof(source),
+                       "    .text\n"
+                       "    .org 0\n"
+                       "_start:\n"
+                       "    jal  %s\n"
+                       "    ecall 3\n"
+                       "    .data\n"
+                       "    .org 0x%X\n"
+                       "    .text\n"
+                       "    .include \"%s\"\n", routine, 0x8000, library);
+    d->routine = routine;
+    if(z16Assemble("z16rtbench-driver.asm", source, (size_t)len, 0, &d->image) != 0) {
+        fprintf(stderr, "%s: %s", library, d->image.error);
+        exit(1);
+    }
+    memset(mem, 0, MEM_SIZE);
+    memcpy(mem, d->image.bytes, (size_t)d->image.size);
+}
+
+// Set the arguments and run one call of the loaded driver, from its jal until the routine
+// returns to the ecall after it. Returns the instructions of the call.
+static long call(const Driver *d, uint16_t a0, uint16_t a1, uint16_t t1) {
+    regs[SP] = (int16_t)STACK_TOP;
+    regs[S0] = 0x5A5A;
+    regs[A0] = (int16_t)a0;
+    regs[A1] = (int16_t)a1;
+    regs[T1] = (int16_t)t1;
+    long steps = z16SimCall((uint16_t)d->image.entry, (uint16_t)(d->image.entry + 2), 10000000);
+    if(steps < 0) {
+        fprintf(stderr, "%s: bad instruction or no return\n", d->routine);
+        exit(1);
+    }
+    if((uint16_t)regs[SP] != STACK_TOP || regs[S0] != 0x5A5A) {
+        fprintf(stderr, "%s: sp or s0 not preserved\n", d->routine);
+        failures++;
+    }
+    return steps - 1;   // not the driver's jal
+}
+
+static void check(int ok, const char *routine, const char *what, unsigned a, unsigned b) {
+    if(!ok) {
+        fprintf(stderr, "%s: wrong result for %s (%u, %u)\n", routine, what, a, b);
+        failures++;
+    }
+}
+
+typedef struct {
+    long calls, total, min, max;
+} Tally;
+
+static void count(Tally *t, long instructions) {
+    if(t->calls == 0 || instructions < t->min)
+        t->min = instructions;
+    if(instructions > t->max)
+        t->max = instructions;
+    t->total += instructions;
+    t->calls++;
+}
+
+static void report(const char *routine, const char *size, const Tally *t, long bytes) {
+    double mean = (double)t->total / t->calls;
+    printf("  %-10s %-18s %8ld %10.1f %8ld %8ld", routine, size, t->calls, mean, t->min, t->max);
+    if(bytes > 0)
+        printf(" %10.2f", mean / bytes);
+    printf("\n");
+}
+
+// A random value of exactly 'bits' bits (0 for 0 bits).
+static uint16_t randomBits(int bits) {
+    if(bits == 0)
+        return 0;
+    return (uint16_t)((1u << (bits - 1)) | (nextRandom(65536) & ((1u << (bits - 1)) - 1)));
+}
+
+static void benchMul(const Driver *d, int samples) {
+    static const int widths[] = { 0, 1, 4, 8, 12, 16 };
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        Tally t = { 0 };
+        for (int s = 0; s < samples; s++) {
+            uint16_t small = randomBits(widths[w]), big = (uint16_t)(nextRandom(65536) | 0x8000);
+            uint16_t a = s & 1 ? small : big, b = s & 1 ? big : small;
+            count(&t, call(d, a, b, 0));
+            check((uint16_t)regs[A0] == (uint16_t)(a * b), d->routine, "a0", a, b);
+        }
+        char size[32];
+        snprintf(size, sizeof(size), "%d-bit operand", widths[w]);
+        report(d->routine, size, &t, 0);
+    }
+}
+
+static void benchDivu(const Driver *d, int samples) {
+    static const int widths[] = { 4, 8, 12, 16 };
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        Tally t = { 0 };
+        for (int s = 0; s < samples; s++) {
+            uint16_t a = randomBits(widths[w]), b = (uint16_t)(1 + nextRandom(s & 1 ? 10 : 1000));
+            count(&t, call(d, a, b, 0));
+            check((uint16_t)regs[A0] == a / b && (uint16_t)regs[A1] == a % b, d->routine, "a0/a1", a, b);
+        }
+        char size[32];
+        snprintf(size, sizeof(size), "%d-bit dividend", widths[w]);
+        report(d->routine, size, &t, 0);
+    }
+    call(d, 1234, 0, 0);
+    check((uint16_t)regs[A0] == 0xFFFF && (uint16_t)regs[A1] == 1234, d->routine, "division by zero", 1234, 0);
+}
+
+static void benchMemcpy(const Driver *d, int samples) {
+    static const int lengths[] = { 0, 1, 7, 16, 64, 256, 1024 };
+    for (int odd = 0; odd < 2; odd++) {
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            int n = lengths[l];
+            uint16_t src = (uint16_t)(SRC_ADDR + odd), dst = DST_ADDR;
+            Tally t = { 0 };
+            for (int s = 0; s < samples; s++) {
+                uint8_t data[1024];
+                for (int i = 0; i < n; i++)
+                    data[i] = (uint8_t)nextRandom(256);
+                memcpy(mem + src, data, (size_t)n);
+                memset(mem + dst, 0xEE, (size_t)n + 1);
+                count(&t, call(d, dst, src, (uint16_t)n));
+                check(memcmp(mem + dst, data, (size_t)n) == 0 && mem[dst + n] == 0xEE, d->routine, "bytes", (unsigned)n, odd);
+                check((uint16_t)regs[A0] == dst + n && (uint16_t)regs[A1] == src + n, d->routine, "a0/a1", (unsigned)n, odd);
+            }
+            char size[32];
+            snprintf(size, sizeof(size), "%d byte%s%s", n, n == 1 ? "" : "s", odd ? ", odd src" : "");
+            report(d->routine, size, &t, n);
+        }
+    }
+}
+
+static void benchStrlen(const Driver *d, int samples) {
+    static const int lengths[] = { 0, 1, 7, 16, 64, 256, 1024 };
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        int n = lengths[l];
+        Tally t = { 0 };
+        for (int s = 0; s < samples; s++) {
+            for (int i = 0; i < n; i++)
+                mem[SRC_ADDR + i] = (uint8_t)(1 + nextRandom(255));
+            mem[SRC_ADDR + n] = 0;
+            count(&t, call(d, SRC_ADDR, 0, 0));
+            check((uint16_t)regs[A0] == n, d->routine, "length", (unsigned)n, 0);
+        }
+        char size[32];
+        snprintf(size, sizeof(size), "%d byte%s", n, n == 1 ? "" : "s");
+        report(d->routine, size, &t, n);
+    }
+}
+
+static void benchItoa(const Driver *d, int samples) {
+    static const int digits[] = { 1, 2, 3, 4, 5 };
+    for (int negative = 0; negative < 2; negative++) {
+        for (size_t k = 0; k < sizeof(digits) / sizeof(digits[0]); k++) {
+            int low = 1, high = 10;
+            for (int i = 1; i < digits[k]; i++)
+                low *= 10, high *= 10;
+            if(digits[k] == 1)
+                low = 0;
+            if(high > 32768)
+                high = 32768;
+            Tally t = { 0 };
+            for (int s = 0; s < samples; s++) {
+                int value = low + (int)nextRandom((unsigned)(high - low));
+                if(negative)
+                    value = -value;
+                char expect[16];
+                snprintf(expect, sizeof(expect), "%d", value);
+                memset(mem + DST_ADDR, 0xEE, sizeof(expect));
+                count(&t, call(d, (uint16_t)value, DST_ADDR, 0));
+                check(strcmp((const char *)mem + DST_ADDR, expect) == 0 && (uint16_t)regs[A0] == DST_ADDR + strlen(expect),
+                      d->routine, "string", (unsigned)value, 0);
+            }
+            char size[32];
+            snprintf(size, sizeof(size), "%d digit%s%s", digits[k], digits[k] > 1 ? "s" : "", negative ? ", negative" : "");
+            report(d->routine, size, &t, 0);
+        }
+    }
+    call(d, 0x8000, DST_ADDR, 0);
+    check(strcmp((const char *)mem + DST_ADDR, "-32768") == 0, d->routine, "string", 0x8000, 0);
+}
+
+int main(int argc, char **argv) {
+    int samples = 200;
+    const char *library = NULL;
+    for (int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            samples = atoi(argv[++i]);
+        else if(argv[i][0] != '-' && !library)
+            library = argv[i];
+        else
+            library = NULL, i = argc;
+    }
+    if(!library || samples < 1) {
+        fprintf(stderr, "Usage: %s [-n <samples>] <z16rt.asm>\n", argv[0]);
+        exit(1);
+    }
+
+    static const struct {
+        const char *routine;
+        void (*bench)(const Driver *, int);
+    } benches[] = {
+        { "rt_mul", benchMul },
+        { "rt_divu", benchDivu },
+        { "rt_memcpy", benchMemcpy },
+        { "rt_strlen", benchStrlen },
+        { "rt_itoa", benchItoa },
+    };
+    z16SimInit();
+    mem = z16SimMemory();
+    regs = z16SimRegs();
+    printf("%s: %d samples per size\n", library, samples);
+    printf("  %-10s %-18s %8s %10s %8s %8s %10s\n", "routine", "size", "calls", "instrs", "min", "max", "per byte");
+    for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+        Driver d;
+        buildDriver(&d, benches[b].routine, library);
+        benches[b].bench(&d, samples);
+        z16FreeImage(&d.image);
+    }
+    if(failures) {
+        printf("%d wrong result(s)\n", failures);
+        return 1;
+    }
+    return 0;
+}
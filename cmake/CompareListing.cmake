@@ -0,0 +1,22 @@
+# Assemble SOURCE with Z16ASM in the scratch directory WORK and compare the listing and
+# binary with the .lst and .bin committed next to SOURCE.
+#
+#   cmake -DZ16ASM=<z16asm> -DSOURCE=<file.txt> -DWORK=<dir> -P CompareListing.cmake
+
+get_filename_component(name ${SOURCE} NAME_WE)
+get_filename_component(file ${SOURCE} NAME)
+get_filename_component(dir ${SOURCE} DIRECTORY)
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+file(COPY ${SOURCE} DESTINATION ${WORK})
+execute_process(COMMAND ${Z16ASM} ${file} WORKING_DIRECTORY ${WORK} RESULT_VARIABLE rc OUTPUT_QUIET)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "z16asm failed on ${SOURCE}")
+endif()
+foreach(ext lst bin)
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${dir}/${name}.${ext} ${WORK}/${name}.${ext}
+                    RESULT_VARIABLE differs)
+    if(NOT differs EQUAL 0)
+        message(FATAL_ERROR "${WORK}/${name}.${ext} differs from ${dir}/${name}.${ext}")
+    endif()
+endforeach()
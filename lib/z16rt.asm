@@ -0,0 +1,272 @@
+# -----------------------------------------------------------------------------
+# z16rt.asm - Z16 runtime library: multiply, divide, memcpy, strlen, itoa
+#
+#     .include "lib/z16rt.asm"
+#
+# Include it in .text. It ends in .text; its powers-of-ten table goes at the
+# current .data location, so give .data an .org clear of the code first.
+#
+# Calling convention (call with "jal rt_<name>"):
+#   arguments    a0, a1, then t1 (memcpy's byte count)
+#   results      a0 (and a1 for the remainder of rt_divu)
+#   clobbered    t0, t1, a0, a1
+#   preserved    s0, s1 and sp (routines that need s0 save it on the stack)
+# The two-register branches (beq, bne, blt, bge, bltu, bgeu rs, label) compare
+# rs with t0, which is loaded just before each of them.
+#
+# bench/z16rtbench runs every routine across input sizes and reports the
+# instructions per call. The entry points are .globl, which also makes each of
+# them a function of its own in z16asm's --report.
+# -----------------------------------------------------------------------------
+
+# rt_mul: a0 = a0 * a1 (low 16 bits; signed and unsigned alike).
+# Shift-add over the smaller operand, stopping once its remaining bits are all
+# zero: 4 + 7 instructions per bit of the smaller operand.
+    .globl rt_mul
+rt_mul:
+    mv   t0, a0
+    bltu a1, rt_mul_start       # a1 < a0: a1 is already the smaller one
+    mv   a0, a1
+    mv   a1, t0
+rt_mul_start:
+    li   t1, 0                  # product
+    bz   a1, rt_mul_done
+rt_mul_loop:
+    mv   t0, a1
+    andi t0, 1
+    bz   t0, rt_mul_next
+    add  t1, a0
+rt_mul_next:
+    slli a0, 1
+    srli a1, 1
+    bnz  a1, rt_mul_loop        # early exit: no multiplier bits left
+rt_mul_done:
+    mv   a0, t1
+    jr   ra, ra
+
+# rt_divu: a0 = a0 / a1, a1 = a0 % a1 (unsigned). Dividing by zero gives
+# 0xFFFF and the dividend as the remainder.
+# Restoring division, one quotient bit per step: the remainder takes the next
+# dividend bit and keeps the subtraction of the divisor only if it fits. The
+# quotient bits shift into a0 as the dividend shifts out. A dividend below the
+# divisor, a divisor of 0x8000 or more (quotient 0 or 1) and dividends below
+# 256 (8 steps instead of 16) exit early.
+    .globl rt_divu
+rt_divu:
+    bz   a1, rt_divu_zero
+    mv   t0, a1
+    bltu a0, rt_divu_small      # a0 < a1: quotient 0
+    srli t0, 15
+    bnz  t0, rt_divu_one
+    addi sp, -2
+    sw   s0, 0(sp)
+    li   t1, 0                  # remainder
+    li   s0, 16                 # steps left
+    mv   t0, a0
+    srli t0, 8
+    bnz  t0, rt_divu_loop
+    slli a0, 8                  # the high byte is zero: skip its steps
+    li   s0, 8
+rt_divu_loop:
+    slli t1, 1
+    mv   t0, a0
+    srli t0, 15
+    or   t1, t0                 # remainder = remainder << 1 | next dividend bit
+    slli a0, 1
+    mv   t0, a1
+    bltu t1, rt_divu_next       # remainder < divisor: quotient bit 0
+    sub  t1, a1
+    ori  a0, 1
+rt_divu_next:
+    addi s0, -1
+    bnz  s0, rt_divu_loop
+    mv   a1, t1
+    lw   s0, 0(sp)
+    addi sp, 2
+    jr   ra, ra
+rt_divu_small:
+    mv   a1, a0
+    li   a0, 0
+    jr   ra, ra
+rt_divu_one:
+    sub  a0, a1
+    mv   a1, a0
+    li   a0, 1
+    jr   ra, ra
+rt_divu_zero:
+    mv   a1, a0
+    li   a0, -1
+    jr   ra, ra
+
+# rt_memcpy: copy t1 bytes from a1 to a0. Returns with a0 and a1 just past the
+# copied bytes. When both addresses are even the copy goes a word at a time,
+# four words per round, then one word at a time, then the odd byte; otherwise
+# a byte at a time.
+    .globl rt_memcpy
+rt_memcpy:
+    bz   t1, rt_memcpy_done
+    mv   t0, a0
+    or   t0, a1
+    andi t0, 1
+    bnz  t0, rt_memcpy_byte     # an odd address: bytes only
+    li   t0, 8
+    bltu t1, rt_memcpy_words
+rt_memcpy_block:
+    lw   t0, 0(a1)
+    sw   t0, 0(a0)
+    lw   t0, 2(a1)
+    sw   t0, 2(a0)
+    lw   t0, 4(a1)
+    sw   t0, 4(a0)
+    lw   t0, 6(a1)
+    sw   t0, 6(a0)
+    addi a0, 8
+    addi a1, 8
+    addi t1, -8
+    li   t0, 8
+    bgeu t1, rt_memcpy_block
+rt_memcpy_words:
+    li   t0, 2
+    bltu t1, rt_memcpy_tail
+    lw   t0, 0(a1)
+    sw   t0, 0(a0)
+    addi a0, 2
+    addi a1, 2
+    addi t1, -2
+    j    rt_memcpy_words
+rt_memcpy_tail:
+    bz   t1, rt_memcpy_done
+rt_memcpy_byte:
+    lbu  t0, 0(a1)
+    sb   t0, 0(a0)
+    addi a0, 1
+    addi a1, 1
+    addi t1, -1
+    bnz  t1, rt_memcpy_byte
+rt_memcpy_done:
+    jr   ra, ra
+
+# rt_strlen: a0 = length of the NUL-terminated string at a0.
+# The scan is unrolled over eight bytes, so a byte costs a load and a branch
+# and the loop overhead is paid once per eight bytes.
+    .globl rt_strlen
+rt_strlen:
+    mv   a1, a0
+rt_strlen_loop:
+    lbu  t0, 0(a0)
+    bz   t0, rt_strlen_end
+    lbu  t0, 1(a0)
+    bz   t0, rt_strlen_1
+    lbu  t0, 2(a0)
+    bz   t0, rt_strlen_2
+    lbu  t0, 3(a0)
+    bz   t0, rt_strlen_3
+    lbu  t0, 4(a0)
+    bz   t0, rt_strlen_4
+    lbu  t0, 5(a0)
+    bz   t0, rt_strlen_5
+    lbu  t0, 6(a0)
+    bz   t0, rt_strlen_6
+    lbu  t0, 7(a0)
+    bz   t0, rt_strlen_7
+    addi a0, 8
+    j    rt_strlen_loop
+rt_strlen_7:
+    addi a0, 7
+    j    rt_strlen_end
+rt_strlen_6:
+    addi a0, 6
+    j    rt_strlen_end
+rt_strlen_5:
+    addi a0, 5
+    j    rt_strlen_end
+rt_strlen_4:
+    addi a0, 4
+    j    rt_strlen_end
+rt_strlen_3:
+    addi a0, 3
+    j    rt_strlen_end
+rt_strlen_2:
+    addi a0, 2
+    j    rt_strlen_end
+rt_strlen_1:
+    addi a0, 1
+rt_strlen_end:
+    sub  a0, a1
+    jr   ra, ra
+
+# rt_itoa: write the signed decimal of a0 at a1, NUL-terminated; returns the
+# address of the NUL in a0. rt_utoa does the same for an unsigned a0.
+# Each digit comes from the rt_pow10 table row 4p, 2p, 2p, p of its power of
+# ten p: subtracting every entry that still fits adds 4, 2, 2 and 1 to the
+# digit, which reaches every digit 0..9 in four compare steps with no division.
+# Leading zeros are skipped by moving down the table first.
+    .globl rt_itoa
+rt_itoa:
+    li   t0, 0
+    bge  a0, rt_utoa            # a0 >= 0
+    li   t0, 45                 # '-'
+    sb   t0, 0(a1)
+    addi a1, 1
+    li   t0, 0
+    sub  t0, a0
+    mv   a0, t0
+    .globl rt_utoa
+rt_utoa:
+    bnz  a0, rt_utoa_start
+    li   t0, 48                 # '0'
+    sb   t0, 0(a1)
+    addi a1, 1
+    j    rt_utoa_end
+rt_utoa_start:
+    addi sp, -2
+    sw   s0, 0(sp)
+    la   t1, rt_pow10
+rt_utoa_skip:
+    lw   t0, 6(t1)
+    bgeu a0, rt_utoa_digit      # a0 >= p: the first digit
+    addi t1, 8
+    j    rt_utoa_skip
+rt_utoa_digit:
+    li   s0, 48                 # '0'
+    lw   t0, 0(t1)
+    bltu a0, rt_utoa_2
+    sub  a0, t0
+    addi s0, 4
+rt_utoa_2:
+    lw   t0, 2(t1)
+    bltu a0, rt_utoa_2b
+    sub  a0, t0
+    addi s0, 2
+rt_utoa_2b:
+    lw   t0, 4(t1)
+    bltu a0, rt_utoa_1
+    sub  a0, t0
+    addi s0, 2
+rt_utoa_1:
+    lw   t0, 6(t1)
+    bltu a0, rt_utoa_put
+    sub  a0, t0
+    addi s0, 1
+rt_utoa_put:
+    sb   s0, 0(a1)
+    addi a1, 1
+    addi t1, 8
+    addi t0, -1                 # t0 is still p: stop after p = 1
+    bnz  t0, rt_utoa_digit
+    lw   s0, 0(sp)
+    addi sp, 2
+rt_utoa_end:
+    li   t0, 0
+    sb   t0, 0(a1)
+    mv   a0, a1
+    jr   ra, ra
+
+    .data
+rt_pow10:
+    .word 40000, 20000, 20000, 10000
+    .word 4000, 2000, 2000, 1000
+    .word 400, 200, 200, 100
+    .word 40, 20, 20, 10
+    .word 4, 2, 2, 1
+    .text
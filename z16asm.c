@@ -29,8 +29,8 @@
  *        using the computed addresses.
  *
  *   2. Assembly Language Parsing:
- *      - The assembler shall support directives (.text, .data, .org, .asciiz, .byte, .word, .space)
- *        and the complete set of Z16 instructions (R‑, I‑, B‑, L‑, J‑, U‑, and System instructions).
+ *      - The assembler shall support directives (.text, .data, .org, .asciiz, .byte, .word, .space,
+ *        .globl, .equ, .include, .macro/.endm) and the complete set of Z16 instructions (R‑, I‑, B‑, L‑, J‑, U‑, and System instructions).
  *
  *   3. Case‑Insensitive Processing:
  *      - All source elements (mnemonics, registers, directives, labels) shall be processed
@@ -43,6 +43,8 @@
  *          - Hexadecimal (e.g., 0x2A or 0X2A)
  *          - Binary (e.g., 0b101010 or 0B101010)
  *      - It shall also support %hi(...) and %lo(...) expressions to extract parts of constants.
+ *      - "li rd, value" and "la rd, label" load any 16-bit constant or label address with the
+ *        shortest of li, lui, or lui + addi (see Constant Loads).
  *
  *   5. Multiple Values in Data Directives:
  *      - The .byte and .word directives shall accept a comma‑separated list of values.
@@ -60,23 +62,72 @@
  *          • -v for verbose output (symbol table and memory usage).
  *          • -d for debug messages.
  *          • -o <filename> to specify an alternate binary output file.
+ *          • -c to write a relocatable object file (.o) for the z16ld linker instead of a binary.
+ *          • -O to remove redundant instructions with a peephole pass (see Peephole Optimizer).
+ *          • -j <threads> to encode large programs on that many threads in pass 2
+ *            (default: the number of online CPUs).
+ *          • --one-pass to assemble in a single pass: each line is encoded as it is read and
+ *            forward label references are backpatched when the label is defined.
+ *          • --cache to reuse the code of unchanged chunks from the previous build (kept in
+ *            <source>.z16c); --verify-cache also checks every reused chunk against a full rebuild.
+ *          • --relax-scratch <reg> for the register that the long forms of out-of-range branches,
+ *            j and jal load their target into (default t1; see Branch Relaxation). The listing
+ *            marks every such site with the register it clobbers.
+ *          • --format seg to write only the used segments of memory (.img), or --format hex
+ *            to write Intel HEX (.hex), instead of the whole image (see Dump Binary).
+ *          • -g to also write <output>.dbg, the symbol table and address-to-line table that z16sim
+ *            uses to show "label+offset (file:line)" (see Debug Information).
+ *          • -MD to also write a make rule (<output>.d) listing the source and its included files.
+ *          • --report to print the size, instruction mix and estimated cycles of each function
+ *            (see Code Size Report); --latency R=1,L=3,... sets the cycles of each class.
+ *          • --profile <file> to reorder the basic blocks of each function so that the paths that
+ *            ran most in "z16sim --profile <file>" fall through (see Profile-Guided Layout).
+ *          • --batch <directory|manifest> to assemble every source in a directory (or listed in a
+ *            manifest) in one process on -j threads, with a summary of errors and timings.
  *
  *   8. Error Handling:
  *      - The assembler shall detect and report errors (e.g., undefined or duplicate labels, 
  *        invalid instructions, missing operands, and out‑of‑range immediates) with clear messages.
+ *      - Branches and jumps that cannot reach their label are not errors: they are relaxed into
+ *        the shortest longer sequence that does (see Branch Relaxation); -v reports how many.
+ *
+ *   9. Library Use:
+ *      - Built with -DZ16ASM_LIBRARY (the z16asmlib target), this file provides z16Assemble()
+ *        (z16asm.h), which assembles a source held in memory into an image and returns errors
+ *        instead of exiting, and z16AssembleFile(), which writes the usual output files and
+ *        times each phase (bench/z16bench). All assembler state lives in one Assembler per call.
  *
  */
-
-
+ 
+ 
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
  #include <ctype.h>
  #include <stdint.h>
+ #include <stdarg.h>
+ #include <errno.h>
+ #include <setjmp.h>
+ #include <time.h>
+ #include "z16asm.h"
+ #ifndef _WIN32
+ #include <pthread.h>
+ #include <stdatomic.h>
+ #include <fcntl.h>
+ #include <unistd.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <dirent.h>
+ #include <sys/resource.h>
+ #endif
+ #if defined(__AVX2__)
+ #include <immintrin.h>
+ #elif defined(__SSE2__)
+ #include <emmintrin.h>
+ #endif
  
  #define MAX_LINE_LENGTH 256
  #define MAX_LABEL_LENGTH 64
- #define MAX_LINES 2048
  // Total memory is 64KB
  #define MEM_SIZE 65536
  
@@ -85,13 +136,13 @@
  // -----------------------
  
  // Convert a string in-place to lower-case.
- void toLowerStr(char *str) {
+ static void toLowerStr(char *str) {
      for (; *str; str++)
          *str = tolower((unsigned char)*str);
  }
  
  // Compare two strings case-insensitively.
- int cmpIgnoreCase(const char* s1, const char* s2) {
+ static int cmpIgnoreCase(const char* s1, const char* s2) {
      while(*s1 && *s2) {
           char c1 = tolower((unsigned char)*s1);
           char c2 = tolower((unsigned char)*s2);
@@ -103,77 +154,441 @@
      return tolower((unsigned char)*s1) - tolower((unsigned char)*s2);
  }
  
- // Trim whitespace from both ends of a string.
- void trim(char *s) {
-     char *p = s;
-     while(isspace((unsigned char)*p)) p++;
-     if(p != s) memmove(s, p, strlen(p) + 1);
-     char *end = s + strlen(s) - 1;
-     while(end >= s && isspace((unsigned char)*end)) {
-         *end = '\0';
-         end--;
+ // A view of source text: a pointer into the source buffer and a length. Views are not
+ // NUL-terminated and are printed with "%.*s"; parsing works on them directly, without copies.
+ typedef struct {
+     const char *ptr;
+     int len;
+ } View;
+ 
+ static View makeView(const char *begin, const char *end) {
+     View v = { begin, (int)(end - begin) };
+     return v;
+ }
+ 
+ // Trim whitespace from both ends of a view.
+ static View trimView(View v) {
+     while(v.len > 0 && isspace((unsigned char)v.ptr[0])) { v.ptr++; v.len--; }
+     while(v.len > 0 && isspace((unsigned char)v.ptr[v.len-1])) v.len--;
+     return v;
+ }
+ 
+ // Split the next field off 'rest' (like strtok): delimiters are skipped, then the field runs up
+ // to the next delimiter. Returns 0 when no field is left.
+ static int nextField(View *rest, const char *delims, View *field) {
+     const char *p = rest->ptr, *end = rest->ptr + rest->len;
+     while(p < end && strchr(delims, *p)) p++;
+     if(p == end) {
+         *rest = makeView(end, end);
+         return 0;
      }
+     const char *q = p;
+     while(q < end && !strchr(delims, *q)) q++;
+     *field = makeView(p, q);
+     *rest = makeView(q, end);
+     return 1;
  }
  
  // Count comma-separated values in a directive operand string.
- int countValues(const char *operands) {
+ static int countValues(View operands) {
      int count = 0;
-     char temp[MAX_LINE_LENGTH];
-     strncpy(temp, operands, MAX_LINE_LENGTH);
-     char *token = strtok(temp, ",");
-     while(token != NULL) {
+     View field;
+     while(nextField(&operands, ",", &field))
          count++;
-         token = strtok(NULL, ",");
-     }
      return count;
  }
  
+ // Parse an integer like strtol(): leading whitespace, an optional sign, and with base 0 a
+ // "0x" (hex) or "0" (octal) prefix. Parsing stops at the first character that is not a digit.
+ static long parseNumber(View v, int base) {
+     const char *p = v.ptr, *end = v.ptr + v.len;
+     while(p < end && isspace((unsigned char)*p)) p++;
+     int neg = 0;
+     if(p < end && (*p == '+' || *p == '-')) {
+         neg = (*p == '-');
+         p++;
+     }
+     if((base == 0 || base == 16) && end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') &&
+        isxdigit((unsigned char)p[2])) {
+         base = 16;
+         p += 2;
+     } else if(base == 0) {
+         base = (p < end && *p == '0') ? 8 : 10;
+     }
+     long value = 0;
+     for (; p < end; p++) {
+         int c = tolower((unsigned char)*p);
+         int d = isdigit(c) ? c - '0' : (c >= 'a' && c <= 'z') ? c - 'a' + 10 : 99;
+         if(d >= base)
+             break;
+         value = value * base + d;
+     }
+     return neg ? -value : value;
+ }
+ 
+ // Wall-clock time in seconds (for -d timings, which may span several threads).
+ static double nowSeconds(void) {
+     struct timespec ts;
+     timespec_get(&ts, TIME_UTC);
+     return ts.tv_sec + ts.tv_nsec * 1e-9;
+ }
+ 
+ // Errors found while encoding. A parallel pass-2 worker installs an EncodeAbort so that an
+ // error abandons its chunk instead of exiting; the earliest one is reported after all chunks.
+ typedef struct {
+     jmp_buf jump;
+     char message[256];
+ } EncodeAbort;
+ 
+ static _Thread_local EncodeAbort *encodeAbort = NULL;
+ 
+ // Name of the included file the current line comes from (NULL for the main source); errors
+ // are prefixed with it.
+ static _Thread_local const char *errorSource = NULL;
+ 
+ static void encodeError(const char *fmt, ...) {
+     va_list ap;
+     va_start(ap, fmt);
+     if(encodeAbort) {
+         int n = errorSource ? snprintf(encodeAbort->message, sizeof(encodeAbort->message), "%s: ", errorSource) : 0;
+         vsnprintf(encodeAbort->message + n, sizeof(encodeAbort->message) - n, fmt, ap);
+         va_end(ap);
+         longjmp(encodeAbort->jump, 1);
+     }
+     if(errorSource)
+         fprintf(stderr, "%s: ", errorSource);
+     vfprintf(stderr, fmt, ap);
+     va_end(ap);
+     exit(1);
+ }
+ 
+ // Create an output file. Failing to is an error like any other: in library use the message is
+ // returned, so one unwritable output does not end a whole --batch run.
+ static FILE *openOutput(const char *filename, const char *mode, const char *what) {
+     FILE *fp = fopen(filename, mode);
+     if(!fp) {
+         errorSource = NULL;
+         encodeError("Error opening %s %s for writing: %s\n", what, filename, strerror(errno));
+     }
+     return fp;
+ }
+ 
  // -----------------------
- // Symbol Table Structures and Functions
+ // Arena Allocation
+ // -----------------------
+ 
+ // A bump-pointer arena: allocations are carved out of large blocks and released all at once.
+ // Each new block is twice the size of the previous one (up to ARENA_MAX_BLOCK), so even very
+ // large sources need only a handful of malloc calls.
+ typedef struct ArenaBlock {
+     struct ArenaBlock *next;
+     size_t used;
+     size_t size;
+     char data[];
+ } ArenaBlock;
+ 
+ typedef struct {
+     ArenaBlock *head;
+ } Arena;
+ 
+ #define ARENA_BLOCK_SIZE (64 * 1024)
+ #define ARENA_MAX_BLOCK (16 * 1024 * 1024)
+ 
+ static void *arenaAlloc(Arena *a, size_t n) {
+     n = (n + 7) & ~(size_t)7;
+     if(!a->head || a->head->used + n > a->head->size) {
+         size_t size = a->head ? a->head->size * 2 : ARENA_BLOCK_SIZE;
+         if(size > ARENA_MAX_BLOCK) size = ARENA_MAX_BLOCK;
+         if(size < n) size = n;
+         ArenaBlock *b = (ArenaBlock *)malloc(sizeof(ArenaBlock) + size);
+         if(!b) { perror("malloc"); exit(1); }
+         b->next = a->head;
+         b->used = 0;
+         b->size = size;
+         a->head = b;
+     }
+     void *p = a->head->data + a->head->used;
+     a->head->used += n;
+     return p;
+ }
+ 
+ static char *arenaStrndup(Arena *a, const char *s, size_t len) {
+     char *p = (char *)arenaAlloc(a, len + 1);
+     memcpy(p, s, len);
+     p[len] = '\0';
+     return p;
+ }
+ 
+ static void arenaFree(Arena *a) {
+     while(a->head) {
+         ArenaBlock *b = a->head;
+         a->head = b->next;
+         free(b);
+     }
+ }
+ 
+ #ifndef Z16ASM_LIBRARY
+ // Drop every allocation but keep the newest (largest) block for reuse.
+ static void arenaReset(Arena *a) {
+     ArenaBlock *keep = a->head;
+     if(!keep)
+         return;
+     a->head = keep->next;
+     arenaFree(a);
+     keep->next = NULL;
+     keep->used = 0;
+     a->head = keep;
+ }
+ #endif
+ 
+ // -----------------------
+ // Assembler State
  // -----------------------
  
  typedef enum { SECTION_NONE, SECTION_TEXT, SECTION_DATA } Section;
  
+ // A source file in memory (see openSource).
+ typedef struct {
+     const char *data;
+     size_t size;
+     int mapped;
+ } SourceFile;
+ 
+ // Everything one assembly builds up lives in an Assembler, so that several assemblies can run
+ // at once (see z16Assemble). 'as' is the assembly the current thread works on; the pass-2
+ // workers of an assembly point it at the same one.
+ typedef struct Assembler {
+     // Options
+     int onePass;
+     int objectMode;                  // -c
+     int optimize;                    // -O
+     int encodeThreads;               // -j
+     int outputFormat;                // OutputFormat (--format)
+     int debugInfo;                   // -g
+     char *cacheFilename;             // --cache
+     int verifyCache;
+     int quiet;                       // --batch: no "file generated" messages
+     int relaxScratch;                // --relax-scratch: register of the long relaxed forms
+ 
+     // Symbol table: the Symbol records and their names are carved out of symbolArena and
+     // indexed by an open-addressing hash table (linear probing) over the case-folded names.
+     struct Symbol *symbolTable;
+     struct Symbol **symbolSlots;
+     unsigned symbolSlotCount;        // always a power of two
+     unsigned symbolCount;
+     Arena symbolArena;
+     int recordSymbolUses;
+ 
+     // Line records and their code words are carved out of lineArena and released together;
+     // 'lines' is a growable array of pointers to them in source order.
+     struct Line **lines;
+     int lineCount;
+     int lineCapacity;
+     Arena lineArena;
+ 
+     // Location counters and section tracking
+     int loc_text;                    // text section location counter (in bytes)
+     int loc_data;                    // data section location counter (in bytes)
+     Section currentSection;
+     int currentFile;                 // source of the lines being read
+ 
+     // Source files and macros
+     struct Source *sources;
+     int sourceCount;
+     int scatteredLines;              // some lines come from included files or macro expansions
+     Arena sourceArena;               // expanded macro text, kept for the listing
+     struct Macro *macros;
+     struct Macro *defining;          // macro whose body is being read
+     int definingDepth;               // .macro lines nested inside that body
+     int expansionCount;              // for "\@"
+     void (*placeLine)(struct Line *line);
+ 
+     // One-pass fixups
+     struct Fixup *freeFixups;
+     struct Fixup *lineFixups;        // fixups recorded by the line being encoded
+     int pendingFixups;
+     Arena fixupArena;
+     struct Listing *streamListing;
+     int streamText, streamData;
+ 
+     // Peephole optimizer and branch relaxation
+     int peepholeRemoved, peepholeRewritten;
+     int textInstructions;            // instructions in .text before -O
+     int relaxedSites;                // branches and jumps expanded by the last relaxation
+     int relaxedBytes;
+     int relaxRounds;
+     int loadSites;                   // li/la lines in .text
+     int loadsExpanded;               // ... that take two words
+ 
+     // Pass 2
+     int encodeThreadsUsed;           // threads the last pass 2 ran on
+     struct EncodeWorker *encodeWorkers;
+     int encodeWorkerCount;
+     struct EncodeChunk *encodeChunks;
+     int encodeChunkCount;
+ #ifndef _WIN32
+     atomic_int nextEncodeChunk;
+ #endif
+ 
+     // Output
+     struct Image *memoryImage;
+     struct DebugLine *debugLines;
+     int debugLineCount, debugLineCapacity;
+ 
+     // Incremental assembly cache
+     SourceFile cacheFile;
+     struct Symbol **cacheSymbols;    // per cached symbol: the current one, NULL if it moved
+     uint32_t cacheSymbolCount;
+     struct CacheEntry *cacheEntries; // chunk records in file order
+     uint32_t cacheFileChunks;
+     uint32_t cacheNext;              // entry after the last one found
+     uint32_t *cacheSlots;            // entry index + 1 by key (open addressing), 0 if empty
+     unsigned cacheSlotCount;
+     int cacheChunks, cacheHits;
+     int cacheLines, cacheLinesEncoded;
+ } Assembler;
+ 
+ static _Thread_local Assembler *as = NULL;
+ 
+ // -----------------------
+ // Symbol Table Structures and Functions
+ // -----------------------
+ 
+ struct Fixup;
+ 
  typedef struct Symbol {
-     char name[MAX_LABEL_LENGTH]; // stored in lower-case
+     char *name;                  // stored in lower-case, in the symbol name arena
      int address;                 // address where the label is defined
      Section section;             // TEXT or DATA
-     struct Symbol *next;         // chaining
+     uint32_t hash;               // hash of the lower-case name
+     int defined;                 // 0 while only forward references exist (one-pass mode)
+     int global;                  // named by .globl (exported from a -c object)
+     int index;                   // position in the symbol table of a -c object or the cache
+     struct Fixup *fixups;        // forward references waiting for the definition
+     struct Symbol *next;         // chaining, newest first (for listing the table)
  } Symbol;
  
- Symbol *symbolTable = NULL;
+ // FNV-1a over the lower-case characters of the first 'len' bytes of name.
+ static uint32_t hashName(const char *name, size_t len) {
+     uint32_t h = 2166136261u;
+     for (size_t i = 0; i < len; i++) {
+         h ^= (unsigned char)tolower((unsigned char)name[i]);
+         h *= 16777619u;
+     }
+     return h;
+ }
+ 
+ // Compare a stored lower-case name with the first 'len' bytes of name, ignoring case.
+ static int lowerNameEquals(const char *lower, const char *name, size_t len) {
+     for (size_t i = 0; i < len; i++)
+         if(lower[i] != tolower((unsigned char)name[i]))
+             return 0;
+     return lower[len] == '\0';
+ }
  
- // Add a symbol to the symbol table (the name is stored in lower-case).
- int addSymbol(const char *name, int address, Section sec) {
-     Symbol *cur = symbolTable;
-     while(cur) {
-         if(cmpIgnoreCase(cur->name, name) == 0) {
-             fprintf(stderr, "Error: Duplicate label '%s'\n", name);
-             return -1;
+ // Returns the slot holding 'name' (case-insensitive), or the empty slot where it would go.
+ static Symbol **symbolSlot(const char *name, size_t len, uint32_t hash) {
+     unsigned mask = as->symbolSlotCount - 1;
+     for (unsigned i = hash & mask; ; i = (i + 1) & mask) {
+         Symbol *sym = as->symbolSlots[i];
+         if(!sym)
+             return &as->symbolSlots[i];
+         if(sym->hash == hash && lowerNameEquals(sym->name, name, len))
+             return &as->symbolSlots[i];
+     }
+ }
+ 
+ static void growSymbolSlots(void) {
+     Symbol **old = as->symbolSlots;
+     unsigned oldCount = as->symbolSlotCount;
+     as->symbolSlotCount = oldCount ? oldCount * 2 : 256;
+     as->symbolSlots = (Symbol **)calloc(as->symbolSlotCount, sizeof(Symbol *));
+     if(!as->symbolSlots) { perror("calloc"); exit(1); }
+     for (unsigned i = 0; i < oldCount; i++) {
+         if(old[i]) {
+             unsigned mask = as->symbolSlotCount - 1, j = old[i]->hash & mask;
+             while(as->symbolSlots[j]) j = (j + 1) & mask;
+             as->symbolSlots[j] = old[i];
          }
-         cur = cur->next;
      }
-     Symbol *newSym = (Symbol *)malloc(sizeof(Symbol));
-     if(!newSym) { perror("malloc"); exit(1); }
-     strncpy(newSym->name, name, MAX_LABEL_LENGTH);
-     newSym->name[MAX_LABEL_LENGTH-1] = '\0';
+     free(old);
+ }
+ 
+ // Return the symbol for 'name', creating an undefined one if it is not in the table yet.
+ static Symbol *internSymbol(View name) {
+     if((as->symbolCount + 1) * 4 > as->symbolSlotCount * 3)
+         growSymbolSlots();
+     size_t len = (size_t)name.len;
+     uint32_t hash = hashName(name.ptr, len);
+     Symbol **slot = symbolSlot(name.ptr, len, hash);
+     if(*slot)
+         return *slot;
+     Symbol *newSym = (Symbol *)arenaAlloc(&as->symbolArena, sizeof(Symbol));
+     newSym->name = arenaStrndup(&as->symbolArena, name.ptr, len);
      toLowerStr(newSym->name);
-     newSym->address = address;
-     newSym->section = sec;
-     newSym->next = symbolTable;
-     symbolTable = newSym;
+     newSym->address = 0;
+     newSym->section = SECTION_NONE;
+     newSym->hash = hash;
+     newSym->defined = 0;
+     newSym->global = 0;
+     newSym->index = -1;
+     newSym->fixups = NULL;
+     newSym->next = NULL;
+     *slot = newSym;
+     as->symbolCount++;
+     return newSym;
+ }
+ 
+ // Add a symbol to the symbol table (the name is stored in lower-case).
+ static int addSymbol(View name, int address, Section sec) {
+     Symbol *sym = internSymbol(name);
+     if(sym->defined)
+         return -1;
+     sym->address = address;
+     sym->section = sec;
+     sym->defined = 1;
+     sym->next = as->symbolTable;
+     as->symbolTable = sym;
      return 0;
  }
  
- // Lookup a symbol by name (case-insensitive).
- Symbol* findSymbol(const char *name) {
-     Symbol *cur = symbolTable;
-     while(cur) {
-         if(cmpIgnoreCase(cur->name, name) == 0)
-             return cur;
-         cur = cur->next;
+ // Lookup a defined symbol by name (case-insensitive).
+ static Symbol* findSymbol(View name) {
+     if(as->symbolCount == 0)
+         return NULL;
+     Symbol *sym = *symbolSlot(name.ptr, (size_t)name.len, hashName(name.ptr, (size_t)name.len));
+     return (sym && sym->defined) ? sym : NULL;
+ }
+ 
+ // With --cache, the symbols resolved while encoding a chunk are recorded, so a cached chunk
+ // is only reused while all of them keep their addresses (see Incremental Assembly Cache).
+ typedef struct {
+     Symbol **items;
+     int count;
+     int capacity;
+ } SymbolList;
+ 
+ static _Thread_local SymbolList *symbolUses = NULL;
+ 
+ static void noteSymbolUse(Symbol *sym) {
+     SymbolList *list = symbolUses;
+     if(list->count && list->items[list->count - 1] == sym)
+         return;
+     if(list->count == list->capacity) {
+         list->capacity = list->capacity ? list->capacity * 2 : 8;
+         list->items = (Symbol **)realloc(list->items, list->capacity * sizeof(Symbol *));
+         if(!list->items) { perror("realloc"); exit(1); }
      }
-     return NULL;
+     list->items[list->count++] = sym;
+ }
+ 
+ // Release the whole symbol table.
+ static void freeSymbols(void) {
+     free(as->symbolSlots);
+     as->symbolSlots = NULL;
+     as->symbolSlotCount = as->symbolCount = 0;
+     as->symbolTable = NULL;
+     arenaFree(&as->symbolArena);
  }
  
  // -----------------------
@@ -190,7 +605,7 @@
      int funct4;        // funct4 field for R-type instructions
  } InstructionDef;
  
- InstructionDef instructionSet[] = {
+ static InstructionDef instructionSet[] = {
      {"add",   INST_R, 0, 0, 0x0},
      {"sub",   INST_R, 0, 0, 0x1},
      {"slt",   INST_R, 0, 1, 0x0},
@@ -200,9 +615,9 @@
      {"sra",   INST_R, 0, 3, 0x8},
      {"or",    INST_R, 0, 4, 0x1},
      {"and",   INST_R, 0, 5, 0x0},
-     {"xor",   INST_R, 0, 6, 0x4},
-     {"mv",    INST_R, 0, 7, 0x8},
-     {"jr",    INST_R, 0, 7, 0x0},
+     {"xor",   INST_R, 0, 6, 0x0},
+     {"mv",    INST_R, 0, 7, 0x0},
+     {"jr",    INST_R, 0, 0, 0x4},
      {"jalr",  INST_R, 0, 0, 0x8},
      {"addi",  INST_I, 1, 0, 0},
      {"slti",  INST_I, 1, 1, 0},
@@ -222,26 +637,174 @@
      {"bge",   INST_B, 2, 5, 0},
      {"bltu",  INST_B, 2, 6, 0},
      {"bgeu",  INST_B, 2, 7, 0},
-     {"lb",    INST_L, 3, 0, 0},
-     {"lw",    INST_L, 3, 2, 0},
-     {"lbu",   INST_L, 3, 4, 0},
-     {"sb",    INST_L, 3, 0, 0},
-     {"sw",    INST_L, 3, 2, 0},
+     {"lb",    INST_L, 4, 0, 0},
+     {"lw",    INST_L, 4, 1, 0},
+     {"lbu",   INST_L, 4, 4, 0},
+     {"sb",    INST_L, 3, 0, 0},     // stores: opcode 3
+     {"sw",    INST_L, 3, 1, 0},
      {"j",     INST_J, 5, 0, 0},
      {"jal",   INST_J, 5, 0, 0},
      {"lui",   INST_U, 6, 0, 0},
      {"auipc", INST_U, 6, 0, 0},
      {"ecall", INST_S, 7, 0, 0},
+     {"la",    INST_I, 1, 7, 0},     // li of a label address
      {NULL, 0, 0, 0, 0} // end marker
  };
  
- // Lookup instruction definition (case-insensitive).
- InstructionDef* lookupInstruction(const char *mnemonic) {
-     for (int i = 0; instructionSet[i].mnemonic != NULL; i++) {
-         if (cmpIgnoreCase(mnemonic, instructionSet[i].mnemonic) == 0)
-             return &instructionSet[i];
+ // -----------------------
+ // Keyword Classification
+ // -----------------------
+ //
+ // Every mnemonic, directive and register name is found with a single probe of a perfect hash.
+ // A keyword (at most 8 characters) is packed lower-case into a 64-bit integer, one byte per
+ // character; multiplying by KEYWORD_SEED and keeping the top 8 bits gives its slot in
+ // keywordSlots, which holds an index into keywords[]. Comparing the packed key confirms the hit.
+ // buildKeywordSlots fills the slots from keywords[] once, before the first assembly, and stops
+ // the program if two keywords share a slot: after adding a keyword, choose a new seed if it does.
+ 
+ typedef enum { KW_NONE, KW_INSTRUCTION, KW_DIRECTIVE, KW_REGISTER } KeywordKind;
+ 
+ typedef enum { DIR_TEXT, DIR_DATA, DIR_ORG, DIR_ASCIIZ, DIR_BYTE, DIR_WORD, DIR_SPACE, DIR_GLOBL,
+                DIR_EQU, DIR_INCLUDE, DIR_MACRO, DIR_ENDM } Directive;
+ 
+ typedef struct {
+     const char *name;
+     KeywordKind kind;
+     int value;         // instructionSet index, Directive, or register number
+ } Keyword;
+ 
+ #define KEYWORD_SEED 0x406FEDE0DC7FF95DULL
+ 
+ static const Keyword keywords[] = {
+     {NULL, KW_NONE, 0},               // slot value 0 means "not a keyword"
+     {"add",     KW_INSTRUCTION, 0},
+     {"sub",     KW_INSTRUCTION, 1},
+     {"slt",     KW_INSTRUCTION, 2},
+     {"sltu",    KW_INSTRUCTION, 3},
+     {"sll",     KW_INSTRUCTION, 4},
+     {"srl",     KW_INSTRUCTION, 5},
+     {"sra",     KW_INSTRUCTION, 6},
+     {"or",      KW_INSTRUCTION, 7},
+     {"and",     KW_INSTRUCTION, 8},
+     {"xor",     KW_INSTRUCTION, 9},
+     {"mv",      KW_INSTRUCTION, 10},
+     {"jr",      KW_INSTRUCTION, 11},
+     {"jalr",    KW_INSTRUCTION, 12},
+     {"addi",    KW_INSTRUCTION, 13},
+     {"slti",    KW_INSTRUCTION, 14},
+     {"sltui",   KW_INSTRUCTION, 15},
+     {"slli",    KW_INSTRUCTION, 16},
+     {"srli",    KW_INSTRUCTION, 17},
+     {"srai",    KW_INSTRUCTION, 18},
+     {"ori",     KW_INSTRUCTION, 19},
+     {"andi",    KW_INSTRUCTION, 20},
+     {"xori",    KW_INSTRUCTION, 21},
+     {"li",      KW_INSTRUCTION, 22},
+     {"beq",     KW_INSTRUCTION, 23},
+     {"bne",     KW_INSTRUCTION, 24},
+     {"bz",      KW_INSTRUCTION, 25},
+     {"bnz",     KW_INSTRUCTION, 26},
+     {"blt",     KW_INSTRUCTION, 27},
+     {"bge",     KW_INSTRUCTION, 28},
+     {"bltu",    KW_INSTRUCTION, 29},
+     {"bgeu",    KW_INSTRUCTION, 30},
+     {"lb",      KW_INSTRUCTION, 31},
+     {"lw",      KW_INSTRUCTION, 32},
+     {"lbu",     KW_INSTRUCTION, 33},
+     {"sb",      KW_INSTRUCTION, 34},
+     {"sw",      KW_INSTRUCTION, 35},
+     {"j",       KW_INSTRUCTION, 36},
+     {"jal",     KW_INSTRUCTION, 37},
+     {"lui",     KW_INSTRUCTION, 38},
+     {"auipc",   KW_INSTRUCTION, 39},
+     {"ecall",   KW_INSTRUCTION, 40},
+     {"la",      KW_INSTRUCTION, 41},
+     {".text",   KW_DIRECTIVE,   DIR_TEXT},
+     {".data",   KW_DIRECTIVE,   DIR_DATA},
+     {".org",    KW_DIRECTIVE,   DIR_ORG},
+     {".asciiz", KW_DIRECTIVE,   DIR_ASCIIZ},
+     {".byte",   KW_DIRECTIVE,   DIR_BYTE},
+     {".word",   KW_DIRECTIVE,   DIR_WORD},
+     {".space",  KW_DIRECTIVE,   DIR_SPACE},
+     {".globl",  KW_DIRECTIVE,   DIR_GLOBL},
+     {".equ",    KW_DIRECTIVE,   DIR_EQU},
+     {".include", KW_DIRECTIVE,  DIR_INCLUDE},
+     {".macro",  KW_DIRECTIVE,   DIR_MACRO},
+     {".endm",   KW_DIRECTIVE,   DIR_ENDM},
+     {"x0",      KW_REGISTER,    0},
+     {"x1",      KW_REGISTER,    1},
+     {"x2",      KW_REGISTER,    2},
+     {"x3",      KW_REGISTER,    3},
+     {"x4",      KW_REGISTER,    4},
+     {"x5",      KW_REGISTER,    5},
+     {"x6",      KW_REGISTER,    6},
+     {"x7",      KW_REGISTER,    7},
+     {"t0",      KW_REGISTER,    0},
+     {"ra",      KW_REGISTER,    1},
+     {"sp",      KW_REGISTER,    2},
+     {"s0",      KW_REGISTER,    3},
+     {"s1",      KW_REGISTER,    4},
+     {"t1",      KW_REGISTER,    5},
+     {"a0",      KW_REGISTER,    6},
+     {"a1",      KW_REGISTER,    7},
+ };
+ 
+ #define KEYWORD_COUNT ((int)(sizeof(keywords) / sizeof(keywords[0])))
+ 
+ static uint8_t keywordSlots[256];            // slot -> keywords[] index, 0 if empty
+ static uint64_t keywordKeys[KEYWORD_COUNT];  // packed name of each keyword
+ 
+ // Pack a token into its keyword key; returns 0 if it is too long to be a keyword.
+ static uint64_t packKeyword(View token) {
+     if(token.len > 8)
+         return 0;
+     uint64_t key = 0;
+     for (int i = 0; i < token.len; i++)
+         key |= (uint64_t)(unsigned char)tolower((unsigned char)token.ptr[i]) << (8 * i);
+     return key;
+ }
+ 
+ // Classify a token (case-insensitive). Returns NULL if it is not a keyword.
+ static const Keyword *lookupKeyword(View token) {
+     uint64_t key = packKeyword(token);
+     if(key == 0)
+         return NULL;
+     int index = keywordSlots[(key * KEYWORD_SEED) >> 56];
+     return (keywordKeys[index] == key) ? &keywords[index] : NULL;
+ }
+ 
+ static void buildKeywordSlots(void) {
+     for (int i = 1; i < KEYWORD_COUNT; i++) {
+         View name = { keywords[i].name, (int)strlen(keywords[i].name) };
+         uint64_t key = packKeyword(name);
+         int slot = (int)((key * KEYWORD_SEED) >> 56);
+         if(key == 0 || keywordSlots[slot] != 0) {
+             fprintf(stderr, "Internal error: keyword '%s' collides in the keyword hash table\n", keywords[i].name);
+             abort();
+         }
+         keywordKeys[i] = key;
+         keywordSlots[slot] = (uint8_t)i;
      }
-     return NULL;
+ }
+ 
+ // Fill the keyword slots on first use; assemblies on other threads wait for it.
+ static void initKeywords(void) {
+ #ifndef _WIN32
+     static pthread_once_t once = PTHREAD_ONCE_INIT;
+     pthread_once(&once, buildKeywordSlots);
+ #else
+     static int built = 0;
+     if(!built) {
+         buildKeywordSlots();
+         built = 1;
+     }
+ #endif
+ }
+ 
+ // Lookup instruction definition (case-insensitive).
+ static InstructionDef* lookupInstruction(View mnemonic) {
+     const Keyword *kw = lookupKeyword(mnemonic);
+     return (kw && kw->kind == KW_INSTRUCTION) ? &instructionSet[kw->value] : NULL;
  }
  
  // -----------------------
@@ -249,57 +812,165 @@
  // -----------------------
  
  // Convert a register name (e.g. "X3" or "s0") to its register number.
- int parseRegister(const char *token) {
-     if(token[0]=='x' || token[0]=='X') {
-         int reg = atoi(token+1);
+ static int parseRegister(View token) {
+     const Keyword *kw = lookupKeyword(token);
+     if(kw && kw->kind == KW_REGISTER)
+         return kw->value;
+     if(token.len > 0 && (token.ptr[0]=='x' || token.ptr[0]=='X')) {
+         int reg = (int)parseNumber(makeView(token.ptr + 1, token.ptr + token.len), 10);
          if(reg < 0 || reg > 7) {
-             fprintf(stderr, "Error: Invalid register number '%s'\n", token);
-             exit(1);
+             encodeError("Error: Invalid register number '%.*s'\n", token.len, token.ptr);
          }
          return reg;
      }
-     if(cmpIgnoreCase(token, "t0") == 0) return 0;
-     if(cmpIgnoreCase(token, "ra") == 0) return 1;
-     if(cmpIgnoreCase(token, "sp") == 0) return 2;
-     if(cmpIgnoreCase(token, "s0") == 0) return 3;
-     if(cmpIgnoreCase(token, "s1") == 0) return 4;
-     if(cmpIgnoreCase(token, "t1") == 0) return 5;
-     if(cmpIgnoreCase(token, "a0") == 0) return 6;
-     if(cmpIgnoreCase(token, "a1") == 0) return 7;
-     fprintf(stderr, "Error: Unknown register '%s'\n", token);
-     exit(1);
+     encodeError("Error: Unknown register '%.*s'\n", token.len, token.ptr);
      return -1;
  }
  
  // Parse an immediate value. In addition to the standard C styles (decimal, octal, hex),
  // this function now also supports binary constants prefixed with "0b" or "0B", as well as %hi() and %lo() expressions.
- int parseImmediate(const char *token) {
-     if(strncmp(token, "%hi(", 4)==0) {
-         const char *p = token + 4;
-         char numberStr[64];
-         int i = 0;
-         while(*p && *p != ')') {
-             numberStr[i++] = *p++;
-         }
-         numberStr[i] = '\0';
-         int value = (int)strtol(numberStr, NULL, 0);
-         return value >> 7;
-     }
-     if(strncmp(token, "%lo(", 4)==0) {
-         const char *p = token + 4;
-         char numberStr[64];
-         int i = 0;
-         while(*p && *p != ')') {
-             numberStr[i++] = *p++;
-         }
-         numberStr[i] = '\0';
-         int value = (int)strtol(numberStr, NULL, 0);
-         return value & 0x7F;
+ static int parseImmediate(View token) {
+     const char *end = token.ptr + token.len;
+     if(token.len >= 4 && (strncmp(token.ptr, "%hi(", 4)==0 || strncmp(token.ptr, "%lo(", 4)==0)) {
+         const char *p = token.ptr + 4, *q = p;
+         while(q < end && *q != ')') q++;
+         int value = parseImmediate(trimView(makeView(p, q)));
+         return token.ptr[1] == 'h' ? value >> 7 : value & 0x7F;
+     }
+     // A name defined by .equ; any other name reads as 0, like text that is not a number.
+     if(token.len && (isalpha((unsigned char)token.ptr[0]) || token.ptr[0] == '_')) {
+         Symbol *sym = findSymbol(token);
+         if(!sym || sym->section != SECTION_NONE)
+             return 0;
+         if(symbolUses)
+             noteSymbolUse(sym);
+         return sym->address;
      }
      // Support binary constants with a "0b" or "0B" prefix.
-     if(token[0]=='0' && (token[1]=='b' || token[1]=='B'))
-         return (int)strtol(token+2, NULL, 2);
-     return (int)strtol(token, NULL, 0);
+     if(token.len >= 2 && token.ptr[0]=='0' && (token.ptr[1]=='b' || token.ptr[1]=='B'))
+         return (int)parseNumber(makeView(token.ptr + 2, end), 2);
+     return (int)parseNumber(token, 0);
+ }
+ 
+ // -----------------------
+ // Source Buffer and Line Scanner
+ // -----------------------
+ 
+ // The source file is mapped read-only (or read into one buffer where mmap is not available) and
+ // stays alive until the output files are written; every Line refers into it. Returns 0, or -1
+ // with errno set if the file cannot be read.
+ static int openSource(const char *filename, SourceFile *src) {
+     src->data = "";
+     src->size = 0;
+     src->mapped = 0;
+ #ifndef _WIN32
+     int fd = open(filename, O_RDONLY);
+     struct stat st;
+     if(fd < 0)
+         return -1;
+     if(fstat(fd, &st) != 0) {
+         int saved = errno;
+         close(fd);
+         errno = saved;
+         return -1;
+     }
+     if(st.st_size > 0) {
+         void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if(map != MAP_FAILED) {
+             madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+             src->data = (const char *)map;
+             src->size = (size_t)st.st_size;
+             src->mapped = 1;
+         }
+     }
+     close(fd);
+     if(src->mapped || st.st_size == 0)
+         return 0;
+ #endif
+     FILE *fp = fopen(filename, "rb");
+     if(!fp)
+         return -1;
+     size_t cap = 1 << 16, size = 0, n;
+     char *buf = (char *)malloc(cap);
+     while(buf && (n = fread(buf + size, 1, cap - size, fp)) > 0) {
+         size += n;
+         if(size == cap)
+             buf = (char *)realloc(buf, cap *= 2);
+     }
+     if(!buf) { perror("malloc"); exit(1); }
+     fclose(fp);
+     src->data = buf;
+     src->size = size;
+     return 0;
+ }
+ 
+ static void closeSource(SourceFile *src) {
+ #ifndef _WIN32
+     if(src->mapped)
+         munmap((void *)src->data, src->size);
+     else
+ #endif
+     if(src->size)
+         free((void *)src->data);
+     src->data = NULL;
+     src->size = 0;
+ }
+ 
+ // Delimiters of one source line, found in a single scan.
+ typedef struct {
+     const char *end;       // the terminating '\n' (or the end of the buffer)
+     const char *comment;   // the first '#' or ';' (or 'end')
+     const char *colon;     // the first ':' before the comment (or NULL)
+ } LineScan;
+ 
+ #if defined(__AVX2__)
+ #define SCAN_WIDTH 32
+ typedef __m256i ScanVec;
+ #define SCAN_LOAD(p)      _mm256_loadu_si256((const __m256i *)(p))
+ #define SCAN_SPLAT(c)     _mm256_set1_epi8(c)
+ #define SCAN_MASK(v, c)   (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, c))
+ #elif defined(__SSE2__)
+ #define SCAN_WIDTH 16
+ typedef __m128i ScanVec;
+ #define SCAN_LOAD(p)      _mm_loadu_si128((const __m128i *)(p))
+ #define SCAN_SPLAT(c)     _mm_set1_epi8(c)
+ #define SCAN_MASK(v, c)   (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, c))
+ #endif
+ 
+ // Scan the line starting at p for its newline, comment and label colon. The vector loop
+ // compares SCAN_WIDTH bytes at a time and never reads past 'limit'; the tail is scalar.
+ static void scanLine(const char *p, const char *limit, LineScan *ls) {
+     const char *comment = NULL, *colon = NULL;
+ #ifdef SCAN_WIDTH
+     const ScanVec nl = SCAN_SPLAT('\n'), hash = SCAN_SPLAT('#'), semi = SCAN_SPLAT(';'), col = SCAN_SPLAT(':');
+     for (; limit - p >= SCAN_WIDTH; p += SCAN_WIDTH) {
+         ScanVec v = SCAN_LOAD(p);
+         uint32_t nlMask = SCAN_MASK(v, nl);
+         // Only bytes before the newline belong to this line.
+         uint32_t live = nlMask ? (nlMask & (0u - nlMask)) - 1 : 0xFFFFFFFFu;
+         uint32_t m;
+         if(!comment && (m = (SCAN_MASK(v, hash) | SCAN_MASK(v, semi)) & live))
+             comment = p + __builtin_ctz(m);
+         if(!colon && (m = SCAN_MASK(v, col) & live))
+             colon = p + __builtin_ctz(m);
+         if(nlMask) {
+             p += __builtin_ctz(nlMask);
+             goto found;
+         }
+     }
+ #endif
+     for (; p < limit && *p != '\n'; p++) {
+         if(!comment && (*p == '#' || *p == ';'))
+             comment = p;
+         else if(!colon && *p == ':')
+             colon = p;
+     }
+ #ifdef SCAN_WIDTH
+ found:
+ #endif
+     ls->end = p;
+     ls->comment = comment ? comment : p;
+     ls->colon = (colon && colon < ls->comment) ? colon : NULL;
  }
  
  // -----------------------
@@ -308,532 +979,3721 @@
  
  // We add an extra field "elementSize" to indicate how many bytes each code element occupies.
  // For instructions and .word, elementSize = 2; for .byte and .asciiz, elementSize = 1.
- typedef struct {
-     int lineNo;                      // source line number
-     char original[MAX_LINE_LENGTH];  // original source text
+ // The text fields are views into the source buffer.
+ struct Reloc;
+ 
+ typedef struct Line {
+     int lineNo;                      // source line number (of the invocation, in a macro expansion)
+     int file;                        // index in sources[] (0 is the main source)
+     View original;                   // original source text (including its newline)
      int address;                     // computed address
      Section section;                 // TEXT or DATA
-     char *label;                     // label (if any)
-     char *mnemonic;                  // directive or instruction mnemonic (in lower-case)
-     char *operands;                  // operand string
+     View label;                      // label (if any)
+     View mnemonic;                   // directive or instruction mnemonic (len 0 if none)
+     const Keyword *keyword;          // classification of the mnemonic (NULL if unknown)
+     View operands;                   // operand string (len 0 if none)
      uint16_t *code;                  // array of code elements (each stored in 16 bits)
      int codeCount;                   // number of code elements
      int elementSize;                 // size in bytes for each code element (1 or 2)
+     int relax;                       // words added to a branch or jump by relaxation, or to li/la
+     struct Symbol *target;           // label of a branch, jump or la, once relaxation resolved it
+     int rewritten;                   // -O: 1 if the line was removed, 2 if replaced
+     struct Reloc *relocs;            // label references left to the linker (-c)
  } Line;
  
- Line *lines[MAX_LINES];
- int lineCount = 0;
- 
- // -----------------------
- // Global Location Counters and Section Tracking
- // -----------------------
- 
- int loc_text = 0;  // text section location counter (in bytes)
- int loc_data = 0;  // data section location counter (in bytes)
- Section currentSection = SECTION_NONE;
+ // Arena that encoded code words come from (each parallel pass-2 worker has its own).
+ static _Thread_local Arena *codeArena = NULL;
  
  // -----------------------
  // Source Line Parsing Functions
  // -----------------------
  
- Line* newLine(int lineNo, const char *src) {
-     Line *l = (Line *)malloc(sizeof(Line));
-     if(!l) { perror("malloc"); exit(1); }
+ static Line* newLine(int lineNo, View src) {
+     Line *l = (Line *)arenaAlloc(&as->lineArena, sizeof(Line));
+     memset(l, 0, sizeof(Line));
      l->lineNo = lineNo;
-     strncpy(l->original, src, MAX_LINE_LENGTH);
-     l->address = 0;
-     l->section = currentSection;
-     l->label = NULL;
-     l->mnemonic = NULL;
-     l->operands = NULL;
-     l->code = NULL;
-     l->codeCount = 0;
-     l->elementSize = 0;
+     l->file = as->currentFile;
+     l->original = src;
+     l->section = as->currentSection;
      return l;
  }
  
- void freeLine(Line *l) {
-     if(l) {
-         if(l->mnemonic) free(l->mnemonic);
-         if(l->operands) free(l->operands);
-         if(l->code) free(l->code);
-         free(l);
+ // Append a line to the line array, growing it geometrically.
+ static void appendLine(Line *l) {
+     if(as->lineCount == as->lineCapacity) {
+         as->lineCapacity = as->lineCapacity ? as->lineCapacity * 2 : 1024;
+         as->lines = (Line **)realloc(as->lines, as->lineCapacity * sizeof(Line *));
+         if(!as->lines) { perror("realloc"); exit(1); }
      }
+     as->lines[as->lineCount++] = l;
+ }
+ 
+ // Release every line at once.
+ static void freeLines(void) {
+     arenaFree(&as->lineArena);
+     free(as->lines);
+     as->lines = NULL;
+     as->lineCount = as->lineCapacity = 0;
  }
  
  // Parse a source line into label, mnemonic, and operands.
- // Comments (starting with '#' or ';') are removed and the mnemonic is converted to lower-case.
- void parseSourceLine(Line *line) {
-     char buffer[MAX_LINE_LENGTH];
-     strncpy(buffer, line->original, MAX_LINE_LENGTH);
-     char *com = strpbrk(buffer, "#;");
-     if(com) *com = '\0';
-     trim(buffer);
-     if(strlen(buffer) == 0)
-         return;
-     char *colon = strchr(buffer, ':');
-     if(colon) {
-         *colon = '\0';
-         trim(buffer);
-         line->label = strdup(buffer);
-         // addSymbol converts the label to lower-case.
-         if(addSymbol(line->label, (currentSection==SECTION_TEXT)? loc_text : loc_data, currentSection) != 0) {
-             fprintf(stderr, "Error on line %d: Duplicate label %s\n", line->lineNo, line->label);
-             exit(1);
-         }
-         char *rest = colon + 1;
-         trim(rest);
-         if(strlen(rest)==0)
-             return;
-         strcpy(buffer, rest);
-     }
-     char *token = strtok(buffer, " \t");
-     if(token) {
-         line->mnemonic = strdup(token);
-         toLowerStr(line->mnemonic);
-         char *ops = strtok(NULL, "\n");
-         if(ops) {
-             while(isspace((unsigned char)*ops)) ops++;
-             line->operands = strdup(ops);
-         }
+ // Comments (starting with '#' or ';') are dropped; the first ':' ends the label.
+ static void parseSourceLine(Line *line, const LineScan *ls) {
+     const char *p = line->original.ptr;
+     if(ls->colon) {
+         line->label = trimView(makeView(p, ls->colon));
+         p = ls->colon + 1;
      }
+     View code = trimView(makeView(p, ls->comment));
+     if(code.len == 0)
+         return;
+     const char *end = code.ptr + code.len, *q = code.ptr;
+     while(q < end && *q != ' ' && *q != '\t') q++;
+     line->mnemonic = makeView(code.ptr, q);
+     line->keyword = lookupKeyword(line->mnemonic);
+     if(q < end)
+         line->operands = trimView(makeView(q + 1, end));
+ }
+ 
+ // The directive named by a line's mnemonic, or -1 if it is not a known directive.
+ static int lineDirective(const Line *line) {
+     return (line->keyword && line->keyword->kind == KW_DIRECTIVE) ? line->keyword->value : -1;
+ }
+ 
+ // The instruction named by a line's mnemonic, or NULL.
+ static InstructionDef *lineInstruction(const Line *line) {
+     return (line->keyword && line->keyword->kind == KW_INSTRUCTION) ? &instructionSet[line->keyword->value] : NULL;
  }
  
  // -----------------------
- // Pass 1: Build Symbol Table and Assign Addresses
+ // Constant Loads (li, la)
  // -----------------------
  
- void pass1(FILE *fp) {
-     char srcLine[MAX_LINE_LENGTH];
-     int currentLineNo = 0;
-     while(fgets(srcLine, sizeof(srcLine), fp)) {
-         currentLineNo++;
-         Line *line = newLine(currentLineNo, srcLine);
-         parseSourceLine(line);
-         line->section = currentSection;
-         if(currentSection == SECTION_TEXT)
-             line->address = loc_text;
-         else if(currentSection == SECTION_DATA)
-             line->address = loc_data;
-         else
-             line->address = 0;
-         
-         if(line->mnemonic && line->mnemonic[0]=='.') {
-             if(cmpIgnoreCase(line->mnemonic, ".text") == 0) {
-                 currentSection = SECTION_TEXT;
-             } else if(cmpIgnoreCase(line->mnemonic, ".data") == 0) {
-                 currentSection = SECTION_DATA;
-             } else if(cmpIgnoreCase(line->mnemonic, ".org") == 0) {
-                 if(line->operands==NULL) {
-                     fprintf(stderr, "Error on line %d: .org missing operand\n", line->lineNo);
-                     exit(1);
-                 }
-                 int newOrg = (int)strtol(line->operands, NULL, 0);
-                 if(currentSection==SECTION_TEXT) {
-                     loc_text = newOrg;
-                     line->address = loc_text;
-                 } else if(currentSection==SECTION_DATA) {
-                     loc_data = newOrg;
-                     line->address = loc_data;
-                 }
-             } else if(cmpIgnoreCase(line->mnemonic, ".asciiz") == 0) {
-                 if(line->operands==NULL) {
-                     fprintf(stderr, "Error on line %d: .asciiz missing string operand\n", line->lineNo);
-                     exit(1);
-                 }
-                 char *s = line->operands;
-                 if(s[0]=='"' && s[strlen(s)-1]=='"') {
-                     s[strlen(s)-1] = '\0';
-                     s++;
-                 }
-                 int len = (int)strlen(s) + 1;
-                 line->elementSize = 1; // each character is a byte
-                 loc_data += len;
-             } else if(cmpIgnoreCase(line->mnemonic, ".byte") == 0) {
-                 if(line->operands==NULL) {
-                     fprintf(stderr, "Error on line %d: .byte missing operand\n", line->lineNo);
-                     exit(1);
-                 }
-                 int count = countValues(line->operands);
-                 line->elementSize = 1;
-                 loc_data += count;
-             } else if(cmpIgnoreCase(line->mnemonic, ".word") == 0) {
-                 if(line->operands==NULL) {
-                     fprintf(stderr, "Error on line %d: .word missing operand\n", line->lineNo);
-                     exit(1);
-                 }
-                 int count = countValues(line->operands);
-                 line->elementSize = 2;
-                 loc_data += count * 2;
-             } else if(cmpIgnoreCase(line->mnemonic, ".space") == 0) {
-                 if(line->operands==NULL) {
-                     fprintf(stderr, "Error on line %d: .space missing operand\n", line->lineNo);
-                     exit(1);
-                 }
-                 int spaceSize = (int)strtol(line->operands, NULL, 0);
-                 line->elementSize = 1;
-                 loc_data += spaceSize;
-             }
-         } else if(line->mnemonic) {
-             // For instructions, each produces 2 bytes.
-             if(currentSection==SECTION_TEXT) {
-                 line->elementSize = 2;
-                 loc_text += 2;
-             }
-         }
-         lines[lineCount++] = line;
-     }
-     rewind(fp);
+ // "li rd, value" and "la rd, label" load any 16-bit number or label address with the
+ // shortest sequence (see encodeLoad):
+ //   li rd, v                   v in -64..63
+ //   lui rd, v >> 7             the low 7 bits of v are zero
+ //   lui rd, hi; addi rd, lo    otherwise, with hi/lo split as for relaxed jumps
+ // A number is sized in pass 1. A label is sized once its address is known: by branch
+ // relaxation, which grows loads like branches, or when it is defined in one-pass mode. Where
+ // the address is not final (-c objects, forward references in one-pass mode), a label load
+ // takes the two-word form and is patched through FIX_HI and FIX_LO. "li rd, %lo(label)"
+ // remains a single I-type instruction.
+ 
+ // Returns 1 (number) or 2 (label) and the value operand if the line is an li or la in the
+ // text section, otherwise 0.
+ static int loadOperand(const Line *line, View *value) {
+     InstructionDef *inst = lineInstruction(line);
+     if(!inst || inst->type != INST_I || inst->funct3 != 7 || line->section != SECTION_TEXT)
+         return 0;
+     View ops = line->operands, token;
+     if(!nextField(&ops, ", \t", &token) || !nextField(&ops, ", \t", value))
+         return 0;
+     if(value->len >= 4 && strncmp(value->ptr, "%lo(", 4) == 0)
+         return 0;
+     if(!(isalpha((unsigned char)value->ptr[0]) || value->ptr[0] == '_'))
+         return 1;
+     // A name already defined by .equ is a number.
+     Symbol *sym = findSymbol(*value);
+     return (sym && sym->section == SECTION_NONE) ? 1 : 2;
+ }
+ 
+ // Words needed to load a 16-bit value.
+ static int loadWords(int value) {
+     int v = value & 0xFFFF, s = (int16_t)v;
+     return ((s >= -64 && s <= 63) || (v & 0x7F) == 0) ? 1 : 2;
  }
  
  // -----------------------
- // Pass 2: Encode Instructions and Process Data Directives
+ // Pass 1: Build Symbol Table and Assign Addresses
  // -----------------------
  
- void pass2() {
-     loc_text = 0;
-     loc_data = 0;
-     for (int i = 0; i < lineCount; i++) {
-         Line *line = lines[i];
-         if(line->mnemonic && line->mnemonic[0]=='.') {
-             if(cmpIgnoreCase(line->mnemonic, ".org") == 0) {
-                 if(currentSection == SECTION_TEXT && line->section==SECTION_TEXT)
-                     loc_text = line->address;
-                 else if(currentSection == SECTION_DATA && line->section==SECTION_DATA)
-                     loc_data = line->address;
-             } else if(cmpIgnoreCase(line->mnemonic, ".asciiz") == 0) {
-                 char *s = line->operands;
-                 if(s[0]=='"' && s[strlen(s)-1]=='"') {
-                     s[strlen(s)-1] = '\0';
-                     s++;
-                 }
-                 int len = (int)strlen(s) + 1;
-                 // For .asciiz, we allocate one 16-bit word per two characters.
-                 line->codeCount = (len + 1) / 2;
-                 line->code = (uint16_t *)malloc(line->codeCount * sizeof(uint16_t));
-                 // Pack characters into words (little-endian).
-                 for (int j = 0; j < line->codeCount; j++) {
-                     uint16_t word = 0;
-                     int index = j * 2;
-                     if(index < len)
-                         word |= ((unsigned char)s[index]);
-                     if(index+1 < len)
-                         word |= (((unsigned char)s[index+1]) << 8);
-                     line->code[j] = word;
-                 }
-                 loc_data += len;
-             } else if(cmpIgnoreCase(line->mnemonic, ".byte") == 0) {
-                 int count = countValues(line->operands);
-                 line->codeCount = count;
-                 line->code = (uint16_t *)malloc(count * sizeof(uint16_t));
-                 char *temp = strdup(line->operands);
-                 char *token = strtok(temp, ",");
-                 int idx = 0;
-                 while(token) {
-                     trim(token);
-                     int val = parseImmediate(token);
-                     line->code[idx++] = (uint16_t)(val & 0xFF);
-                     token = strtok(NULL, ",");
-                 }
-                 free(temp);
-                 loc_data += count;
-             } else if(cmpIgnoreCase(line->mnemonic, ".word") == 0) {
-                 int count = countValues(line->operands);
-                 line->codeCount = count;
-                 line->code = (uint16_t *)malloc(count * sizeof(uint16_t));
-                 char *temp = strdup(line->operands);
-                 char *token = strtok(temp, ",");
-                 int idx = 0;
-                 while(token) {
-                     trim(token);
-                     int val = parseImmediate(token);
-                     line->code[idx++] = (uint16_t)val;
-                     token = strtok(NULL, ",");
-                 }
-                 free(temp);
-                 loc_data += count * 2;
-             } else if(cmpIgnoreCase(line->mnemonic, ".space") == 0) {
-                 int size = (int)strtol(line->operands, NULL, 0);
-                 line->codeCount = 0; // no code produced
-                 loc_data += size;
-             } else if(cmpIgnoreCase(line->mnemonic, ".text") == 0 || cmpIgnoreCase(line->mnemonic, ".data") == 0) {
-                 if(cmpIgnoreCase(line->mnemonic, ".text") == 0)
-                     currentSection = SECTION_TEXT;
-                 else
-                     currentSection = SECTION_DATA;
+ // Define the label of a parsed line (if it has one) at the current location.
+ static void defineLabel(Line *line) {
+     if(!line->label.ptr)
+         return;
+     // addSymbol converts the label to lower-case.
+     if(addSymbol(line->label, (as->currentSection==SECTION_TEXT)? as->loc_text : as->loc_data, as->currentSection) != 0) {
+         encodeError("Error on line %d: Duplicate label %.*s\n", line->lineNo, line->label.len, line->label.ptr);
+     }
+ }
+ 
+ // Place a parsed line at the current location and advance the location counters.
+ static void assignAddress(Line *line) {
+     line->section = as->currentSection;
+     if(as->currentSection == SECTION_TEXT)
+         line->address = as->loc_text;
+     else if(as->currentSection == SECTION_DATA)
+         line->address = as->loc_data;
+     else
+         line->address = 0;
+ 
+     if(line->mnemonic.len && line->mnemonic.ptr[0]=='.') {
+         switch(lineDirective(line)) {
+         case DIR_TEXT:
+             as->currentSection = SECTION_TEXT;
+             break;
+         case DIR_DATA:
+             as->currentSection = SECTION_DATA;
+             break;
+         case DIR_ORG: {
+             if(line->operands.len == 0) {
+                 encodeError("Error on line %d: .org missing operand\n", line->lineNo);
              }
-             continue;
+             int newOrg = parseImmediate(line->operands);
+             if(as->currentSection==SECTION_TEXT) {
+                 as->loc_text = newOrg;
+                 line->address = as->loc_text;
+             } else if(as->currentSection==SECTION_DATA) {
+                 as->loc_data = newOrg;
+                 line->address = as->loc_data;
+             }
+             break;
          }
-         if(line->mnemonic) {
-             InstructionDef *inst = lookupInstruction(line->mnemonic);
-             if(!inst) {
-                 fprintf(stderr, "Error on line %d: Unknown mnemonic '%s'\n", line->lineNo, line->mnemonic);
-                 exit(1);
+         case DIR_ASCIIZ: {
+             if(line->operands.len == 0) {
+                 encodeError("Error on line %d: .asciiz missing string operand\n", line->lineNo);
              }
-             uint16_t machineWord = 0;
-             if(inst->type == INST_R) {
-                 char *ops = line->operands;
-                 if(!ops) {
-                     fprintf(stderr, "Error on line %d: Missing operands for '%s'\n", line->lineNo, line->mnemonic);
-                     exit(1);
-                 }
-                 char *token = strtok(ops, ", \t");
-                 if(!token) {
-                     fprintf(stderr, "Error on line %d: Expected register operand\n", line->lineNo);
-                     exit(1);
-                 }
-                 int reg1 = parseRegister(token);
-                 token = strtok(NULL, ", \t");
-                 if(!token) {
-                     fprintf(stderr, "Error on line %d: Expected second register operand\n", line->lineNo);
-                     exit(1);
-                 }
-                 int reg2 = parseRegister(token);
-                 machineWord |= (inst->funct4 & 0xF) << 12;
-                 machineWord |= (reg2 & 0x7) << 9;
-                 machineWord |= (reg1 & 0x7) << 6;
-                 machineWord |= (inst->funct3 & 0x7) << 3;
-                 machineWord |= (inst->opcode & 0x7);
-             } else if(inst->type == INST_I) {
-                 char *ops = line->operands;
-                 if(!ops) {
-                     fprintf(stderr, "Error on line %d: Missing operands for '%s'\n", line->lineNo, line->mnemonic);
-                     exit(1);
-                 }
-                 char *token = strtok(ops, ", \t");
-                 if(!token) {
-                     fprintf(stderr, "Error on line %d: Expected register operand\n", line->lineNo);
-                     exit(1);
-                 }
-                 int reg = parseRegister(token);
-                 token = strtok(NULL, ", \t");
-                 if(!token) {
-                     fprintf(stderr, "Error on line %d: Expected immediate operand\n", line->lineNo);
-                     exit(1);
-                 }
-                 int imm = parseImmediate(token);
-                 if(cmpIgnoreCase(inst->mnemonic, "srli") == 0) {
-                     imm = (0x2 << 4) | (imm & 0xF);
-                 } else if(cmpIgnoreCase(inst->mnemonic, "srai") == 0) {
-                     imm = (0x4 << 4) | (imm & 0xF);
-                 } else if(cmpIgnoreCase(inst->mnemonic, "slli") == 0) {
-                     imm = (0x1 << 4) | (imm & 0xF);
-                 }
-                 machineWord |= ((imm & 0x7F) << 9);
-                 machineWord |= ((reg & 0x7) << 6);
-                 machineWord |= ((inst->funct3 & 0x7) << 3);
-                 machineWord |= (inst->opcode & 0x7);
-             } else if(inst->type == INST_B) {
-                 char *ops = line->operands;
-                 if(!ops) {
-                     fprintf(stderr, "Error on line %d: Missing operands for branch\n", line->lineNo);
-                     exit(1);
-                 }
-                 char *token = strtok(ops, ", \t");
-                 if(!token) {
-                     fprintf(stderr, "Error on line %d: Expected register operand for branch\n", line->lineNo);
-                     exit(1);
-                 }
-                 int rs1 = parseRegister(token);
-                 token = strtok(NULL, ", \t");
-                 if(!token) {
-                     fprintf(stderr, "Error on line %d: Expected label for branch\n", line->lineNo);
-                     exit(1);
-                 }
-                 Symbol *sym = findSymbol(token);
-                 if(!sym) {
-                     fprintf(stderr, "Error on line %d: Undefined label '%s'\n", line->lineNo, token);
-                     exit(1);
-                 }
-                 int currPC = line->address;
-                 int targetPC = sym->address;
-                 int offset = (targetPC - (currPC + 2)) >> 1;
-                 if(offset < -8 || offset > 7) {
-                     fprintf(stderr, "Error on line %d: Branch offset out of range\n", line->lineNo);
-                     exit(1);
-                 }
-                 machineWord |= ((offset & 0xF) << 12);
-                 machineWord |= ((rs1 & 0x7) << 6);
-                 machineWord |= ((inst->funct3 & 0x7) << 3);
-                 machineWord |= (inst->opcode & 0x7);
-             } else if(inst->type == INST_J) {
-                 if(line->operands == NULL) {
-                     fprintf(stderr, "Error on line %d: Missing operand for jump\n", line->lineNo);
-                     exit(1);
-                 }
-                 char *token = strtok(line->operands, " \t");
-                 if(!token) {
-                     fprintf(stderr, "Error on line %d: Expected label for jump\n", line->lineNo);
-                     exit(1);
-                 }
-                 Symbol *sym = findSymbol(token);
-                 if(!sym) {
-                     fprintf(stderr, "Error on line %d: Undefined label '%s'\n", line->lineNo, token);
-                     exit(1);
-                 }
-                 int currPC = line->address;
-                 int targetPC = sym->address;
-                 int offset = (targetPC - currPC) >> 1;
-                 if(offset < -128 || offset > 127) {
-                     fprintf(stderr, "Error on line %d: Jump offset out of range\n", line->lineNo);
-                     exit(1);
-                 }
-                 int f = (cmpIgnoreCase(inst->mnemonic, "jal") == 0) ? 1 : 0;
-                 machineWord |= (f & 0x1) << 15;
-                 machineWord |= ((offset & 0xFF) << 7);
-                 machineWord |= (inst->opcode & 0xF);
-             } else if(inst->type == INST_U) {
-                 char *ops = line->operands;
-                 char *token = strtok(ops, ", \t");
-                 if(!token) {
-                     fprintf(stderr, "Error on line %d: Expected register for U‑type\n", line->lineNo);
-                     exit(1);
-                 }
-                 int rd = parseRegister(token);
-                 token = strtok(NULL, ", \t");
-                 if(!token) {
-                     fprintf(stderr, "Error on line %d: Expected immediate for U‑type\n", line->lineNo);
-                     exit(1);
-                 }
-                 int imm = parseImmediate(token);
-                 imm = (imm & 0x1FF);
-                 machineWord |= ((imm & 0x1FF) << 6);
-                 machineWord |= ((rd & 0x7) << 3);
-                 machineWord |= (inst->opcode & 0x7);
-             } else if(inst->type == INST_S) {
-                 if(line->operands == NULL) {
-                     fprintf(stderr, "Error on line %d: ecall missing operand\n", line->lineNo);
-                     exit(1);
-                 }
-                 int svc = parseImmediate(line->operands);
-                 machineWord = (svc << 4) | 0x7;
+             // The closing quote is dropped from the operand here; the opening one is only
+             // skipped for the size computation.
+             View *s = &line->operands;
+             int len = s->len + 1;
+             if(s->ptr[0]=='"' && s->ptr[s->len-1]=='"') {
+                 s->len--;
+                 len = (s->len > 0 ? s->len - 1 : 0) + 1;
              }
-             line->codeCount = 1;
-             line->code = (uint16_t *)malloc(sizeof(uint16_t));
-             line->code[0] = machineWord;
-             loc_text += 2;
+             line->elementSize = 1; // each character is a byte
+             as->loc_data += len;
+             break;
+         }
+         case DIR_BYTE: {
+             if(line->operands.len == 0) {
+                 encodeError("Error on line %d: .byte missing operand\n", line->lineNo);
+             }
+             int count = countValues(line->operands);
+             line->elementSize = 1;
+             as->loc_data += count;
+             break;
+         }
+         case DIR_WORD: {
+             if(line->operands.len == 0) {
+                 encodeError("Error on line %d: .word missing operand\n", line->lineNo);
+             }
+             int count = countValues(line->operands);
+             line->elementSize = 2;
+             as->loc_data += count * 2;
+             break;
+         }
+         case DIR_SPACE: {
+             if(line->operands.len == 0) {
+                 encodeError("Error on line %d: .space missing operand\n", line->lineNo);
+             }
+             int spaceSize = parseImmediate(line->operands);
+             line->elementSize = 1;
+             as->loc_data += spaceSize;
+             break;
+         }
+         case DIR_GLOBL: {
+             if(line->operands.len == 0) {
+                 encodeError("Error on line %d: .globl missing operand\n", line->lineNo);
+             }
+             View rest = line->operands, name;
+             while(nextField(&rest, ", \t", &name))
+                 internSymbol(name)->global = 1;
+             break;
+         }
+         case DIR_EQU: {
+             // ".equ name, value" defines an absolute symbol.
+             View rest = line->operands, name, value;
+             if(!nextField(&rest, ", \t", &name) || !nextField(&rest, ",", &value)) {
+                 encodeError("Error on line %d: .equ needs a name and a value\n", line->lineNo);
+             }
+             if(addSymbol(name, parseImmediate(trimView(value)), SECTION_NONE) != 0) {
+                 encodeError("Error on line %d: Duplicate label %.*s\n", line->lineNo, name.len, name.ptr);
+             }
+             break;
+         }
+         default:
+             break;
+         }
+     } else if(line->mnemonic.len) {
+         // For instructions, each produces 2 bytes; li/la of a number may need 4.
+         if(as->currentSection==SECTION_TEXT) {
+             View value;
              line->elementSize = 2;
+             if(loadOperand(line, &value) == 1)
+                 line->relax = loadWords(parseImmediate(value)) - 1;
+             as->loc_text += 2 * (1 + line->relax);
          }
      }
  }
  
  // -----------------------
- // Listing File Generation (.lst)
+ // Source Files: .include and Macros
  // -----------------------
  
- void generateListing(const char *sourceFilename) {
-     char listingFilename[256];
-     strcpy(listingFilename, sourceFilename);
-     char *dot = strrchr(listingFilename, '.');
-     if(dot)
-         strcpy(dot, ".lst");
-     else
-         strcat(listingFilename, ".lst");
-     FILE *lst = fopen(listingFilename, "w");
-     if(!lst) {
-         perror("Error opening listing file");
-         exit(1);
-     }
-     fprintf(lst, "Line   Address   Machine Code    Source\n");
-     fprintf(lst, "-----------------------------------------------------\n");
-     for (int i = 0; i < lineCount; i++) {
-         Line *l = lines[i];
-         if(l->section == SECTION_TEXT)
-             fprintf(lst, "%4d   0x%04X   ", l->lineNo, l->address);
-         else if(l->section == SECTION_DATA)
-             fprintf(lst, "%4d   0x%04X   ", l->lineNo, l->address);
-         else
-             fprintf(lst, "%4d           ", l->lineNo);
-         if(l->codeCount > 0) {
-             for (int j = 0; j < l->codeCount; j++)
-                 fprintf(lst, "%0*X ", (l->elementSize==1)?2:4, l->code[j]);
-             int pad = 12 - (l->codeCount * ((l->elementSize==1)?3:5));
-             for (int k = 0; k < pad; k++) fprintf(lst, " ");
-         } else {
-             fprintf(lst, "              ");
-         }
-         fprintf(lst, " %s", l->original);
-     }
-     fclose(lst);
-     printf("Listing file generated: %s\n", listingFilename);
+ // Pass 1 and one-pass assembly take every source line through readLine, which reads
+ // included files and expands macros; the lines that remain go to placeLine.
+ //   .include "file"        the lines of the file (looked up next to the including file)
+ //   .macro name a, b       starts the definition of a macro, ended by .endm; in its body
+ //                          "\a" is replaced by the argument and "\@" by a number unique to
+ //                          each expansion
+ //   name x, y              an expansion of the macro
+ // An included file is read and tokenized once; its parsed lines are kept in sources[] and
+ // copied for each .include of it. The .include, .macro and invocation lines stay in the
+ // listing but produce no code. Expanded lines carry the line number of the invocation, and
+ // errors in an included file are prefixed with its name.
+ #define MAX_NESTING 32
+ #define MAX_MACRO_PARAMS 16
+ 
+ typedef struct Source {
+     char *name;                  // path as opened
+     SourceFile src;              // (unused for the main source)
+     Line *lines;                 // parsed lines of an included file, once it has been read
+     int lineCount;
+ } Source;
+ 
+ typedef struct Macro {
+     char *name;                  // lower-case
+     View params[MAX_MACRO_PARAMS];
+     int paramCount;
+     View *body;                  // source lines of the body, each with its newline
+     int bodyCount, bodyCapacity;
+     int lineNo, file;            // the .macro line
+     struct Macro *next;
+ } Macro;
+ 
+ static int addSource(const char *name) {
+     as->sources = (Source *)realloc(as->sources, (as->sourceCount + 1) * sizeof(Source));
+     if(!as->sources) { perror("realloc"); exit(1); }
+     memset(&as->sources[as->sourceCount], 0, sizeof(Source));
+     as->sources[as->sourceCount].name = strdup(name);
+     return as->sourceCount++;
  }
  
- // -----------------------
- // Dump Binary: Write Memory Image to Output File
- // -----------------------
+ static Macro *findMacro(View name) {
+     for (Macro *m = as->macros; m; m = m->next)
+         if(lowerNameEquals(m->name, name.ptr, (size_t)name.len))
+             return m;
+     return NULL;
+ }
  
- void dumpBinary(const char *binFilename) {
-     int maxAddr = 0;
-     for (int i = 0; i < lineCount; i++) {
-         if (lines[i]->codeCount > 0) {
-             int endAddr = lines[i]->address + lines[i]->codeCount * lines[i]->elementSize;
-             if(endAddr > maxAddr)
-                 maxAddr = endAddr;
-         }
-     }
-     if(maxAddr == 0)
-         maxAddr = 1;  // write at least one byte
- 
-     unsigned char *memoryImage = (unsigned char *)calloc(maxAddr, 1);
-     if(!memoryImage) {
-          perror("calloc");
-          exit(1);
-     }
-     // Copy each line's code into the memory image at its computed address.
-     for (int i = 0; i < lineCount; i++) {
-          Line *l = lines[i];
-          if(l->codeCount > 0 && (l->section == SECTION_TEXT || l->section == SECTION_DATA)) {
-              for (int j = 0; j < l->codeCount; j++) {
-                  int addr = l->address + j * l->elementSize;
-                  if(l->elementSize == 1) {
-                      memoryImage[addr] = l->code[j] & 0xFF;
-                  } else if(l->elementSize == 2) {
-                      memoryImage[addr] = l->code[j] & 0xFF;
-                      memoryImage[addr+1] = (l->code[j] >> 8) & 0xFF;
-                  }
-              }
-          }
-     }
-     FILE *fp = fopen(binFilename, "wb");
-     if(!fp) {
-          perror("Error opening binary file for writing");
-          exit(1);
-     }
-     fwrite(memoryImage, 1, maxAddr, fp);
-     fclose(fp);
-     free(memoryImage);
-     printf("Binary file generated: %s\n", binFilename);
+ // Keep a line in the listing without assembling it.
+ static void hideLine(Line *line) {
+     line->mnemonic.len = 0;
+     line->keyword = NULL;
+     line->operands.len = 0;
  }
  
- // -----------------------
- // Verbose Dump: Symbol Table and Memory Usage
- // -----------------------
+ static void readLine(Line *line, int depth);
  
- void dumpVerbose() {
+ // Parse the lines of an included file into sources[index].lines.
+ static void tokenizeSource(int index) {
+     Source *s = &as->sources[index];
+     if(openSource(s->name, &s->src) != 0)
+         encodeError("Error: Cannot open include file '%s': %s\n", s->name, strerror(errno));
+     const char *p = s->src.data, *limit = p + s->src.size;
+     int capacity = 0, savedFile = as->currentFile;
+     as->currentFile = index;
+     while(p < limit) {
+         LineScan ls;
+         scanLine(p, limit, &ls);
+         const char *next = (ls.end < limit) ? ls.end + 1 : limit;
+         if(s->lineCount == capacity) {
+             capacity = capacity ? capacity * 2 : 64;
+             s->lines = (Line *)realloc(s->lines, capacity * sizeof(Line));
+             if(!s->lines) { perror("realloc"); exit(1); }
+         }
+         Line *line = &s->lines[s->lineCount++];
+         memset(line, 0, sizeof(Line));
+         line->lineNo = s->lineCount;
+         line->file = index;
+         line->original = makeView(p, next);
+         parseSourceLine(line, &ls);
+         p = next;
+     }
+     as->currentFile = savedFile;
+ }
+ 
+ static void includeFile(const Line *line, int depth) {
+     View name = line->operands;
+     if(name.len >= 2 && name.ptr[0] == '"' && name.ptr[name.len - 1] == '"') {
+         name.ptr++;
+         name.len -= 2;
+     }
+     if(name.len == 0) {
+         encodeError("Error on line %d: .include missing file name\n", line->lineNo);
+     }
+     if(depth > MAX_NESTING) {
+         encodeError("Error on line %d: .include nested too deeply\n", line->lineNo);
+     }
+     // A relative name is looked up next to the including file first.
+     char path[1024];
+     const char *from = as->sources[line->file].name, *slash = strrchr(from, '/');
+     FILE *fp = NULL;
+     if(name.ptr[0] != '/' && slash) {
+         snprintf(path, sizeof(path), "%.*s%.*s", (int)(slash - from + 1), from, name.len, name.ptr);
+         fp = fopen(path, "rb");
+     }
+     if(!fp) {
+         snprintf(path, sizeof(path), "%.*s", name.len, name.ptr);
+         fp = fopen(path, "rb");
+     }
+     if(!fp) {
+         encodeError("Error on line %d: Cannot open include file '%.*s'\n", line->lineNo, name.len, name.ptr);
+     }
+     fclose(fp);
+     int index = 1;
+     while(index < as->sourceCount && strcmp(as->sources[index].name, path) != 0)
+         index++;
+     if(index == as->sourceCount)
+         tokenizeSource(addSource(path));
+     int savedFile = as->currentFile;
+     as->currentFile = index;
+     as->scatteredLines = 1;
+     for (int i = 0; i < as->sources[index].lineCount; i++) {
+         Line *copy = (Line *)arenaAlloc(&as->lineArena, sizeof(Line));
+         *copy = as->sources[index].lines[i];
+         copy->section = as->currentSection;
+         readLine(copy, depth + 1);
+     }
+     as->currentFile = savedFile;
+ }
+ 
+ static void defineMacro(const Line *line) {
+     View rest = line->operands, name, param;
+     if(!nextField(&rest, " \t,", &name)) {
+         encodeError("Error on line %d: .macro missing name\n", line->lineNo);
+     }
+     if(lookupKeyword(name) || findMacro(name)) {
+         encodeError("Error on line %d: Macro name '%.*s' is already in use\n", line->lineNo, name.len, name.ptr);
+     }
+     Macro *m = (Macro *)calloc(1, sizeof(Macro));
+     if(!m) { perror("calloc"); exit(1); }
+     m->name = arenaStrndup(&as->sourceArena, name.ptr, (size_t)name.len);
+     toLowerStr(m->name);
+     while(nextField(&rest, ", \t", &param)) {
+         if(m->paramCount == MAX_MACRO_PARAMS) {
+             encodeError("Error on line %d: Too many macro parameters\n", line->lineNo);
+         }
+         m->params[m->paramCount++] = param;
+     }
+     m->lineNo = line->lineNo;
+     m->file = line->file;
+     m->next = as->macros;
+     as->macros = m;
+     as->defining = m;
+     as->definingDepth = 0;
+ }
+ 
+ static void addBodyLine(Macro *m, View text) {
+     if(m->bodyCount == m->bodyCapacity) {
+         m->bodyCapacity = m->bodyCapacity ? m->bodyCapacity * 2 : 8;
+         m->body = (View *)realloc(m->body, m->bodyCapacity * sizeof(View));
+         if(!m->body) { perror("realloc"); exit(1); }
+     }
+     m->body[m->bodyCount++] = text;
+ }
+ 
+ static int sameName(View a, View b) {
+     if(a.len != b.len)
+         return 0;
+     for (int i = 0; i < a.len; i++)
+         if(tolower((unsigned char)a.ptr[i]) != tolower((unsigned char)b.ptr[i]))
+             return 0;
+     return 1;
+ }
+ 
+ // Append n bytes to a growable buffer.
+ static void appendText(char **buf, int *len, int *cap, const char *text, int n) {
+     if(*len + n > *cap) {
+         *cap = (*len + n) * 2 + 64;
+         *buf = (char *)realloc(*buf, *cap);
+         if(!*buf) { perror("realloc"); exit(1); }
+     }
+     memcpy(*buf + *len, text, n);
+     *len += n;
+ }
+ 
+ static void expandMacro(const Macro *m, const Line *call, int depth) {
+     View args[MAX_MACRO_PARAMS], rest = call->operands, arg;
+     int argCount = 0;
+     if(depth > MAX_NESTING) {
+         encodeError("Error on line %d: Macro '%s' nested too deeply\n", call->lineNo, m->name);
+     }
+     while(nextField(&rest, ",", &arg)) {
+         if(argCount == m->paramCount) {
+             encodeError("Error on line %d: Too many arguments for macro '%s'\n", call->lineNo, m->name);
+         }
+         args[argCount++] = trimView(arg);
+     }
+     for (int i = argCount; i < m->paramCount; i++)
+         args[i] = makeView("", "");
+     char unique[16], *buf = NULL;
+     int cap = 0, uniqueLen = snprintf(unique, sizeof(unique), "%d", as->expansionCount++);
+     as->scatteredLines = 1;
+     for (int b = 0; b < m->bodyCount; b++) {
+         const char *p = m->body[b].ptr, *end = p + m->body[b].len;
+         int len = 0;
+         while(p < end) {
+             const char *q = p;
+             while(q < end && *q != '\\') q++;
+             appendText(&buf, &len, &cap, p, (int)(q - p));
+             if(q == end)
+                 break;
+             // "\@" or "\param"; anything else is copied as it is.
+             const char *id = q + 1, *idEnd = id;
+             while(idEnd < end && (isalnum((unsigned char)*idEnd) || *idEnd == '_')) idEnd++;
+             int k = 0;
+             while(k < m->paramCount && !sameName(m->params[k], makeView(id, idEnd)))
+                 k++;
+             if(id < end && *id == '@') {
+                 appendText(&buf, &len, &cap, unique, uniqueLen);
+                 p = id + 1;
+             } else if(idEnd > id && k < m->paramCount) {
+                 appendText(&buf, &len, &cap, args[k].ptr, args[k].len);
+                 p = idEnd;
+             } else {
+                 appendText(&buf, &len, &cap, q, 1);
+                 p = id;
+             }
+         }
+         if(len == 0 || buf[len - 1] != '\n')
+             appendText(&buf, &len, &cap, "\n", 1);
+         char *text = (char *)arenaAlloc(&as->sourceArena, (size_t)len);
+         memcpy(text, buf, (size_t)len);
+         LineScan ls;
+         scanLine(text, text + len, &ls);
+         Line *line = newLine(call->lineNo, makeView(text, text + len));
+         line->file = call->file;
+         parseSourceLine(line, &ls);
+         readLine(line, depth + 1);
+     }
+     free(buf);
+ }
+ 
+ // Route one parsed line: record macro bodies, read included files, expand macros, and pass
+ // everything else to placeLine.
+ static void readLine(Line *line, int depth) {
+     errorSource = line->file ? as->sources[line->file].name : NULL;
+     int dir = lineDirective(line);
+     if(as->defining) {
+         if(dir == DIR_MACRO)
+             as->definingDepth++;
+         if(dir == DIR_ENDM && as->definingDepth-- == 0)
+             as->defining = NULL;
+         else
+             addBodyLine(as->defining, line->original);
+         line->label = makeView(NULL, NULL);
+         hideLine(line);
+         as->placeLine(line);
+         return;
+     }
+     Macro *m;
+     if(dir == DIR_MACRO) {
+         defineMacro(line);
+         hideLine(line);
+         as->placeLine(line);
+     } else if(dir == DIR_ENDM) {
+         encodeError("Error on line %d: .endm without .macro\n", line->lineNo);
+     } else if(dir == DIR_INCLUDE) {
+         as->placeLine(line);
+         includeFile(line, depth);
+     } else if(!line->keyword && line->mnemonic.len && (m = findMacro(line->mnemonic))) {
+         // The invocation's label marks the start of the expansion.
+         Line call = *line;
+         hideLine(line);
+         as->placeLine(line);
+         expandMacro(m, &call, depth);
+     } else {
+         as->placeLine(line);
+     }
+ }
+ 
+ // After the last line: a macro must be complete.
+ static void endSources(void) {
+     if(as->defining) {
+         errorSource = as->defining->file ? as->sources[as->defining->file].name : NULL;
+         encodeError("Error on line %d: .macro '%s' without .endm\n", as->defining->lineNo, as->defining->name);
+     }
+     errorSource = NULL;
+ }
+ 
+ static void freeSources(void) {
+     for (int i = 0; i < as->sourceCount; i++) {
+         free(as->sources[i].name);
+         free(as->sources[i].lines);
+         if(i > 0)
+             closeSource(&as->sources[i].src);
+     }
+     free(as->sources);
+     as->sources = NULL;
+     as->sourceCount = 0;
+     while(as->macros) {
+         Macro *next = as->macros->next;
+         free(as->macros->body);
+         free(as->macros);
+         as->macros = next;
+     }
+     arenaFree(&as->sourceArena);
+ }
+ 
+ #ifndef Z16ASM_LIBRARY
+ // Write a make rule naming every source file the output depends on (-MD).
+ static void writeDepFile(const char *depFilename, const char *target) {
+     FILE *fp = openOutput(depFilename, "w", "dependency file");
+     const char *name = target;
+     for (int i = -1; i < as->sourceCount; i++) {
+         if(i >= 0)
+             name = as->sources[i].name;
+         for (const char *c = name; *c; c++) {
+             if(*c == ' ' || *c == '#')
+                 fputc('\\', fp);
+             else if(*c == '$')
+                 fputc('$', fp);
+             fputc(*c, fp);
+         }
+         fputs(i < 0 ? ": " : (i + 1 < as->sourceCount ? " \\\n " : "\n"), fp);
+     }
+     // An empty rule per included file, so that deleting one does not break the build.
+     for (int i = 1; i < as->sourceCount; i++)
+         fprintf(fp, "\n%s:\n", as->sources[i].name);
+     fclose(fp);
+ }
+ #endif
+ 
+ // Pass 1 places each line that readLine passes on.
+ static void keepLine(Line *line) {
+     defineLabel(line);
+     assignAddress(line);
+     appendLine(line);
+ }
+ 
+ static void pass1(const char *data, size_t size) {
+     const char *p = data, *limit = data + size;
+     int currentLineNo = 0;
+     as->placeLine = keepLine;
+     while(p < limit) {
+         LineScan ls;
+         scanLine(p, limit, &ls);
+         const char *next = (ls.end < limit) ? ls.end + 1 : limit;
+         currentLineNo++;
+         Line *line = newLine(currentLineNo, makeView(p, next));
+         p = next;
+         parseSourceLine(line, &ls);
+         readLine(line, 0);
+     }
+     endSources();
+ }
+ 
+ // After pass 1, the peephole optimizer and branch relaxation change the size of some lines.
+ // The lines and labels that follow such a line in its section move by the change, up to the
+ // next .org in that section. 'moves' is in source order.
+ typedef struct {
+     Line *line;
+     int bytes;                   // size change of the line
+ } LineMove;
+ 
+ static void moveLines(const LineMove *moves, int count) {
+     int shift[3] = {0, 0, 0};
+     int m = 0;
+     for (int i = 0; i < as->lineCount && (m < count || shift[SECTION_TEXT] || shift[SECTION_DATA]); i++) {
+         Line *line = as->lines[i];
+         if(line->label.len && (shift[SECTION_TEXT] || shift[SECTION_DATA])) {
+             Symbol *sym = findSymbol(line->label);
+             sym->address += shift[sym->section];
+         }
+         if(lineDirective(line) == DIR_ORG) {
+             shift[line->section] = 0;
+             continue;
+         }
+         line->address += shift[line->section];
+         if(m < count && moves[m].line == line)
+             shift[line->section] += moves[m++].bytes;
+     }
+ }
+ 
+ // -----------------------
+ // Label References: Fixups and Relocations
+ // -----------------------
+ 
+ // A label reference fills one field of the word at 'site':
+ //   FIX_B     branch offset, bits [15:12] = (label - site) >> 1
+ //   FIX_J     jump offset label - site: bits [14:9] = offset[9:4], bits [5:3] = offset[3:1]
+ //   FIX_U     U-type immediate label >> 7: bits [14:9] = imm[8:3], bits [5:3] = imm[2:0]
+ //             ("label" or "%hi(label)")
+ //   FIX_LO    I-type immediate, bits [15:9] = label & 0x7F  ("%lo(label)")
+ //   FIX_WORD  the whole .word = label
+ //   FIX_HI    U-type immediate of the lui before an addi, (label + 64) >> 7 (la)
+ typedef enum { FIX_B, FIX_J, FIX_U, FIX_LO, FIX_WORD, FIX_HI } FixupKind;
+ 
+ // Offset and immediate fields, as z16sim decodes them. A branch reaches -16..+14 bytes and a
+ // jump -512..+510 bytes from its own address.
+ #define B_FIELD 0xF000
+ #define J_FIELD 0x7E38
+ #define U_FIELD 0x7E38
+ 
+ static uint16_t bField(int offset) {
+     return (uint16_t)(((offset >> 1) & 0xF) << 12);
+ }
+ 
+ static uint16_t jField(int offset) {
+     return (uint16_t)((((offset >> 4) & 0x3F) << 9) | (((offset >> 1) & 0x7) << 3));
+ }
+ 
+ static uint16_t uField(int imm) {
+     return (uint16_t)((((imm >> 3) & 0x3F) << 9) | ((imm & 0x7) << 3));
+ }
+ 
+ static int branchReaches(int offset) {
+     return offset >= -16 && offset <= 14;
+ }
+ 
+ static int jumpReaches(int offset) {
+     return offset >= -512 && offset <= 510;
+ }
+ 
+ #ifndef Z16ASM_LIBRARY
+ // Fill in the field of 'word' for a reference from 'site' to 'target'. Returns 0 if a branch
+ // or jump offset is out of range.
+ static int patchField(FixupKind kind, uint16_t *word, int site, int target) {
+     int offset;
+     switch(kind) {
+     case FIX_B:
+         offset = target - site;
+         if(!branchReaches(offset))
+             return 0;
+         *word = (*word & ~B_FIELD) | bField(offset);
+         break;
+     case FIX_J:
+         offset = target - site;
+         if(!jumpReaches(offset))
+             return 0;
+         *word = (*word & ~J_FIELD) | jField(offset);
+         break;
+     case FIX_U:
+         *word = (*word & ~U_FIELD) | uField(target >> 7);
+         break;
+     case FIX_LO:
+         *word = (*word & 0x01FF) | ((target & 0x7F) << 9);
+         break;
+     case FIX_WORD:
+         *word = (uint16_t)target;
+         break;
+     case FIX_HI:
+         *word = (*word & ~U_FIELD) | uField((target + 64) >> 7);
+         break;
+     }
+     return 1;
+ }
+ #endif
+ 
+ // In one-pass mode a line is encoded as soon as it is parsed, so a label used before its
+ // definition has no address yet. The reference is encoded with a zero field and recorded as
+ // a fixup on the (still undefined) symbol; it is patched when the label is defined. Resolved
+ // fixups go back on a free list, so memory follows the number of pending references.
+ typedef struct Fixup {
+     FixupKind kind;
+     int lineNo;              // referencing line (for error messages)
+     int site;                // address of the word, or -1 if it is not emitted
+     int element;             // index of the word within its line (for the listing)
+     long listingPos;         // offset of the word in the listing, or -1
+     View label;              // label as written in the source
+     struct Fixup *next;      // next fixup on the same symbol (or on the free list)
+     struct Fixup *lineNext;  // next fixup recorded by the same line
+ } Fixup;
+ 
+ static void addFixup(FixupKind kind, const Line *line, View label, int site, int element) {
+     Symbol *sym = internSymbol(label);
+     Fixup *f = as->freeFixups;
+     if(f)
+         as->freeFixups = f->next;
+     else
+         f = (Fixup *)arenaAlloc(&as->fixupArena, sizeof(Fixup));
+     f->kind = kind;
+     f->lineNo = line->lineNo;
+     f->site = (line->section == SECTION_TEXT || line->section == SECTION_DATA) ? site : -1;
+     f->element = element;
+     f->listingPos = -1;
+     f->label = label;
+     f->next = sym->fixups;
+     sym->fixups = f;
+     f->lineNext = as->lineFixups;
+     as->lineFixups = f;
+     as->pendingFixups++;
+ }
+ 
+ // With -c, a reference whose value depends on where the linker places the sections is kept
+ // with its line as a relocation against the named symbol. Branches and jumps to a label in
+ // the same section of the same source are still resolved here.
+ typedef struct Reloc {
+     FixupKind kind;
+     int site;                // section offset of the word to patch
+     View label;
+     struct Reloc *next;
+ } Reloc;
+ 
+ // Value of a label referenced from 'site' (the address of the word holding the field). Forward
+ // references in one-pass mode and relocations in -c mode get a placeholder that encodes as a
+ // zero field.
+ static int labelValue(Line *line, View label, FixupKind kind, int site, int element) {
+     Symbol *sym = line->target ? line->target : findSymbol(label);
+     int placeholder = (kind == FIX_B || kind == FIX_J) ? site : 0;
+     if(as->objectMode) {
+         if(sym && (kind == FIX_B || kind == FIX_J) && sym->section == line->section)
+             return sym->address;
+         Reloc *r = (Reloc *)arenaAlloc(codeArena, sizeof(Reloc));
+         r->kind = kind;
+         r->site = site;
+         r->label = label;
+         r->next = line->relocs;
+         line->relocs = r;
+         return placeholder;
+     }
+     if(sym) {
+         if(symbolUses)
+             noteSymbolUse(sym);
+         return sym->address;
+     }
+     if(!as->onePass)
+         encodeError("Error on line %d: Undefined label '%.*s'\n", line->lineNo, label.len, label.ptr);
+     addFixup(kind, line, label, site, element);
+     return placeholder;
+ }
+ 
+ // If an operand names a label, either bare (wrapper NULL) or as wrapper + "label)", e.g.
+ // "%hi(label)", store the label and return 1. Numbers and registers are not labels.
+ static int operandLabel(View token, const char *wrapper, View *label) {
+     if(wrapper) {
+         int n = (int)strlen(wrapper);
+         if(token.len <= n || strncmp(token.ptr, wrapper, n) != 0)
+             return 0;
+         const char *p = token.ptr + n, *end = token.ptr + token.len, *q = p;
+         while(q < end && *q != ')') q++;
+         token = trimView(makeView(p, q));
+     }
+     if(token.len == 0 || !(isalpha((unsigned char)token.ptr[0]) || token.ptr[0] == '_'))
+         return 0;
+     *label = token;
+     return 1;
+ }
+ 
+ // -----------------------
+ // Peephole Optimizer (-O)
+ // -----------------------
+ 
+ // With -O, the text lines are scanned for wasteful sequences after pass 1, before branch
+ // relaxation settles the layout:
+ //   mv r, r  /  addi r, 0          removed (no effect)
+ //   li r, a  then  li r, b         the first li is removed (its value is never used)
+ //   sw r, m  then  lw d, m         the lw becomes "mv d, r", or is removed if d is r
+ //   j L  where L is the next line  removed
+ // A removed line keeps its label, which then marks the next instruction, so jumps to it
+ // still see the same effect. A store and load are only combined when no label lies between
+ // them.
+ // Register number of an operand, or -1 (no error is reported here).
+ static int peekRegister(View token) {
+     const Keyword *kw = lookupKeyword(token);
+     if(kw && kw->kind == KW_REGISTER)
+         return kw->value;
+     if(token.len == 2 && (token.ptr[0] == 'x' || token.ptr[0] == 'X') && token.ptr[1] >= '0' && token.ptr[1] <= '7')
+         return token.ptr[1] - '0';
+     return -1;
+ }
+ 
+ // Split "reg, rest" into the register number and the rest of the operands.
+ static int registerOperand(const Line *line, int *reg, View *rest) {
+     View ops = line->operands, token;
+     if(!nextField(&ops, ", \t", &token) || (*reg = peekRegister(token)) < 0)
+         return 0;
+     *rest = trimView(ops);
+     while(rest->len && (rest->ptr[0] == ',' || rest->ptr[0] == ' ' || rest->ptr[0] == '\t')) {
+         rest->ptr++;
+         rest->len--;
+     }
+     return 1;
+ }
+ 
+ static int isZeroImmediate(View v) {
+     const char *p = v.ptr, *end = v.ptr + v.len;
+     if(p < end && (*p == '-' || *p == '+'))
+         p++;
+     if(end - p > 2 && p[0] == '0' && strchr("xXbB", p[1]))
+         p += 2;
+     if(p == end)
+         return 0;
+     for (; p < end; p++)
+         if(*p != '0')
+             return 0;
+     return 1;
+ }
+ 
+ // Operand text equal up to blanks and letter case, e.g. "0(t0)" and "0( T0 )".
+ static int sameOperand(View a, View b) {
+     const char *p = a.ptr, *pe = a.ptr + a.len, *q = b.ptr, *qe = b.ptr + b.len;
+     for (;;) {
+         while(p < pe && (*p == ' ' || *p == '\t')) p++;
+         while(q < qe && (*q == ' ' || *q == '\t')) q++;
+         if(p == pe || q == qe)
+             return p == pe && q == qe;
+         if(tolower((unsigned char)*p++) != tolower((unsigned char)*q++))
+             return 0;
+     }
+ }
+ 
+ static int isMnemonic(const InstructionDef *inst, const char *name) {
+     return inst && strcmp(inst->mnemonic, name) == 0;
+ }
+ 
+ static void removeLine(Line *line) {
+     line->mnemonic.len = 0;
+     line->operands.len = 0;
+     line->keyword = NULL;
+     line->elementSize = 0;
+     line->rewritten = 1;
+     as->peepholeRemoved++;
+ }
+ 
+ // Apply the pattern that matches at line i, if any; returns 1 if something changed.
+ static int peepholeAt(int i) {
+     Line *line = as->lines[i];
+     InstructionDef *inst = lineInstruction(line);
+     if(!inst || line->section != SECTION_TEXT)
+         return 0;
+     int reg, reg2, labelled = 0, j;
+     View rest, rest2;
+     // The next line with a mnemonic, noting labels on the way.
+     for (j = i + 1; j < as->lineCount && !as->lines[j]->mnemonic.len; j++)
+         labelled |= (as->lines[j]->label.len != 0);
+     Line *next = (j < as->lineCount) ? as->lines[j] : NULL;
+     InstructionDef *nextInst = (next && next->section == SECTION_TEXT) ? lineInstruction(next) : NULL;
+     if(isMnemonic(inst, "mv") || isMnemonic(inst, "addi")) {
+         if(registerOperand(line, &reg, &rest) &&
+            (inst->type == INST_R ? peekRegister(rest) == reg : isZeroImmediate(rest))) {
+             removeLine(line);
+             return 1;
+         }
+     } else if(isMnemonic(inst, "li")) {
+         if(isMnemonic(nextInst, "li") && registerOperand(line, &reg, &rest) &&
+            registerOperand(next, &reg2, &rest2) && reg == reg2) {
+             removeLine(line);
+             return 1;
+         }
+     } else if(isMnemonic(inst, "sw")) {
+         if(isMnemonic(nextInst, "lw") && !labelled && !next->label.len &&
+            registerOperand(line, &reg, &rest) && registerOperand(next, &reg2, &rest2) &&
+            sameOperand(rest, rest2)) {
+             if(reg == reg2) {
+                 removeLine(next);
+             } else {
+                 // The stored value is still in its register.
+                 char *ops = (char *)arenaAlloc(&as->lineArena, 16);
+                 View srcOps = line->operands, dstOps = next->operands, src, dst;
+                 nextField(&srcOps, ", \t", &src);
+                 nextField(&dstOps, ", \t", &dst);
+                 int n = snprintf(ops, 16, "%.*s, %.*s", dst.len, dst.ptr, src.len, src.ptr);
+                 next->mnemonic = makeView("mv", "mv" + 2);
+                 next->keyword = lookupKeyword(next->mnemonic);
+                 next->operands = makeView(ops, ops + n);
+                 next->rewritten = 2;
+                 as->peepholeRewritten++;
+             }
+             return 1;
+         }
+     } else if(isMnemonic(inst, "j")) {
+         View label = trimView(line->operands);
+         for (int k = i + 1; k <= j && k < as->lineCount; k++) {
+             if(as->lines[k]->label.len && sameOperand(as->lines[k]->label, label)) {
+                 removeLine(line);
+                 return 1;
+             }
+         }
+     }
+     return 0;
+ }
+ 
+ // One scan over the lines. After a change the scan steps back to the previous instruction,
+ // which may now match with the next one.
+ static void peephole(void) {
+     as->peepholeRemoved = as->peepholeRewritten = as->textInstructions = 0;
+     for (int i = 0; i < as->lineCount; i++)
+         as->textInstructions += (lineInstruction(as->lines[i]) && as->lines[i]->section == SECTION_TEXT);
+     for (int i = 0; i < as->lineCount; i++) {
+         if(!peepholeAt(i))
+             continue;
+         int p = i - 1;
+         while(p >= 0 && !as->lines[p]->mnemonic.len)
+             p--;
+         i = (p >= 0 ? p : i) - 1;
+     }
+     if(!as->peepholeRemoved)
+         return;
+     LineMove *moves = (LineMove *)malloc(as->peepholeRemoved * sizeof(LineMove));
+     if(!moves) { perror("malloc"); exit(1); }
+     int count = 0;
+     for (int i = 0; i < as->lineCount; i++) {
+         if(as->lines[i]->rewritten == 1) {
+             moves[count].line = as->lines[i];
+             moves[count++].bytes = -2 * (1 + as->lines[i]->relax);
+             as->lines[i]->relax = 0;
+         }
+     }
+     moveLines(moves, count);
+     free(moves);
+ }
+ 
+ // -----------------------
+ // Branch Relaxation
+ // -----------------------
+ 
+ // A branch reaches -16..+14 bytes and a jump -512..+510. Before pass 2, every branch or
+ // jump to a label that is out of reach is replaced by the shortest sequence that reaches it:
+ //   branch, far:      b<inverted> over the next word; j label
+ //   branch, farther:  b<inverted> over the sequence; lui t1, hi; [addi t1, lo;] jr t1
+ //   j/jal, far:       lui t1, hi; [addi t1, lo;] jr t1 (jalr ra, t1 for jal)
+ // where hi/lo split the address so that (hi << 7) + lo == label with lo in -64..63; the
+ // addi is left out when lo is 0. Sites only ever grow, starting from the short forms, so
+ // the pass stops at the smallest layout in which every site reaches its target. In -c
+ // objects, sites to another section are left to the linker, and the lui forms are not used
+ // because the addresses are not final. Loads of label addresses (li/la, see Constant Loads)
+ // are sized in the same rounds.
+ //
+ // The lui forms load the target into a scratch register, t1 unless --relax-scratch names
+ // another (not ra, which jalr writes before it reads its source). The register is clobbered
+ // whenever the branch is taken, so a site whose branch tests it, or after which it may still
+ // be read before it is written, is an error (see checkScratch).
+ #define RELAX_SCRATCH 5          // t1
+ 
+ static const char *registerNames[8] = { "t0", "ra", "sp", "s0", "s1", "t1", "a0", "a1" };
+ 
+ typedef struct {
+     Line *line;
+     Symbol *target;              // NULL for a load whose address is left to the linker
+     FixupKind kind;              // FIX_B (branch), FIX_J (jump) or FIX_HI (li/la)
+     int grow;                    // words added in the current round
+ } RelaxSite;
+ 
+ // Split a 16-bit address for lui + addi.
+ static void splitAddress(int target, int *hi, int *lo) {
+     *hi = ((target + 64) >> 7) & 0x1FF;
+     *lo = (int16_t)(target - (*hi << 7));
+ }
+ 
+ // Extra words a site at 'site' needs to reach (or load) 'target'.
+ static int relaxWords(FixupKind kind, int site, int target) {
+     int hi, lo;
+     if(kind == FIX_HI)
+         return loadWords(target) - 1;
+     splitAddress(target, &hi, &lo);
+     if(kind == FIX_J)
+         return jumpReaches(target - site) ? 0 : (lo == 0) ? 1 : 2;
+     if(branchReaches(target - site))
+         return 0;
+     if(jumpReaches(target - (site + 2)))
+         return 1;
+     return (lo == 0) ? 2 : 3;
+ }
+ 
+ // The label operand of a branch ("rs1, label") or jump ("label") line.
+ static int siteLabel(const Line *line, int jump, View *label) {
+     View ops = line->operands, token;
+     if(!jump && !nextField(&ops, ", \t", &token))
+         return 0;
+     return nextField(&ops, jump ? " \t" : ", \t", label);
+ }
+ 
+ // Whether a relaxed branch or jump takes its lui form (it loads the scratch register).
+ static int scratchForm(const Line *l) {
+     InstructionDef *inst = lineInstruction(l);
+     if(!inst || !l->target || (inst->type != INST_B && inst->type != INST_J))
+         return 0;
+     int branch = (inst->type == INST_B);
+     return l->relax > branch && !jumpReaches(l->target->address - (l->address + 2 * branch));
+ }
+ 
+ // Registers an instruction line reads and writes, as bit masks.
+ static void registerUse(const Line *l, const InstructionDef *inst, int *reads, int *writes) {
+     View ops = l->operands, token;
+     int r[2] = { 0, 0 };
+     for (int k = 0; k < 2 && nextField(&ops, ", \t", &token); k++) {
+         const char *end = token.ptr + token.len, *open = memchr(token.ptr, '(', token.len);
+         if(open) {   // offset(base)
+             const char *close = memchr(open, ')', end - open);
+             token = makeView(open + 1, close ? close : end);
+         }
+         const Keyword *kw = lookupKeyword(trimView(token));
+         if(kw && kw->kind == KW_REGISTER)
+             r[k] = 1 << kw->value;
+     }
+     *reads = *writes = 0;
+     switch(inst->type) {
+         case INST_R:
+             if(strcmp(inst->mnemonic, "mv") == 0 || strcmp(inst->mnemonic, "jalr") == 0)
+                 *reads = r[1], *writes = r[0];
+             else
+                 *reads = r[0] | r[1], *writes = strcmp(inst->mnemonic, "jr") == 0 ? 0 : r[0];
+             break;
+         case INST_I:
+             *writes = r[0];
+             if(strcmp(inst->mnemonic, "li") != 0 && strcmp(inst->mnemonic, "la") != 0)
+                 *reads = r[0];
+             break;
+         case INST_B:
+             // The two-register branches compare with t0.
+             *reads = r[0] | ((inst->funct3 == 2 || inst->funct3 == 3) ? 0 : 1);
+             break;
+         case INST_L:
+             if(inst->opcode == 3)
+                 *reads = r[0] | r[1];
+             else
+                 *reads = r[1], *writes = r[0];
+             break;
+         case INST_J:
+             *writes = strcmp(inst->mnemonic, "jal") == 0 ? 1 << 1 : 0;
+             break;
+         case INST_U:
+             *writes = r[0];
+             break;
+         default:
+             break;
+     }
+ }
+ 
+ typedef struct {
+     Symbol *symbol;
+     int line;
+ } LabelLine;
+ 
+ static int compareLabelLines(const void *a, const void *b) {
+     uintptr_t x = (uintptr_t)((const LabelLine *)a)->symbol, y = (uintptr_t)((const LabelLine *)b)->symbol;
+     return (x > y) - (x < y);
+ }
+ 
+ // Index of the line that defines 'symbol', or -1.
+ static int labelLine(const LabelLine *labels, int count, Symbol *symbol) {
+     LabelLine key = { symbol, 0 };
+     const LabelLine *found = (const LabelLine *)bsearch(&key, labels, count, sizeof(LabelLine), compareLabelLines);
+     return found ? found->line : -1;
+ }
+ 
+ // Whether 'reg' may be read before it is written on some path from line 'start'. Paths follow
+ // the fall-through, branches, j, and jal into the callee; they end at jr and jalr, as callers
+ // treat t0, t1, a0 and a1 as clobbered by a call (see lib/z16rt.asm). A target that is not a
+ // known line counts as a read.
+ static int registerLive(int start, int reg, const LabelLine *labels, int labelCount, int *stack, char *seen) {
+     int depth = 0;
+     memset(seen, 0, as->lineCount);
+     stack[depth++] = start;
+     while(depth > 0) {
+         for (int i = stack[--depth]; i < as->lineCount && !seen[i]; i++) {
+             seen[i] = 1;
+             Line *l = as->lines[i];
+             InstructionDef *inst = lineInstruction(l);
+             if(!inst || l->section != SECTION_TEXT || l->rewritten == 1)
+                 continue;
+             int reads, writes;
+             registerUse(l, inst, &reads, &writes);
+             if(reads & (1 << reg))
+                 return 1;
+             if(writes & (1 << reg))
+                 break;
+             if(inst->type == INST_B || inst->type == INST_J) {
+                 int next = l->target ? labelLine(labels, labelCount, l->target) : -1;
+                 if(next < 0)
+                     return 1;
+                 if(!seen[next])
+                     stack[depth++] = next;    // at most one push per line visited
+                 if(inst->type == INST_J)
+                     break;
+             } else if(inst->type == INST_R && (strcmp(inst->mnemonic, "jr") == 0 || strcmp(inst->mnemonic, "jalr") == 0)) {
+                 break;
+             }
+         }
+     }
+     return 0;
+ }
+ 
+ // Reject the lui-form sites that would clobber a scratch register that is still needed: the
+ // register a branch tests, or one that may be read at the target before it is written.
+ static void checkScratch(void) {
+     int reg = as->relaxScratch, labelCount = 0, sites = 0;
+     for (int i = 0; i < as->lineCount; i++)
+         sites += scratchForm(as->lines[i]);
+     if(!sites)
+         return;
+     LabelLine *labels = (LabelLine *)malloc(as->lineCount * sizeof(LabelLine));
+     int *stack = (int *)malloc((as->lineCount + 1) * sizeof(int));
+     char *seen = (char *)malloc(as->lineCount);
+     if(!labels || !stack || !seen) { perror("malloc"); exit(1); }
+     for (int i = 0; i < as->lineCount; i++) {
+         Symbol *sym = as->lines[i]->label.len ? findSymbol(as->lines[i]->label) : NULL;
+         if(sym && sym->section == SECTION_TEXT) {
+             labels[labelCount].symbol = sym;
+             labels[labelCount++].line = i;
+         }
+     }
+     qsort(labels, labelCount, sizeof(LabelLine), compareLabelLines);
+     for (int i = 0; i < as->lineCount; i++) {
+         Line *l = as->lines[i];
+         if(!scratchForm(l))
+             continue;
+         int reads, writes, target = labelLine(labels, labelCount, l->target);
+         registerUse(l, lineInstruction(l), &reads, &writes);
+         const char *why = (reads & (1 << reg)) ? "which the branch tests" :
+                           (target < 0 || registerLive(target, reg, labels, labelCount, stack, seen)) ?
+                           "which may still be read at the target" : NULL;
+         if(why) {
+             free(labels);
+             free(stack);
+             free(seen);
+             encodeError("Error on line %d: '%.*s %.*s' is out of reach; its long form loads the target into %s, %s "
+                         "(choose another register with --relax-scratch)\n", l->lineNo, l->mnemonic.len, l->mnemonic.ptr,
+                         l->operands.len, l->operands.ptr, registerNames[reg], why);
+         }
+     }
+     free(labels);
+     free(stack);
+     free(seen);
+ }
+ 
+ // Grow the sites that do not reach their targets, round after round, moving the lines and
+ // labels that follow each grown site until no site grows.
+ static void relaxBranches(void) {
+     RelaxSite *sites = NULL;
+     int siteCount = 0, siteCapacity = 0;
+     as->loadSites = as->loadsExpanded = 0;
+     for (int i = 0; i < as->lineCount; i++) {
+         Line *line = as->lines[i];
+         InstructionDef *inst = lineInstruction(line);
+         if(!inst || line->section != SECTION_TEXT)
+             continue;
+         View label;
+         Symbol *sym;
+         FixupKind kind;
+         int load = (inst->type == INST_I) ? loadOperand(line, &label) : 0;
+         as->loadSites += (load != 0);
+         if(load == 1) {
+             as->loadsExpanded += (line->relax > 0);
+             continue;   // sized by pass 1
+         } else if(load == 2) {
+             kind = FIX_HI;
+         } else if(inst->type == INST_B || inst->type == INST_J) {
+             kind = (inst->type == INST_J) ? FIX_J : FIX_B;
+             if(!siteLabel(line, kind == FIX_J, &label))
+                 continue;
+         } else {
+             continue;
+         }
+         sym = findSymbol(label);
+         if(as->objectMode && kind == FIX_HI)
+             sym = NULL;
+         else if(!sym || (as->objectMode && sym->section != line->section))
+             continue;   // pass 2 reports an undefined label
+         if(siteCount == siteCapacity) {
+             siteCapacity = siteCapacity ? siteCapacity * 2 : 64;
+             sites = (RelaxSite *)realloc(sites, siteCapacity * sizeof(RelaxSite));
+             if(!sites) { perror("realloc"); exit(1); }
+         }
+         line->target = sym;
+         sites[siteCount].line = line;
+         sites[siteCount].target = sym;
+         sites[siteCount].kind = kind;
+         siteCount++;
+     }
+     LineMove *moves = (LineMove *)malloc((siteCount ? siteCount : 1) * sizeof(LineMove));
+     if(!moves) { perror("malloc"); exit(1); }
+     as->relaxRounds = 0;
+     for (;;) {
+         int grown = 0;
+         for (int s = 0; s < siteCount; s++) {
+             RelaxSite *site = &sites[s];
+             int words;
+             // Object code cannot hold an absolute address yet.
+             if(!site->target) {
+                 words = 1;
+             } else {
+                 words = relaxWords(site->kind, site->line->address, site->target->address);
+                 if(as->objectMode && words > (site->kind == FIX_J ? 0 : 1))
+                     words = site->line->relax;
+             }
+             site->grow = (words > site->line->relax) ? words - site->line->relax : 0;
+             grown += site->grow;
+         }
+         if(!grown)
+             break;
+         as->relaxRounds++;
+         int moveCount = 0;
+         for (int s = 0; s < siteCount; s++) {
+             if(sites[s].grow) {
+                 sites[s].line->relax += sites[s].grow;
+                 moves[moveCount].line = sites[s].line;
+                 moves[moveCount++].bytes = 2 * sites[s].grow;
+             }
+         }
+         moveLines(moves, moveCount);
+     }
+     as->relaxedSites = as->relaxedBytes = 0;
+     for (int s = 0; s < siteCount; s++) {
+         if(sites[s].kind == FIX_HI) {
+             as->loadsExpanded += (sites[s].line->relax > 0);
+             continue;
+         }
+         as->relaxedSites += (sites[s].line->relax > 0);
+         as->relaxedBytes += 2 * sites[s].line->relax;
+     }
+     free(moves);
+     free(sites);
+     checkScratch();
+ }
+ 
+ // Machine word of an R-type instruction.
+ static uint16_t rTypeWord(const char *mnemonic, int reg1, int reg2) {
+     InstructionDef *inst = lookupInstruction(makeView(mnemonic, mnemonic + strlen(mnemonic)));
+     return (uint16_t)(((inst->funct4 & 0xF) << 12) | ((reg2 & 0x7) << 9) | ((reg1 & 0x7) << 6) |
+                       ((inst->funct3 & 0x7) << 3) | (inst->opcode & 0x7));
+ }
+ 
+ // Encode a relaxed site into its 1 + line->relax words; 'word' is the short form without
+ // its offset field. A site can end up with more words than its target needs now (when a
+ // later .org pulls the target closer); the shorter sequence is then padded after its jump.
+ static void encodeRelaxed(Line *line, InstructionDef *inst, uint16_t word, int target, uint16_t *code) {
+     int total = 1 + line->relax, site = line->address, n = 0, hi, lo;
+     // Bit 15 and rd are jal's link; in a branch they are offset bits and rs1, never a link.
+     uint16_t link = (inst->type == INST_J) ? (word & 0x81C0) : 0;
+     splitAddress(target, &hi, &lo);
+     if(inst->type == INST_B) {
+         // Inverted condition, skipping the rest of the sequence.
+         code[n++] = (uint16_t)(bField(2 * total) | (word & ~B_FIELD)) ^ (1 << 3);
+         site += 2;
+     }
+     if(jumpReaches(target - site)) {
+         code[n++] = (uint16_t)(jField(target - site) | link | 5);
+     } else {
+         code[n++] = (uint16_t)(uField(hi) | (as->relaxScratch << 6) | 6);
+         if(n + 1 < total)
+             code[n++] = (uint16_t)(((lo & 0x7F) << 9) | (as->relaxScratch << 6) | 1);
+         code[n++] = link ? rTypeWord("jalr", 1, as->relaxScratch) : rTypeWord("jr", as->relaxScratch, as->relaxScratch);
+     }
+     while(n < total)
+         code[n++] = 0;
+ }
+ 
+ // Encode an li/la of 'value' into its 1 + line->relax words; 'word' is the li instruction
+ // without its immediate.
+ static void encodeLoad(const Line *line, uint16_t word, int value, uint16_t *code) {
+     int rd = (word >> 6) & 0x7, v = value & 0xFFFF, s = (int16_t)v, n = 0, hi, lo;
+     if(line->relax == 0 && s >= -64 && s <= 63) {
+         code[n++] = (uint16_t)(((s & 0x7F) << 9) | word);
+     } else if(line->relax == 0) {
+         code[n++] = (uint16_t)(uField(v >> 7) | (rd << 6) | 6);
+     } else {
+         splitAddress(v, &hi, &lo);
+         code[n++] = (uint16_t)(uField(hi) | (rd << 6) | 6);
+         code[n++] = (uint16_t)(((lo & 0x7F) << 9) | (rd << 6) | 1);
+     }
+     while(n < 1 + line->relax)
+         code[n++] = 0;
+ }
+ 
+ // -----------------------
+ // Pass 2: Encode Instructions and Process Data Directives
+ // -----------------------
+ 
+ // Encode one line into line->code. Instructions are encoded from the line's own address;
+ // *textLoc and *dataLoc follow the size of what has been emitted in each section.
+ static void encodeLine(Line *line, int *textLoc, int *dataLoc) {
+     errorSource = line->file ? as->sources[line->file].name : NULL;
+     if(line->mnemonic.len && line->mnemonic.ptr[0]=='.') {
+         switch(lineDirective(line)) {
+         case DIR_ORG:
+             if(line->section==SECTION_TEXT)
+                 *textLoc = line->address;
+             else if(line->section==SECTION_DATA)
+                 *dataLoc = line->address;
+             break;
+         case DIR_ASCIIZ: {
+             const char *s = line->operands.ptr;
+             int slen = line->operands.len;
+             if(slen > 0 && s[0]=='"' && s[slen-1]=='"') {
+                 s++;
+                 slen = slen > 1 ? slen - 2 : 0;
+             }
+             int len = slen + 1;
+             // For .asciiz, we allocate one 16-bit word per two characters.
+             line->codeCount = (len + 1) / 2;
+             line->code = (uint16_t *)arenaAlloc(codeArena, line->codeCount * sizeof(uint16_t));
+             // Pack characters into words (little-endian).
+             for (int j = 0; j < line->codeCount; j++) {
+                 uint16_t word = 0;
+                 int index = j * 2;
+                 if(index < slen)
+                     word |= ((unsigned char)s[index]);
+                 if(index+1 < slen)
+                     word |= (((unsigned char)s[index+1]) << 8);
+                 line->code[j] = word;
+             }
+             *dataLoc += len;
+             break;
+         }
+         case DIR_BYTE: {
+             int count = countValues(line->operands);
+             line->codeCount = count;
+             line->code = (uint16_t *)arenaAlloc(codeArena, count * sizeof(uint16_t));
+             View rest = line->operands, token;
+             int idx = 0;
+             while(nextField(&rest, ",", &token)) {
+                 int val = parseImmediate(trimView(token));
+                 line->code[idx++] = (uint16_t)(val & 0xFF);
+             }
+             *dataLoc += count;
+             break;
+         }
+         case DIR_WORD: {
+             int count = countValues(line->operands);
+             line->codeCount = count;
+             line->code = (uint16_t *)arenaAlloc(codeArena, count * sizeof(uint16_t));
+             View rest = line->operands, token, label;
+             int idx = 0;
+             while(nextField(&rest, ",", &token)) {
+                 token = trimView(token);
+                 int val = operandLabel(token, NULL, &label)
+                           ? labelValue(line, label, FIX_WORD, line->address + idx * 2, idx)
+                           : parseImmediate(token);
+                 line->code[idx++] = (uint16_t)val;
+             }
+             *dataLoc += count * 2;
+             break;
+         }
+         case DIR_SPACE: {
+             int size = parseImmediate(line->operands);
+             line->codeCount = 0; // no code produced
+             *dataLoc += size;
+             break;
+         }
+         default:
+             // .text and .data were tracked by pass 1 (line->section).
+             break;
+         }
+         return;
+     }
+     if(line->mnemonic.len) {
+         InstructionDef *inst = (line->keyword && line->keyword->kind == KW_INSTRUCTION)
+                                ? &instructionSet[line->keyword->value] : NULL;
+         if(!inst) {
+             encodeError("Error on line %d: Unknown mnemonic '%.*s'\n", line->lineNo,
+                     line->mnemonic.len, line->mnemonic.ptr);
+         }
+         uint16_t machineWord = 0;
+         int relaxTarget = 0, load = 0, loadValue = 0;
+         if(inst->type == INST_R) {
+             View ops = line->operands, token;
+             if(ops.len == 0) {
+                 encodeError("Error on line %d: Missing operands for '%s'\n", line->lineNo, inst->mnemonic);
+             }
+             if(!nextField(&ops, ", \t", &token)) {
+                 encodeError("Error on line %d: Expected register operand\n", line->lineNo);
+             }
+             int reg1 = parseRegister(token);
+             if(!nextField(&ops, ", \t", &token)) {
+                 encodeError("Error on line %d: Expected second register operand\n", line->lineNo);
+             }
+             int reg2 = parseRegister(token);
+             machineWord |= (inst->funct4 & 0xF) << 12;
+             machineWord |= (reg2 & 0x7) << 9;
+             machineWord |= (reg1 & 0x7) << 6;
+             machineWord |= (inst->funct3 & 0x7) << 3;
+             machineWord |= (inst->opcode & 0x7);
+         } else if(inst->type == INST_I) {
+             View ops = line->operands, token;
+             if(ops.len == 0) {
+                 encodeError("Error on line %d: Missing operands for '%s'\n", line->lineNo, inst->mnemonic);
+             }
+             if(!nextField(&ops, ", \t", &token)) {
+                 encodeError("Error on line %d: Expected register operand\n", line->lineNo);
+             }
+             int reg = parseRegister(token);
+             if(!nextField(&ops, ", \t", &token)) {
+                 encodeError("Error on line %d: Expected immediate operand\n", line->lineNo);
+             }
+             View label;
+             load = loadOperand(line, &label);
+             if(load == 2) {
+                 // A two-word la is patched in both words where the address is not known yet.
+                 loadValue = labelValue(line, label, FIX_HI, line->address, 0);
+                 if(line->relax)
+                     labelValue(line, label, FIX_LO, line->address + 2, 1);
+             } else if(load == 1) {
+                 loadValue = parseImmediate(token);
+                 if(loadValue < -32768 || loadValue > 65535) {
+                     encodeError("Error on line %d: Constant out of range for '%s'\n", line->lineNo, inst->mnemonic);
+                 }
+             }
+             int imm = operandLabel(token, "%lo(", &label)
+                       ? labelValue(line, label, FIX_LO, line->address, 0)
+                       : load ? 0 : parseImmediate(token);
+             if(cmpIgnoreCase(inst->mnemonic, "srli") == 0) {
+                 imm = (0x2 << 4) | (imm & 0xF);
+             } else if(cmpIgnoreCase(inst->mnemonic, "srai") == 0) {
+                 imm = (0x4 << 4) | (imm & 0xF);
+             } else if(cmpIgnoreCase(inst->mnemonic, "slli") == 0) {
+                 imm = (0x1 << 4) | (imm & 0xF);
+             }
+             machineWord |= ((imm & 0x7F) << 9);
+             machineWord |= ((reg & 0x7) << 6);
+             machineWord |= ((inst->funct3 & 0x7) << 3);
+             machineWord |= (inst->opcode & 0x7);
+         } else if(inst->type == INST_L) {
+             // "lw rd, offset(base)" and "sw rs, offset(base)", with an offset of 0..15 bytes
+             // that may be left out ("lw rd, (base)"). Loads hold the base in [11:9] and rd in
+             // [8:6]; stores hold the source in [11:9] and the base in [8:6].
+             View ops = line->operands, token;
+             if(!nextField(&ops, ", \t", &token)) {
+                 encodeError("Error on line %d: Expected register operand\n", line->lineNo);
+             }
+             int reg = parseRegister(token);
+             View address = trimView(ops);
+             while(address.len && address.ptr[0] == ',') {
+                 address.ptr++;
+                 address.len--;
+             }
+             const char *open = memchr(address.ptr, '(', address.len), *close = NULL;
+             if(open)
+                 close = memchr(open, ')', address.ptr + address.len - open);
+             if(!close) {
+                 encodeError("Error on line %d: Expected offset(register) operand for '%s'\n", line->lineNo, inst->mnemonic);
+             }
+             View offsetText = trimView(makeView(address.ptr, open));
+             int offset = offsetText.len ? parseImmediate(offsetText) : 0;
+             View baseText = trimView(makeView(open + 1, close));
+             int base = peekRegister(baseText);
+             if(base < 0) {
+                 encodeError("Error on line %d: '%.*s' is not a register: '%s' takes offset(register); "
+                             "load a label's address with la first\n", line->lineNo, baseText.len, baseText.ptr, inst->mnemonic);
+             }
+             if(offset < 0 || offset > 15) {
+                 encodeError("Error on line %d: Offset out of range for '%s' (0..15)\n", line->lineNo, inst->mnemonic);
+             }
+             int store = (inst->opcode == 3);
+             machineWord |= (offset & 0xF) << 12;
+             machineWord |= ((store ? reg : base) & 0x7) << 9;
+             machineWord |= ((store ? base : reg) & 0x7) << 6;
+             machineWord |= (inst->funct3 & 0x7) << 3;
+             machineWord |= (inst->opcode & 0x7);
+         } else if(inst->type == INST_B) {
+             View ops = line->operands, token;
+             if(ops.len == 0) {
+                 encodeError("Error on line %d: Missing operands for branch\n", line->lineNo);
+             }
+             if(!nextField(&ops, ", \t", &token)) {
+                 encodeError("Error on line %d: Expected register operand for branch\n", line->lineNo);
+             }
+             int rs1 = parseRegister(token);
+             if(!nextField(&ops, ", \t", &token)) {
+                 encodeError("Error on line %d: Expected label for branch\n", line->lineNo);
+             }
+             int currPC = line->address;
+             int targetPC = labelValue(line, token, FIX_B, currPC, 0);
+             relaxTarget = targetPC;
+             if(!branchReaches(targetPC - currPC) && !line->relax) {
+                 encodeError("Error on line %d: Branch offset out of range\n", line->lineNo);
+             }
+             machineWord |= bField(targetPC - currPC);
+             machineWord |= ((rs1 & 0x7) << 6);
+             machineWord |= ((inst->funct3 & 0x7) << 3);
+             machineWord |= (inst->opcode & 0x7);
+         } else if(inst->type == INST_J) {
+             View ops = line->operands, token;
+             if(ops.len == 0) {
+                 encodeError("Error on line %d: Missing operand for jump\n", line->lineNo);
+             }
+             if(!nextField(&ops, " \t", &token)) {
+                 encodeError("Error on line %d: Expected label for jump\n", line->lineNo);
+             }
+             int currPC = line->address;
+             int targetPC = labelValue(line, token, FIX_J, currPC, 0);
+             relaxTarget = targetPC;
+             if(!jumpReaches(targetPC - currPC) && !line->relax) {
+                 encodeError("Error on line %d: Jump offset out of range\n", line->lineNo);
+             }
+             int f = (cmpIgnoreCase(inst->mnemonic, "jal") == 0) ? 1 : 0;
+             machineWord |= (f & 0x1) << 15;
+             machineWord |= (f & 0x1) << 6;        // jal links through ra
+             machineWord |= jField(targetPC - currPC);
+             machineWord |= (inst->opcode & 0xF);
+         } else if(inst->type == INST_U) {
+             View ops = line->operands, token;
+             if(!nextField(&ops, ", \t", &token)) {
+                 encodeError("Error on line %d: Expected register for U‑type\n", line->lineNo);
+             }
+             int rd = parseRegister(token);
+             if(!nextField(&ops, ", \t", &token)) {
+                 encodeError("Error on line %d: Expected immediate for U‑type\n", line->lineNo);
+             }
+             View label;
+             int imm = (operandLabel(token, NULL, &label) || operandLabel(token, "%hi(", &label))
+                       ? labelValue(line, label, FIX_U, line->address, 0) >> 7
+                       : parseImmediate(token);
+             int f = (cmpIgnoreCase(inst->mnemonic, "auipc") == 0) ? 1 : 0;
+             machineWord |= (f & 0x1) << 15;
+             machineWord |= uField(imm);
+             machineWord |= ((rd & 0x7) << 6);
+             machineWord |= (inst->opcode & 0x7);
+         } else if(inst->type == INST_S) {
+             if(line->operands.len == 0) {
+                 encodeError("Error on line %d: ecall missing operand\n", line->lineNo);
+             }
+             int svc = parseImmediate(line->operands);
+             machineWord = ((svc & 0x3FF) << 6) | 0x7;
+         }
+         line->codeCount = 1 + line->relax;
+         line->code = (uint16_t *)arenaAlloc(codeArena, line->codeCount * sizeof(uint16_t));
+         if(load)
+             encodeLoad(line, machineWord, loadValue, line->code);
+         else if(line->relax)
+             encodeRelaxed(line, inst, machineWord, relaxTarget, line->code);
+         else
+             line->code[0] = machineWord;
+         *textLoc += 2 * line->codeCount;
+         line->elementSize = 2;
+     }
+ }
+ 
+ // Once pass 1 has placed every line, lines encode independently, so large programs are
+ // split into chunks that a pool of workers takes in turn. Each chunk keeps its own section
+ // counters (relative, unless a .org in the chunk set them) and its first error, so the
+ // result and the error reported are the same as for a serial run.
+ #define ENCODE_CHUNK 8192
+ 
+ typedef struct EncodeChunk {
+     int first, last;           // line range [first, last)
+     int textLoc, dataLoc;      // emitted bytes per section
+     int textOrg, dataOrg;      // set if a .org made the counter absolute
+     int failed;
+     char error[256];
+     uint64_t key;              // content hash (--cache)
+     int cached;                // index + 1 of the cache record the code came from, or 0
+     SymbolList uses;           // symbols the chunk's lines resolved (--cache)
+ } EncodeChunk;
+ 
+ // Encode a chunk's lines; returns 0 (with the message saved) if one of them has an error.
+ static int encodeChunk(EncodeChunk *ch) {
+     EncodeAbort abort, *outer = encodeAbort;
+     encodeAbort = &abort;
+     symbolUses = as->recordSymbolUses ? &ch->uses : NULL;
+     if(setjmp(abort.jump)) {
+         encodeAbort = outer;
+         symbolUses = NULL;
+         ch->failed = 1;
+         memcpy(ch->error, abort.message, sizeof(ch->error));
+         return 0;
+     }
+     for (int i = ch->first; i < ch->last; i++) {
+         Line *line = as->lines[i];
+         encodeLine(line, &ch->textLoc, &ch->dataLoc);
+         if(lineDirective(line) == DIR_ORG) {
+             ch->textOrg |= (line->section == SECTION_TEXT);
+             ch->dataOrg |= (line->section == SECTION_DATA);
+         }
+     }
+     encodeAbort = outer;
+     symbolUses = NULL;
+     errorSource = NULL;
+     return 1;
+ }
+ 
+ // Fold the chunks' section counters into loc_text/loc_data in source order, reporting the
+ // first error.
+ static void combineChunks(EncodeChunk *chunks, int count) {
+     for (int c = 0; c < count; c++) {
+         EncodeChunk *ch = &chunks[c];
+         if(ch->failed)
+             encodeError("%s", ch->error);
+         as->loc_text = ch->textOrg ? ch->textLoc : as->loc_text + ch->textLoc;
+         as->loc_data = ch->dataOrg ? ch->dataLoc : as->loc_data + ch->dataLoc;
+     }
+ }
+ 
+ #ifndef _WIN32
+ typedef struct EncodeWorker {
+     pthread_t thread;
+     Arena arena;
+     struct Assembler *as;      // the assembly the worker encodes for
+ } EncodeWorker;
+ 
+ static void *encodeWorkerMain(void *arg) {
+     EncodeWorker *w = (EncodeWorker *)arg;
+     as = w->as;
+     codeArena = &w->arena;
+     for (;;) {
+         int c = atomic_fetch_add(&as->nextEncodeChunk, 1);
+         if(c >= as->encodeChunkCount)
+             break;
+         if(!as->encodeChunks[c].cached)
+             encodeChunk(&as->encodeChunks[c]);
+     }
+     return NULL;
+ }
+ 
+ // Encode the chunks not taken from the cache on up to encodeThreads workers.
+ static void encodeOnWorkers(EncodeChunk *chunks, int count) {
+     as->encodeChunks = chunks;
+     as->encodeChunkCount = count;
+     as->encodeWorkerCount = as->encodeThreads < as->encodeChunkCount ? as->encodeThreads : as->encodeChunkCount;
+     as->encodeWorkers = (EncodeWorker *)calloc(as->encodeWorkerCount, sizeof(EncodeWorker));
+     as->encodeThreadsUsed = as->encodeWorkerCount;
+     if(!as->encodeWorkers) { perror("calloc"); exit(1); }
+     atomic_store(&as->nextEncodeChunk, 0);
+     for (int t = 0; t < as->encodeWorkerCount; t++) {
+         as->encodeWorkers[t].as = as;
+         if(pthread_create(&as->encodeWorkers[t].thread, NULL, encodeWorkerMain, &as->encodeWorkers[t]) != 0) {
+             perror("pthread_create");
+             exit(1);
+         }
+     }
+     for (int t = 0; t < as->encodeWorkerCount; t++)
+         pthread_join(as->encodeWorkers[t].thread, NULL);
+     as->encodeChunks = NULL;
+ }
+ 
+ static void encodeParallel(void) {
+     int count = (as->lineCount + ENCODE_CHUNK - 1) / ENCODE_CHUNK;
+     EncodeChunk *chunks = (EncodeChunk *)calloc(count, sizeof(EncodeChunk));
+     if(!chunks) { perror("calloc"); exit(1); }
+     for (int c = 0; c < count; c++) {
+         chunks[c].first = c * ENCODE_CHUNK;
+         chunks[c].last = (c + 1 < count) ? (c + 1) * ENCODE_CHUNK : as->lineCount;
+     }
+     encodeOnWorkers(chunks, count);
+     combineChunks(chunks, count);
+     free(chunks);
+ }
+ 
+ // The workers' arenas hold code words until the output files are written.
+ static void freeEncodeWorkers(void) {
+     for (int t = 0; t < as->encodeWorkerCount; t++)
+         arenaFree(&as->encodeWorkers[t].arena);
+     free(as->encodeWorkers);
+     as->encodeWorkers = NULL;
+     as->encodeWorkerCount = 0;
+ }
+ #endif
+ 
+ static void pass2() {
+     as->loc_text = 0;
+     as->loc_data = 0;
+ #ifndef _WIN32
+     if(as->encodeThreads > 1 && as->lineCount >= 2 * ENCODE_CHUNK) {
+         encodeParallel();
+         return;
+     }
+ #endif
+     for (int i = 0; i < as->lineCount; i++)
+         encodeLine(as->lines[i], &as->loc_text, &as->loc_data);
+     errorSource = NULL;
+ }
+ 
+ // -----------------------
+ // Listing File Generation (.lst)
+ // -----------------------
+ 
+ // Derive the listing file name from the source file name.
+ static void listingName(const char *sourceFilename, char *listingFilename) {
+     strcpy(listingFilename, sourceFilename);
+     char *dot = strrchr(listingFilename, '.');
+     if(dot)
+         strcpy(dot, ".lst");
+     else
+         strcat(listingFilename, ".lst");
+ }
+ 
+ // The listing is formatted into a buffer that is written out in large chunks. In one-pass
+ // mode the buffer is held back while forward references are pending, so their machine code
+ // can still be patched in place.
+ typedef struct Listing {
+     FILE *fp;
+     char *buf;
+     size_t len;
+     size_t cap;
+     long flushed;      // bytes already written to fp
+ } Listing;
+ 
+ #define LISTING_CHUNK (64 * 1024)
+ 
+ static void listPrintf(Listing *lst, const char *fmt, ...) {
+     for (;;) {
+         va_list ap;
+         va_start(ap, fmt);
+         int n = vsnprintf(lst->buf + lst->len, lst->cap - lst->len, fmt, ap);
+         va_end(ap);
+         if(n < 0) {
+             perror("vsnprintf");
+             exit(1);
+         }
+         if(lst->len + n < lst->cap) {
+             lst->len += n;
+             return;
+         }
+         lst->cap = (lst->cap + n) * 2;
+         lst->buf = (char *)realloc(lst->buf, lst->cap);
+         if(!lst->buf) { perror("realloc"); exit(1); }
+     }
+ }
+ 
+ static void flushListing(Listing *lst) {
+     fwrite(lst->buf, 1, lst->len, lst->fp);
+     lst->flushed += (long)lst->len;
+     lst->len = 0;
+ }
+ 
+ static void openListing(Listing *lst, const char *listingFilename) {
+     lst->fp = openOutput(listingFilename, "w", "listing file");
+     lst->cap = LISTING_CHUNK * 2;
+     lst->buf = (char *)malloc(lst->cap);
+     if(!lst->buf) { perror("malloc"); exit(1); }
+     lst->len = 0;
+     lst->flushed = 0;
+     listPrintf(lst, "Line   Address   Machine Code    Source\n");
+     listPrintf(lst, "-----------------------------------------------------\n");
+ }
+ 
+ static void closeListing(Listing *lst) {
+     flushListing(lst);
+     fclose(lst->fp);
+     free(lst->buf);
+     lst->buf = NULL;
+ }
+ 
+ // Format one listing line; returns the listing offset of its machine code field.
+ static long listLine(Listing *lst, const Line *l) {
+     if(l->section == SECTION_TEXT)
+         listPrintf(lst, "%4d   0x%04X   ", l->lineNo, l->address);
+     else if(l->section == SECTION_DATA)
+         listPrintf(lst, "%4d   0x%04X   ", l->lineNo, l->address);
+     else
+         listPrintf(lst, "%4d           ", l->lineNo);
+     long codePos = lst->flushed + (long)lst->len;
+     if(l->codeCount > 0) {
+         for (int j = 0; j < l->codeCount; j++)
+             listPrintf(lst, "%0*X ", (l->elementSize==1)?2:4, l->code[j]);
+         int pad = 12 - (l->codeCount * ((l->elementSize==1)?3:5));
+         for (int k = 0; k < pad; k++) listPrintf(lst, " ");
+     } else {
+         listPrintf(lst, "              ");
+     }
+     if(scratchForm(l)) {
+         int len = l->original.len;
+         while(len > 0 && (l->original.ptr[len - 1] == '\n' || l->original.ptr[len - 1] == '\r'))
+             len--;
+         listPrintf(lst, " %.*s    # relaxed, clobbers %s\n", len, l->original.ptr, registerNames[as->relaxScratch]);
+     } else {
+         listPrintf(lst, " %.*s", l->original.len, l->original.ptr);
+     }
+     return codePos;
+ }
+ 
+ static void generateListing(const char *sourceFilename) {
+     char listingFilename[256];
+     listingName(sourceFilename, listingFilename);
+     Listing lst;
+     openListing(&lst, listingFilename);
+     for (int i = 0; i < as->lineCount; i++) {
+         listLine(&lst, as->lines[i]);
+         if(lst.len >= LISTING_CHUNK)
+             flushListing(&lst);
+     }
+     closeListing(&lst);
+     if(!as->quiet)
+         printf("Listing file generated: %s\n", listingFilename);
+ }
+ 
+ // -----------------------
+ // Dump Binary: Write Memory Image to Output File
+ // -----------------------
+ 
+ // Little-endian integers for the binary formats.
+ static void putU16(FILE *fp, unsigned v) {
+     fputc(v & 0xFF, fp);
+     fputc((v >> 8) & 0xFF, fp);
+ }
+ 
+ static void putU32(FILE *fp, unsigned long v) {
+     putU16(fp, v & 0xFFFF);
+     putU16(fp, (v >> 16) & 0xFFFF);
+ }
+ 
+ // A memory image grows (zero-filled) to the highest address any line has code for. 'live'
+ // marks each byte that holds code or data (LIVE_CODE) or that .space reserves (LIVE_FILL); a
+ // .space at the end does not extend 'size'.
+ enum { LIVE_NONE, LIVE_CODE, LIVE_FILL };
+ 
+ typedef struct Image {
+     unsigned char *bytes;
+     unsigned char *live;
+     int size;
+     int capacity;
+ } Image;
+ 
+ // Output formats (--format):
+ //   bin   the whole image from address 0 up to the last byte of code (the default)
+ //   seg   only the live segments, see writeSegments
+ //   hex   Intel HEX records of the code and data bytes
+ typedef enum { FORMAT_BIN, FORMAT_SEG, FORMAT_HEX } OutputFormat;
+ 
+ static void growImage(Image *img, int endAddr) {
+     if(endAddr > img->capacity) {
+         int cap = img->capacity ? img->capacity : MEM_SIZE;
+         while(cap < endAddr) cap *= 2;
+         img->bytes = (unsigned char *)realloc(img->bytes, cap);
+         img->live = (unsigned char *)realloc(img->live, cap);
+         if(!img->bytes || !img->live) {
+             perror("realloc");
+             exit(1);
+         }
+         memset(img->bytes + img->capacity, 0, cap - img->capacity);
+         memset(img->live + img->capacity, LIVE_NONE, cap - img->capacity);
+         img->capacity = cap;
+     }
+ }
+ 
+ // Make room for addresses below endAddr.
+ static void reserveImage(Image *img, int endAddr) {
+     growImage(img, endAddr);
+     if(endAddr > img->size)
+         img->size = endAddr;
+ }
+ 
+ static void noteDebugLine(const Line *l);
+ 
+ // Copy a line's code into the image at its computed address; a .space marks its range.
+ static void emitLine(Image *img, const Line *l) {
+     if(lineDirective(l) == DIR_SPACE && (l->section == SECTION_TEXT || l->section == SECTION_DATA)) {
+         int end = l->address + parseImmediate(l->operands);
+         growImage(img, end);
+         for (int addr = l->address; addr < end; addr++)
+             if(img->live[addr] == LIVE_NONE)
+                 img->live[addr] = LIVE_FILL;
+         return;
+     }
+     if(l->codeCount <= 0)
+         return;
+     reserveImage(img, l->address + l->codeCount * l->elementSize);
+     noteDebugLine(l);
+     if(l->section == SECTION_TEXT || l->section == SECTION_DATA) {
+         for (int j = 0; j < l->codeCount; j++) {
+             int addr = l->address + j * l->elementSize;
+             if(l->elementSize == 1) {
+                 img->bytes[addr] = l->code[j] & 0xFF;
+                 img->live[addr] = LIVE_CODE;
+             } else if(l->elementSize == 2) {
+                 img->bytes[addr] = l->code[j] & 0xFF;
+                 img->bytes[addr+1] = (l->code[j] >> 8) & 0xFF;
+                 img->live[addr] = img->live[addr+1] = LIVE_CODE;
+             }
+         }
+     }
+ }
+ 
+ static void freeImage(Image *img) {
+     free(img->bytes);
+     free(img->live);
+     img->bytes = img->live = NULL;
+     img->size = img->capacity = 0;
+ }
+ 
+ // The program starts at _start if it is defined, otherwise at address 0 (as with a bin image).
+ static int entryPoint(void) {
+     Symbol *sym = findSymbol(makeView("_start", "_start" + 6));
+     return (sym && sym->section == SECTION_TEXT) ? sym->address : 0;
+ }
+ 
+ // A run of bytes with the same live state, starting at 'addr'; returns its end.
+ static int liveRun(const Image *img, int addr) {
+     int end = addr;
+     while(end < img->capacity && img->live[end] == img->live[addr]) end++;
+     return end;
+ }
+ 
+ // Segmented image layout (all integers little-endian):
+ //   "Z16S", u16 version (1), u16 segmentCount, u32 entry
+ //   segments: u32 address, u32 length, u8 kind (1 = length bytes follow, 2 = zero fill)
+ // A segment is a run of live bytes, so a program with code at 0 and data at 0xF000 takes a
+ // few dozen bytes instead of a 60KB image. Zero-fill segments (.space) carry no bytes; they
+ // tell the loader the range is part of the program.
+ #define SEG_VERSION 1
+ 
+ static void writeSegments(const Image *img, FILE *fp) {
+     int count = 0;
+     for (int addr = 0; addr < img->capacity; addr = liveRun(img, addr))
+         count += (img->live[addr] != LIVE_NONE);
+     fwrite("Z16S", 1, 4, fp);
+     putU16(fp, SEG_VERSION);
+     putU16(fp, count);
+     putU32(fp, entryPoint());
+     for (int addr = 0, end; addr < img->capacity; addr = end) {
+         end = liveRun(img, addr);
+         if(img->live[addr] == LIVE_NONE)
+             continue;
+         putU32(fp, addr);
+         putU32(fp, end - addr);
+         fputc(img->live[addr], fp);
+         if(img->live[addr] == LIVE_CODE)
+             fwrite(img->bytes + addr, 1, end - addr, fp);
+     }
+ }
+ 
+ // One Intel HEX record: ":" count, address, type, data, checksum.
+ static void hexRecord(FILE *fp, int type, int addr, const unsigned char *data, int n) {
+     unsigned sum = n + ((addr >> 8) & 0xFF) + (addr & 0xFF) + type;
+     fprintf(fp, ":%02X%04X%02X", n, addr & 0xFFFF, type);
+     for (int i = 0; i < n; i++) {
+         fprintf(fp, "%02X", data[i]);
+         sum += data[i];
+     }
+     fprintf(fp, "%02X\n", (0x100 - (sum & 0xFF)) & 0xFF);
+ }
+ 
+ // Intel HEX: data records of up to 16 bytes for the code and data bytes, a start address
+ // record when _start is defined, and the end record. Zero-fill ranges are left out.
+ static void writeHex(const Image *img, FILE *fp) {
+     int upper = 0;
+     for (int addr = 0, end; addr < img->capacity; addr = end) {
+         end = liveRun(img, addr);
+         if(img->live[addr] != LIVE_CODE)
+             continue;
+         for (int a = addr, n; a < end; a += n) {
+             n = (end - a < 16) ? end - a : 16;
+             // Above 64KB, an extended linear address record sets the upper half; no record
+             // crosses a 64KB boundary.
+             if((a >> 16) != upper) {
+                 upper = a >> 16;
+                 unsigned char ext[2] = { (unsigned char)(upper >> 8), (unsigned char)upper };
+                 hexRecord(fp, 4, 0, ext, 2);
+             }
+             if((a & 0xFFFF) + n > 0x10000)
+                 n = 0x10000 - (a & 0xFFFF);
+             hexRecord(fp, 0, a, img->bytes + a, n);
+         }
+     }
+     int entry = entryPoint();
+     if(entry) {
+         unsigned char start[4] = { 0, 0, (unsigned char)(entry >> 8), (unsigned char)entry };
+         hexRecord(fp, 5, 0, start, 4);
+     }
+     hexRecord(fp, 1, 0, NULL, 0);
+ }
+ 
+ static void writeImage(Image *img, const char *binFilename) {
+     reserveImage(img, 1);  // write at least one byte
+     FILE *fp = openOutput(binFilename, as->outputFormat == FORMAT_HEX ? "w" : "wb", "binary file");
+     if(as->outputFormat == FORMAT_SEG)
+         writeSegments(img, fp);
+     else if(as->outputFormat == FORMAT_HEX)
+         writeHex(img, fp);
+     else
+         fwrite(img->bytes, 1, img->size, fp);
+     fclose(fp);
+     freeImage(img);
+     if(!as->quiet)
+         printf("Binary file generated: %s\n", binFilename);
+ }
+ 
+ static void dumpBinary(const char *binFilename) {
+     for (int i = 0; i < as->lineCount; i++)
+         emitLine(as->memoryImage, as->lines[i]);
+     writeImage(as->memoryImage, binFilename);
+ }
+ 
+ // -----------------------
+ // Debug Information (-g)
+ // -----------------------
+ 
+ // With -g, a side file <output>.dbg maps addresses back to the source for z16sim: the symbol
+ // table and, for every line of .text with code, its address range and source position.
+ // Layout (all integers little-endian):
+ //   "Z16D", u16 version (1), u16 fileCount, u32 symbolCount, u32 lineCount
+ //   files:    u16 name length, name (index 0 is the main source)
+ //   symbols:  u16 address, u8 section (1 = .text, 2 = .data, 3 = absolute), u8 reserved,
+ //             u16 name length, name; sorted by address
+ //   lines:    u16 address, u16 size, u16 file, u32 line number; sorted by address
+ #define DBG_VERSION 1
+ 
+ typedef struct DebugLine {
+     int address, size, file, lineNo;
+ } DebugLine;
+ 
+ // Called for each line as it goes into the memory image, in either mode.
+ static void noteDebugLine(const Line *l) {
+     if(!as->debugInfo || l->section != SECTION_TEXT)
+         return;
+     if(as->debugLineCount == as->debugLineCapacity) {
+         as->debugLineCapacity = as->debugLineCapacity ? as->debugLineCapacity * 2 : 1024;
+         as->debugLines = (DebugLine *)realloc(as->debugLines, as->debugLineCapacity * sizeof(DebugLine));
+         if(!as->debugLines) { perror("realloc"); exit(1); }
+     }
+     DebugLine *d = &as->debugLines[as->debugLineCount++];
+     d->address = l->address;
+     d->size = l->codeCount * l->elementSize;
+     d->file = l->file;
+     d->lineNo = l->lineNo;
+ }
+ 
+ static int compareDebugLines(const void *a, const void *b) {
+     return ((const DebugLine *)a)->address - ((const DebugLine *)b)->address;
+ }
+ 
+ static int compareSymbolAddresses(const void *a, const void *b) {
+     return (*(Symbol * const *)a)->address - (*(Symbol * const *)b)->address;
+ }
+ 
+ static void writeDebugInfo(const char *dbgFilename) {
+     Symbol **syms = (Symbol **)malloc((as->symbolCount + 1) * sizeof(Symbol *));
+     if(!syms) { perror("malloc"); exit(1); }
+     int count = 0;
+     for (Symbol *sym = as->symbolTable; sym; sym = sym->next)
+         if(sym->defined)
+             syms[count++] = sym;
+     qsort(syms, count, sizeof(Symbol *), compareSymbolAddresses);
+     qsort(as->debugLines, as->debugLineCount, sizeof(DebugLine), compareDebugLines);
+     FILE *fp = openOutput(dbgFilename, "wb", "debug file");
+     fwrite("Z16D", 1, 4, fp);
+     putU16(fp, DBG_VERSION);
+     putU16(fp, as->sourceCount);
+     putU32(fp, count);
+     putU32(fp, as->debugLineCount);
+     for (int i = 0; i < as->sourceCount; i++) {
+         putU16(fp, (unsigned)strlen(as->sources[i].name));
+         fputs(as->sources[i].name, fp);
+     }
+     for (int i = 0; i < count; i++) {
+         putU16(fp, syms[i]->address);
+         fputc(syms[i]->section == SECTION_TEXT ? 1 : syms[i]->section == SECTION_DATA ? 2 : 3, fp);
+         fputc(0, fp);
+         putU16(fp, (unsigned)strlen(syms[i]->name));
+         fputs(syms[i]->name, fp);
+     }
+     for (int i = 0; i < as->debugLineCount; i++) {
+         putU16(fp, as->debugLines[i].address);
+         putU16(fp, as->debugLines[i].size);
+         putU16(fp, as->debugLines[i].file);
+         putU32(fp, as->debugLines[i].lineNo);
+     }
+     fclose(fp);
+     free(syms);
+     free(as->debugLines);
+     as->debugLines = NULL;
+     as->debugLineCount = as->debugLineCapacity = 0;
+     if(!as->quiet)
+         printf("Debug file generated: %s\n", dbgFilename);
+ }
+ 
+ // -----------------------
+ // Relocatable Object Output (-c)
+ // -----------------------
+ 
+ // With -c, each section is assembled from offset 0 and written out with the symbol table and
+ // the relocations left by pass 2; z16ld places the sections and resolves the references.
+ // Object file layout (all integers little-endian):
+ //   "Z16O", u16 version (2), u16 reserved
+ //   u32 textSize, u32 dataSize, u32 symbolCount, u32 relocCount
+ //   .text bytes, .data bytes
+ //   symbols:  u8 section, u8 flags (1 = global), u16 value, u16 name length, name
+ //   relocs:   u8 section, u8 kind (FixupKind), u16 offset, u32 symbol index
+ // Section codes are 0 = undefined, 1 = .text, 2 = .data, 3 = absolute.
+ #define OBJ_VERSION 2
+ 
+ #ifndef Z16ASM_LIBRARY
+ static int objectSection(Section sec) {
+     return (sec == SECTION_TEXT) ? 1 : (sec == SECTION_DATA) ? 2 : 3;
+ }
+ 
+ static void writeObject(const char *objFilename) {
+     Image text = {NULL, NULL, 0, 0}, data = {NULL, NULL, 0, 0};
+     int relocCount = 0;
+     for (int i = 0; i < as->lineCount; i++) {
+         Line *l = as->lines[i];
+         Image *img = (l->section == SECTION_TEXT) ? &text : (l->section == SECTION_DATA) ? &data : NULL;
+         if(!img)
+             continue;
+         emitLine(img, l);
+         if(lineDirective(l) == DIR_SPACE)
+             reserveImage(img, l->address + parseImmediate(l->operands));
+         for (Reloc *r = l->relocs; r; r = r->next)
+             relocCount++;
+     }
+     // Defined symbols first, in definition order, then the undefined ones the relocations name.
+     for (int i = 0; i < as->lineCount; i++)
+         for (Reloc *r = as->lines[i]->relocs; r; r = r->next)
+             internSymbol(r->label);
+     int symbolTotal = 0;
+     Symbol **syms = (Symbol **)malloc((as->symbolCount + 1) * sizeof(Symbol *));
+     if(!syms) { perror("malloc"); exit(1); }
+     for (Symbol *s = as->symbolTable; s; s = s->next)
+         symbolTotal++;
+     int n = symbolTotal;
+     for (Symbol *s = as->symbolTable; s; s = s->next) {
+         s->index = --n;
+         syms[s->index] = s;
+     }
+     for (int i = 0; i < as->lineCount; i++) {
+         for (Reloc *r = as->lines[i]->relocs; r; r = r->next) {
+             Symbol *s = internSymbol(r->label);   // already in the table
+             if(s->index < 0) {
+                 s->index = symbolTotal;
+                 syms[symbolTotal++] = s;
+             }
+         }
+     }
+     FILE *fp = openOutput(objFilename, "wb", "object file");
+     fwrite("Z16O", 1, 4, fp);
+     putU16(fp, OBJ_VERSION);
+     putU16(fp, 0);
+     putU32(fp, text.size);
+     putU32(fp, data.size);
+     putU32(fp, symbolTotal);
+     putU32(fp, relocCount);
+     fwrite(text.bytes, 1, text.size, fp);
+     fwrite(data.bytes, 1, data.size, fp);
+     for (int i = 0; i < symbolTotal; i++) {
+         Symbol *s = syms[i];
+         fputc(s->defined ? objectSection(s->section) : 0, fp);
+         fputc(s->global ? 1 : 0, fp);
+         putU16(fp, s->defined ? s->address : 0);
+         putU16(fp, (unsigned)strlen(s->name));
+         fputs(s->name, fp);
+     }
+     for (int i = 0; i < as->lineCount; i++) {
+         for (Reloc *r = as->lines[i]->relocs; r; r = r->next) {
+             fputc(objectSection(as->lines[i]->section), fp);
+             fputc(r->kind, fp);
+             putU16(fp, r->site);
+             putU32(fp, internSymbol(r->label)->index);
+         }
+     }
+     fclose(fp);
+     free(syms);
+     freeImage(&text);
+     freeImage(&data);
+     printf("Object file generated: %s\n", objFilename);
+ }
+ #endif
+ 
+ // -----------------------
+ // Incremental Assembly Cache (--cache)
+ // -----------------------
+ 
+ // Reassembling after a small edit re-encodes mostly unchanged lines. With --cache, pass 2
+ // splits the lines into chunks that start at each label (at most CACHE_CHUNK lines) and keys
+ // each chunk by a hash of its section, start address and text. The cache file keeps every
+ // chunk's code words and the symbols its lines resolved; a chunk is reused only if its key
+ // is found and none of those symbols has moved. The other chunks are encoded as usual and
+ // the file is rewritten if anything changed.
+ // Cache file layout (all integers little-endian):
+ //   "Z16K", u16 version, u16 reserved, u32 symbol count, u32 chunk count
+ //   symbol:  u32 address, u16 name length, name
+ //   chunk:   u32 record length (after this field), u32 key (low), u32 key (high),
+ //            u32 line count, u32 word count, u32 textLoc, u32 dataLoc, u8 textOrg,
+ //            u8 dataOrg, u32 use count, u32 symbol index per use,
+ //            per line: u8 elementSize, u32 code count; then the u16 code words
+ #define CACHE_CHUNK 256
+ #define CACHE_VERSION 2
+ #define CACHE_CHUNK_HEADER 30    // bytes of a chunk record up to its symbol indices
+ 
+ typedef struct CacheEntry {
+     uint64_t key;
+     const unsigned char *record;   // chunk record in the cache file (after its length)
+     uint32_t length;
+ } CacheEntry;
+ 
+ static void freeCache(void) {
+     closeSource(&as->cacheFile);
+     free(as->cacheSymbols);
+     free(as->cacheEntries);
+     free(as->cacheSlots);
+     as->cacheSymbols = NULL;
+     as->cacheEntries = NULL;
+     as->cacheSlots = NULL;
+     as->cacheSymbolCount = as->cacheSlotCount = as->cacheFileChunks = as->cacheNext = 0;
+ }
+ 
+ #ifndef Z16ASM_LIBRARY
+ static uint32_t getU32(const unsigned char *p) {
+     return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+ }
+ 
+ // Hash of a byte range, eight bytes at a time.
+ static uint64_t hashBytes(uint64_t h, const void *data, size_t n) {
+     const unsigned char *p = (const unsigned char *)data;
+     uint64_t w;
+     for (; n >= 8; p += 8, n -= 8) {
+         memcpy(&w, p, 8);
+         h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+         h ^= h >> 29;
+     }
+     w = 0;
+     memcpy(&w, p, n);
+     h = (h ^ w ^ ((uint64_t)n << 56)) * 0x9E3779B97F4A7C15ULL;
+     return h ^ (h >> 32);
+ }
+ 
+ // The lines of a chunk are adjacent in the source buffer. The sizes chosen by branch
+ // relaxation (and li/la) and the lines changed by -O are part of the key.
+ static uint64_t chunkKey(const EncodeChunk *ch) {
+     const Line *first = as->lines[ch->first], *last = as->lines[ch->last - 1];
+     uint64_t h = hashBytes(0, &first->section, sizeof(first->section));
+     h = hashBytes(h, &first->address, sizeof(first->address));
+     if(as->relaxedSites || as->loadsExpanded || as->peepholeRemoved || as->peepholeRewritten) {
+         for (int i = ch->first; i < ch->last; i++) {
+             if(as->lines[i]->relax || as->lines[i]->rewritten) {
+                 int state[3] = { as->lines[i]->relax, as->lines[i]->rewritten, as->relaxScratch };
+                 h = hashBytes(h, state, sizeof(state)) + (i - ch->first);
+             }
+         }
+     }
+     // Lines from included files and macro expansions are not adjacent; each is hashed alone.
+     if(as->scatteredLines) {
+         for (int i = ch->first; i < ch->last; i++)
+             h = hashBytes(h, as->lines[i]->original.ptr, as->lines[i]->original.len) + as->lines[i]->file;
+         return h;
+     }
+     return hashBytes(h, first->original.ptr, last->original.ptr + last->original.len - first->original.ptr);
+ }
+ 
+ static uint32_t *cacheSlot(uint64_t key) {
+     unsigned mask = as->cacheSlotCount - 1;
+     for (unsigned i = (unsigned)(key ^ (key >> 32)) & mask; ; i = (i + 1) & mask)
+         if(as->cacheSlots[i] == 0 || as->cacheEntries[as->cacheSlots[i] - 1].key == key)
+             return &as->cacheSlots[i];
+ }
+ 
+ // Chunks mostly come back in the order they were written, so the entry after the last one
+ // found is tried first; the hash index is only built when that fails.
+ static CacheEntry *findCacheEntry(uint64_t key) {
+     if(as->cacheNext < as->cacheFileChunks && as->cacheEntries[as->cacheNext].key == key)
+         return &as->cacheEntries[as->cacheNext++];
+     if(as->cacheFileChunks == 0)
+         return NULL;
+     if(!as->cacheSlots) {
+         for (as->cacheSlotCount = 16; as->cacheSlotCount < 2 * as->cacheFileChunks; as->cacheSlotCount *= 2)
+             ;
+         as->cacheSlots = (uint32_t *)calloc(as->cacheSlotCount, sizeof(uint32_t));
+         if(!as->cacheSlots) { perror("calloc"); exit(1); }
+         for (uint32_t c = 0; c < as->cacheFileChunks; c++) {
+             uint32_t *slot = cacheSlot(as->cacheEntries[c].key);
+             if(*slot == 0)
+                 *slot = c + 1;
+         }
+     }
+     uint32_t *slot = cacheSlot(key);
+     if(*slot == 0)
+         return NULL;
+     as->cacheNext = *slot;
+     return &as->cacheEntries[*slot - 1];
+ }
+ 
+ // Read the cache file, look up its symbols and index its chunks. A missing, stale or
+ // damaged file only costs cache misses.
+ static void loadCache(void) {
+     if(openSource(as->cacheFilename, &as->cacheFile) != 0)
+         return;
+     const unsigned char *p = (const unsigned char *)as->cacheFile.data, *end = p + as->cacheFile.size;
+     if(as->cacheFile.size < 16 || memcmp(p, "Z16K", 4) != 0 || (p[4] | (p[5] << 8)) != CACHE_VERSION)
+         return;
+     uint32_t symbols = getU32(p + 8), chunks = getU32(p + 12);
+     p += 16;
+     as->cacheSymbols = (Symbol **)calloc(symbols ? symbols : 1, sizeof(Symbol *));
+     if(!as->cacheSymbols) { perror("calloc"); exit(1); }
+     // The file lists the symbols in the order of the symbol table it was written from, so
+     // the current table is walked alongside and only names that differ are looked up.
+     Symbol *expect = as->symbolTable;
+     for (uint32_t i = 0; i < symbols; i++) {
+         if(end - p < 6 || end - p - 6 < (p[4] | (p[5] << 8)))
+             return;
+         int address = (int32_t)getU32(p);
+         unsigned len = p[4] | (p[5] << 8);
+         const char *name = (const char *)p + 6;
+         Symbol *sym = expect;
+         if(!sym || strncmp(sym->name, name, len) != 0 || sym->name[len] != '\0')
+             sym = findSymbol(makeView(name, name + len));
+         as->cacheSymbols[i] = (sym && sym->address == address) ? sym : NULL;
+         expect = sym ? sym->next : expect;
+         p += 6 + len;
+     }
+     as->cacheSymbolCount = symbols;
+     as->cacheEntries = (CacheEntry *)malloc((chunks ? chunks : 1) * sizeof(CacheEntry));
+     if(!as->cacheEntries) { perror("malloc"); exit(1); }
+     uint32_t c;
+     for (c = 0; c < chunks; c++) {
+         if(end - p < 4 || (uint32_t)(end - p - 4) < getU32(p) || getU32(p) < CACHE_CHUNK_HEADER)
+             break;
+         as->cacheEntries[c].length = getU32(p);
+         as->cacheEntries[c].key = getU32(p + 4) | ((uint64_t)getU32(p + 8) << 32);
+         as->cacheEntries[c].record = p + 4;
+         p += 4 + as->cacheEntries[c].length;
+     }
+     as->cacheFileChunks = c;
+ }
+ 
+ // Fill a chunk's lines from its cache record if none of the symbols it used has moved.
+ static int applyCached(EncodeChunk *ch, const CacheEntry *e) {
+     const unsigned char *r = e->record;
+     uint32_t lineTotal = getU32(r + 8), words = getU32(r + 12), uses = getU32(r + 26);
+     if(lineTotal != (uint32_t)(ch->last - ch->first) ||
+        (uint64_t)CACHE_CHUNK_HEADER + 4ull * uses + 5ull * lineTotal + 2ull * words != e->length)
+         return 0;
+     const unsigned char *p = r + CACHE_CHUNK_HEADER;
+     for (uint32_t u = 0; u < uses; u++, p += 4) {
+         uint32_t index = getU32(p);
+         if(index >= as->cacheSymbolCount || !as->cacheSymbols[index])
+             return 0;
+     }
+     const unsigned char *w = p + 5 * lineTotal;
+     uint16_t *code = (uint16_t *)arenaAlloc(&as->lineArena, (words ? words : 1) * sizeof(uint16_t));
+     uint32_t used = 0;
+     for (int i = ch->first; i < ch->last; i++, p += 5) {
+         Line *line = as->lines[i];
+         uint32_t n = getU32(p + 1);
+         if(n > words - used)
+             return 0;
+         line->elementSize = p[0];
+         line->codeCount = (int)n;
+         line->code = n ? code + used : NULL;
+         for (uint32_t j = 0; j < n; j++, w += 2)
+             code[used + j] = w[0] | (w[1] << 8);
+         used += n;
+     }
+     ch->textLoc = (int32_t)getU32(r + 16);
+     ch->dataLoc = (int32_t)getU32(r + 20);
+     ch->textOrg = r[24];
+     ch->dataOrg = r[25];
+     ch->cached = (int)(e - as->cacheEntries) + 1;
+     return 1;
+ }
+ 
+ static void writeCacheChunk(FILE *fp, const EncodeChunk *ch, const CacheEntry *e) {
+     uint32_t words = 0, uses = e ? getU32(e->record + 26) : (uint32_t)ch->uses.count;
+     int lineTotal = ch->last - ch->first;
+     for (int i = ch->first; i < ch->last; i++)
+         words += as->lines[i]->codeCount;
+     putU32(fp, CACHE_CHUNK_HEADER + 4 * uses + 5 * lineTotal + 2 * words);
+     putU32(fp, (unsigned long)(ch->key & 0xFFFFFFFFu));
+     putU32(fp, (unsigned long)(ch->key >> 32));
+     putU32(fp, lineTotal);
+     putU32(fp, words);
+     putU32(fp, (unsigned long)(uint32_t)ch->textLoc);
+     putU32(fp, (unsigned long)(uint32_t)ch->dataLoc);
+     fputc(ch->textOrg, fp);
+     fputc(ch->dataOrg, fp);
+     putU32(fp, uses);
+     // A reused record's symbol indices refer to the old file's table.
+     for (uint32_t u = 0; u < uses; u++)
+         putU32(fp, e ? as->cacheSymbols[getU32(e->record + CACHE_CHUNK_HEADER + 4 * u)]->index
+                      : ch->uses.items[u]->index);
+     if(e) {
+         fwrite(e->record + CACHE_CHUNK_HEADER + 4 * uses, 1, 5 * lineTotal + 2 * words, fp);
+         return;
+     }
+     for (int i = ch->first; i < ch->last; i++) {
+         fputc(as->lines[i]->elementSize, fp);
+         putU32(fp, as->lines[i]->codeCount);
+     }
+     for (int i = ch->first; i < ch->last; i++)
+         for (int j = 0; j < as->lines[i]->codeCount; j++)
+             putU16(fp, as->lines[i]->code[j]);
+ }
+ 
+ // Write the cache for this build through a temporary file.
+ static void writeCache(EncodeChunk *chunks, int count) {
+     size_t n = strlen(as->cacheFilename);
+     char *tmpFilename = (char *)malloc(n + 5);
+     if(!tmpFilename) { perror("malloc"); exit(1); }
+     memcpy(tmpFilename, as->cacheFilename, n);
+     strcpy(tmpFilename + n, ".tmp");
+     FILE *fp = openOutput(tmpFilename, "wb", "cache file");
+     int symbols = 0;
+     for (Symbol *s = as->symbolTable; s; s = s->next)
+         s->index = symbols++;
+     fwrite("Z16K", 1, 4, fp);
+     putU16(fp, CACHE_VERSION);
+     putU16(fp, 0);
+     putU32(fp, symbols);
+     putU32(fp, count);
+     for (Symbol *s = as->symbolTable; s; s = s->next) {
+         size_t len = strlen(s->name);
+         putU32(fp, (unsigned long)(uint32_t)s->address);
+         putU16(fp, (unsigned)len);
+         fwrite(s->name, 1, len, fp);
+     }
+     for (int c = 0; c < count; c++)
+         writeCacheChunk(fp, &chunks[c], chunks[c].cached ? &as->cacheEntries[chunks[c].cached - 1] : NULL);
+     if(fclose(fp) != 0 || rename(tmpFilename, as->cacheFilename) != 0) {
+         int saved = errno;
+         remove(tmpFilename);
+         free(tmpFilename);
+         errorSource = NULL;
+         encodeError("Error writing cache file %s: %s\n", as->cacheFilename, strerror(saved));
+     }
+     free(tmpFilename);
+ }
+ 
+ // --verify-cache: encode every reused chunk again and compare it with the cached code.
+ static void verifyCachedChunks(EncodeChunk *chunks, int count) {
+     for (int c = 0; c < count; c++) {
+         EncodeChunk *ch = &chunks[c];
+         if(!ch->cached)
+             continue;
+         int n = ch->last - ch->first;
+         Line *cached = (Line *)malloc(n * sizeof(Line));
+         if(!cached) { perror("malloc"); exit(1); }
+         for (int i = 0; i < n; i++) {
+             cached[i] = *as->lines[ch->first + i];
+             as->lines[ch->first + i]->code = NULL;
+             as->lines[ch->first + i]->codeCount = 0;
+         }
+         EncodeChunk fresh;
+         memset(&fresh, 0, sizeof(fresh));
+         fresh.first = ch->first;
+         fresh.last = ch->last;
+         if(!encodeChunk(&fresh)) {
+             fputs(fresh.error, stderr);
+             exit(1);
+         }
+         int bad = -1;
+         for (int i = 0; i < n && bad < 0; i++) {
+             const Line *a = &cached[i], *b = as->lines[ch->first + i];
+             if(a->codeCount != b->codeCount || a->elementSize != b->elementSize ||
+                (a->codeCount > 0 && memcmp(a->code, b->code, a->codeCount * sizeof(uint16_t)) != 0))
+                 bad = i;
+         }
+         if(bad < 0 && (fresh.textLoc != ch->textLoc || fresh.dataLoc != ch->dataLoc ||
+                        fresh.textOrg != ch->textOrg || fresh.dataOrg != ch->dataOrg))
+             bad = n - 1;
+         free(cached);
+         if(bad >= 0) {
+             fprintf(stderr, "Error on line %d: Cached code differs from a full rebuild\n",
+                     as->lines[ch->first + bad]->lineNo);
+             remove(as->cacheFilename);
+             exit(1);
+         }
+     }
+ }
+ 
+ // Pass 2 with --cache: reuse what the cache has, encode the rest, then update the cache.
+ static void pass2Cached(void) {
+     as->loc_text = 0;
+     as->loc_data = 0;
+     EncodeChunk *chunks = (EncodeChunk *)calloc(as->lineCount ? as->lineCount : 1, sizeof(EncodeChunk));
+     if(!chunks) { perror("calloc"); exit(1); }
+     int count = 0;
+     for (int i = 0; i < as->lineCount; i++) {
+         if(count == 0 || as->lines[i]->label.len || i - chunks[count - 1].first >= CACHE_CHUNK)
+             chunks[count++].first = i;
+         chunks[count - 1].last = i + 1;
+     }
+     loadCache();
+     int encodeLines = 0;
+     for (int c = 0; c < count; c++) {
+         EncodeChunk *ch = &chunks[c];
+         ch->key = chunkKey(ch);
+         CacheEntry *e = findCacheEntry(ch->key);
+         if(e && applyCached(ch, e))
+             continue;
+         encodeLines += ch->last - ch->first;
+     }
+     as->recordSymbolUses = 1;
+ #ifndef _WIN32
+     if(as->encodeThreads > 1 && encodeLines >= 2 * ENCODE_CHUNK)
+         encodeOnWorkers(chunks, count);
+     else
+ #endif
+     for (int c = 0; c < count; c++)
+         if(!chunks[c].cached)
+             encodeChunk(&chunks[c]);
+     as->recordSymbolUses = 0;
+     combineChunks(chunks, count);
+ 
+     as->cacheChunks = count;
+     as->cacheLines = as->lineCount;
+     as->cacheLinesEncoded = encodeLines;
+     as->cacheHits = 0;
+     for (int c = 0; c < count; c++)
+         as->cacheHits += (chunks[c].cached != 0);
+     if(as->verifyCache)
+         verifyCachedChunks(chunks, count);
+     // An unchanged build would write the same file again.
+     if(as->cacheHits != count || as->cacheFileChunks != (uint32_t)count)
+         writeCache(chunks, count);
+     for (int c = 0; c < count; c++)
+         free(chunks[c].uses.items);
+     free(chunks);
+ }
+ #endif
+ 
+ // -----------------------
+ // One-Pass Assembly
+ // -----------------------
+ 
+ #ifndef Z16ASM_LIBRARY
+ // Patch a forward reference now that its label is at 'target', in the memory image and in
+ // the part of the listing that is still buffered.
+ static void patchFixup(const Fixup *f, int target, Listing *lst) {
+     uint16_t word = 0;
+     if(f->site >= 0)
+         word = as->memoryImage->bytes[f->site] | (as->memoryImage->bytes[f->site+1] << 8);
+     if(!patchField(f->kind, &word, f->site, target)) {
+         fprintf(stderr, "Error on line %d: %s offset out of range\n", f->lineNo, (f->kind == FIX_B) ? "Branch" : "Jump");
+         exit(1);
+     }
+     if(f->site >= 0) {
+         as->memoryImage->bytes[f->site] = word & 0xFF;
+         as->memoryImage->bytes[f->site+1] = (word >> 8) & 0xFF;
+     }
+     if(f->listingPos >= 0) {
+         char hex[8];
+         snprintf(hex, sizeof(hex), "%04X", word);
+         memcpy(lst->buf + (f->listingPos - lst->flushed), hex, 4);
+     }
+ }
+ 
+ // Patch every fixup waiting on a newly defined symbol and recycle them.
+ static void resolveFixups(Symbol *sym, Listing *lst) {
+     while(sym->fixups) {
+         Fixup *f = sym->fixups;
+         sym->fixups = f->next;
+         patchFixup(f, sym->address, lst);
+         f->next = as->freeFixups;
+         as->freeFixups = f;
+         as->pendingFixups--;
+     }
+ }
+ 
+ // Report the earliest reference to a label that was never defined.
+ static void checkUnresolved(void) {
+     const Fixup *first = NULL;
+     for (unsigned i = 0; i < as->symbolSlotCount; i++) {
+         Symbol *sym = as->symbolSlots[i];
+         if(!sym || sym->defined)
+             continue;
+         for (const Fixup *f = sym->fixups; f; f = f->next)
+             if(!first || f->lineNo < first->lineNo)
+                 first = f;
+     }
+     if(first) {
+         fprintf(stderr, "Error on line %d: Undefined label '%.*s'\n", first->lineNo, first->label.len, first->label.ptr);
+         exit(1);
+     }
+ }
+ 
+ // The listing is streamed while assembling; an error exit must not leave a partial one behind.
+ static char partialListing[256] = "";
+ 
+ static void removePartialListing(void) {
+     if(partialListing[0])
+         remove(partialListing);
+ }
+ 
+ // Parse, place and encode each line as it is read, streaming the listing and filling the
+ // memory image directly. Only the current line is kept; its storage is reused for the next.
+ // Place, encode and list one line that readLine passes on.
+ static void streamLine(Line *line) {
+     defineLabel(line);
+     if(line->label.ptr)
+         resolveFixups(findSymbol(line->label), as->streamListing);
+     assignAddress(line);
+     View label;
+     if(lineDirective(line) == DIR_EQU) {
+         View rest = line->operands;
+         nextField(&rest, ", \t", &label);
+         resolveFixups(findSymbol(label), as->streamListing);
+     }
+     if(loadOperand(line, &label) == 2) {
+         // The address of a label defined further on is not known yet.
+         Symbol *sym = findSymbol(label);
+         line->relax = (sym && sym->defined) ? loadWords(sym->address) - 1 : 1;
+         as->loc_text += 2 * line->relax;
+     }
+     as->lineFixups = NULL;
+     encodeLine(line, &as->streamText, &as->streamData);
+     emitLine(as->memoryImage, line);
+     long codePos = listLine(as->streamListing, line);
+     for (Fixup *f = as->lineFixups; f; f = f->lineNext)
+         f->listingPos = codePos + 5 * f->element;
+     if(as->pendingFixups == 0 && as->streamListing->len >= LISTING_CHUNK)
+         flushListing(as->streamListing);
+ }
+ 
+ static int assembleOnePass(const char *data, size_t size, const char *sourceFilename) {
+     char listingFilename[256];
+     listingName(sourceFilename, listingFilename);
+     Listing lst;
+     as->streamListing = &lst;
+     openListing(as->streamListing, listingFilename);
+     strcpy(partialListing, listingFilename);
+     atexit(removePartialListing);
+     const char *p = data, *limit = data + size;
+     int currentLineNo = 0;
+     as->placeLine = streamLine;
+     while(p < limit) {
+         LineScan ls;
+         scanLine(p, limit, &ls);
+         const char *next = (ls.end < limit) ? ls.end + 1 : limit;
+         currentLineNo++;
+         Line *line = newLine(currentLineNo, makeView(p, next));
+         p = next;
+         parseSourceLine(line, &ls);
+         readLine(line, 0);
+         arenaReset(&as->lineArena);
+     }
+     endSources();
+     checkUnresolved();
+     closeListing(as->streamListing);
+     partialListing[0] = '\0';
+     if(!as->quiet)
+         printf("Listing file generated: %s\n", listingFilename);
+     // Report the emitted sizes, like pass 2 does.
+     as->loc_text = as->streamText;
+     as->loc_data = as->streamData;
+     return currentLineNo;
+ }
+ #endif
+ 
+ // -----------------------
+ // Verbose Dump: Symbol Table and Memory Usage
+ // -----------------------
+ 
+ #ifndef Z16ASM_LIBRARY
+ static void dumpVerbose() {
      printf("\n--- Symbol Table ---\n");
-     Symbol *cur = symbolTable;
+     Symbol *cur = as->symbolTable;
      while(cur) {
          printf("%-10s  0x%04X  %s\n", cur->name, cur->address,
                 (cur->section==SECTION_TEXT) ? "TEXT" : (cur->section==SECTION_DATA ? "DATA" : "NONE"));
          cur = cur->next;
      }
      printf("\nMemory usage:\n");
-     printf("  Text section: %d bytes\n", loc_text);
-     printf("  Data section: %d bytes\n", loc_data);
+     printf("  Text section: %d bytes\n", as->loc_text);
+     printf("  Data section: %d bytes\n", as->loc_data);
+     if(as->optimize)
+         printf("  Peephole (-O): %d instructions removed, %d rewritten, %d bytes saved (%.1f%% of %d)\n",
+                as->peepholeRemoved, as->peepholeRewritten, 2 * as->peepholeRemoved,
+                as->textInstructions ? 100.0 * as->peepholeRemoved / as->textInstructions : 0.0, as->textInstructions);
+     if(as->relaxedSites)
+         printf("  Relaxed branches/jumps: %d sites, %d bytes added\n", as->relaxedSites, as->relaxedBytes);
+     if(as->loadSites)
+         printf("  Constant loads (li/la): %d sites, %d take two words\n", as->loadSites, as->loadsExpanded);
+     if(as->cacheFilename) {
+         printf("\nCache: %d of %d chunks reused (%.1f%%), %d of %d lines encoded\n", as->cacheHits, as->cacheChunks,
+                as->cacheChunks ? 100.0 * as->cacheHits / as->cacheChunks : 0.0, as->cacheLinesEncoded, as->cacheLines);
+     }
+ }
+ #endif
+ 
+ // -----------------------
+ // Code Size Report (--report)
+ // -----------------------
+ 
+ // --report splits .text into functions and prints the instruction count, size, instruction mix
+ // and a static cycle estimate of each. A function starts at a .text label that is .globl, is
+ // _start or main, or is called by jal (at every .text label if there is no such label) and
+ // runs to the next one. An instruction is classified by its type; the words of relaxed branches
+ // and of li/la are classified by their opcode, so they count as the instructions they became. Cycles add up a latency per class (--latency):
+ // 'cycles' is one pass over the function with no branch taken, and 'block' the costliest basic
+ // block (straight-line code between labels and control transfers).
+ typedef enum { CLASS_R, CLASS_I, CLASS_B, CLASS_L, CLASS_J, CLASS_U, CLASS_ECALL, CLASS_COUNT } InstClass;
+ 
+ #ifndef Z16ASM_LIBRARY
+ static const char *classNames[CLASS_COUNT] = { "R", "I", "B", "L", "J", "U", "ecall" };
+ 
+ // Default latencies: memory accesses and control transfers cost two cycles, the rest one.
+ static const int defaultLatency[CLASS_COUNT] = { 1, 1, 2, 2, 2, 1, 1 };
+ 
+ // Opcodes 3 (loads) and 4 (stores) are both memory accesses (class L).
+ static const InstClass opcodeClass[8] = { CLASS_R, CLASS_I, CLASS_B, CLASS_L, CLASS_L, CLASS_J, CLASS_U, CLASS_ECALL };
+ 
+ // Parse "--latency R=1,L=3,ecall=20": classes not named keep their latency. Returns 0 on error.
+ static int parseLatencies(const char *spec, int *latency) {
+     View rest = makeView(spec, spec + strlen(spec)), field;
+     while(nextField(&rest, ",", &field)) {
+         const char *eq = memchr(field.ptr, '=', field.len);
+         if(!eq)
+             return 0;
+         View key = trimView(makeView(field.ptr, eq));
+         char name[8];
+         snprintf(name, sizeof(name), "%.*s", key.len, key.ptr);
+         int c = 0;
+         while(c < CLASS_COUNT && cmpIgnoreCase(name, classNames[c]) != 0)
+             c++;
+         char *end;
+         long value = strtol(eq + 1, &end, 0);
+         if(c == CLASS_COUNT || value < 0 || end == eq + 1)
+             return 0;
+         latency[c] = (int)value;
+     }
+     return 1;
+ }
+ 
+ static const InstClass typeClass[] = { CLASS_R, CLASS_I, CLASS_B, CLASS_L, CLASS_J, CLASS_U, CLASS_ECALL };
+ 
+ // Class of word k of a .text line, and whether it transfers control (which ends a basic block).
+ // jr and jalr are the R-type control transfers.
+ static InstClass wordClass(const Line *l, const InstructionDef *inst, int k, int *control) {
+     if(inst && !l->relax && strcmp(inst->mnemonic, "li") != 0 && strcmp(inst->mnemonic, "la") != 0) {
+         InstClass c = typeClass[inst->type];
+         *control = c == CLASS_B || c == CLASS_J || c == CLASS_ECALL ||
+                    strcmp(inst->mnemonic, "jr") == 0 || strcmp(inst->mnemonic, "jalr") == 0;
+         return c;
+     }
+     uint16_t word = l->code[k];
+     int opcode = word & 7, funct3 = (word >> 3) & 7, funct4 = word >> 12;
+     *control = opcode == 2 || opcode == 5 || opcode == 7 ||
+                (opcode == 0 && funct3 == 0 && (funct4 == 4 || funct4 == 8));
+     return opcodeClass[opcode];
+ }
+ 
+ typedef struct {
+     const char *name;
+     int address;
+     int words;
+     int mix[CLASS_COUNT];
+     long cycles;
+     long block;           // cycles of the costliest basic block
+ } FunctionReport;
+ 
+ static int compareFunctions(const void *a, const void *b) {
+     return ((const FunctionReport *)a)->address - ((const FunctionReport *)b)->address;
+ }
+ 
+ static int comparePointers(const void *a, const void *b) {
+     uintptr_t x = (uintptr_t)*(void *const *)a, y = (uintptr_t)*(void *const *)b;
+     return (x > y) - (x < y);
+ }
+ 
+ // Find the functions: .text symbols that start one, sorted by address, one per address. A
+ // function starts at a .globl symbol, _start, main or a jal target. A source with no .globl
+ // marks no entry points, so there every .text label that no branch or j goes to starts one too
+ // (the labels inside a function are branch targets). With none of these, every label counts.
+ static int findFunctions(FunctionReport **out) {
+     int capacity = 16, count = 0, calls = 0, branches = 0, globals = 0;
+     FunctionReport *fns = (FunctionReport *)calloc(capacity, sizeof(FunctionReport));
+     Symbol **called = (Symbol **)malloc((as->lineCount + 1) * sizeof(Symbol *));
+     Symbol **branched = (Symbol **)malloc((as->lineCount + 1) * sizeof(Symbol *));
+     if(!fns || !called || !branched) { perror("malloc"); exit(1); }
+     for (int i = 0; i < as->lineCount; i++) {
+         InstructionDef *inst = lineInstruction(as->lines[i]);
+         if(inst && as->lines[i]->target) {
+             if(strcmp(inst->mnemonic, "jal") == 0)
+                 called[calls++] = as->lines[i]->target;
+             else if(inst->type == INST_B || inst->type == INST_J)
+                 branched[branches++] = as->lines[i]->target;
+         }
+     }
+     qsort(called, calls, sizeof(Symbol *), comparePointers);
+     qsort(branched, branches, sizeof(Symbol *), comparePointers);
+     for (Symbol *s = as->symbolTable; s; s = s->next)
+         globals += s->global;
+     for (int pass = 0; pass < 2 && count == 0; pass++) {
+         for (Symbol *s = as->symbolTable; s; s = s->next) {
+             if(s->section != SECTION_TEXT || !s->defined)
+                 continue;
+             int entry = pass || s->global || strcmp(s->name, "_start") == 0 || strcmp(s->name, "main") == 0 ||
+                         bsearch(&s, called, calls, sizeof(Symbol *), comparePointers) ||
+                         (globals == 0 && !bsearch(&s, branched, branches, sizeof(Symbol *), comparePointers));
+             if(!entry)
+                 continue;
+             if(count == capacity) {
+                 capacity *= 2;
+                 fns = (FunctionReport *)realloc(fns, capacity * sizeof(FunctionReport));
+                 if(!fns) { perror("realloc"); exit(1); }
+             }
+             memset(&fns[count], 0, sizeof(FunctionReport));
+             fns[count].name = s->name;
+             fns[count].address = s->address;
+             count++;
+         }
+     }
+     qsort(fns, count, sizeof(FunctionReport), compareFunctions);
+     int unique = 0;
+     for (int i = 0; i < count; i++)
+         if(unique == 0 || fns[unique - 1].address != fns[i].address)
+             fns[unique++] = fns[i];
+     free(called);
+     free(branched);
+     *out = fns;
+     return unique;
+ }
+ 
+ // Index of the function holding 'address', or -1 before the first one.
+ static int functionAt(const FunctionReport *fns, int count, int address) {
+     int lo = 0, hi = count - 1, found = -1;
+     while(lo <= hi) {
+         int mid = (lo + hi) / 2;
+         if(fns[mid].address <= address) {
+             found = mid;
+             lo = mid + 1;
+         } else {
+             hi = mid - 1;
+         }
+     }
+     return found;
+ }
+ 
+ static void printFunctionRow(const FunctionReport *f, const char *name, int showAddress) {
+     if(showAddress)
+         printf("%-16.16s 0x%04X %7d %7d", name, f->address, f->words, 2 * f->words);
+     else
+         printf("%-16.16s %6s %7d %7d", name, "", f->words, 2 * f->words);
+     for (int c = 0; c < CLASS_COUNT; c++)
+         printf(" %5d", f->mix[c]);
+     printf(" %8ld %6ld\n", f->cycles, f->block);
+ }
+ 
+ static void printReport(const int *latency) {
+     FunctionReport *fns;
+     int count = findFunctions(&fns);
+     FunctionReport outside, total;
+     memset(&outside, 0, sizeof(outside));
+     memset(&total, 0, sizeof(total));
+     int current = -2;
+     long blockCycles = 0, dataBytes = 0;
+     for (int i = 0; i < as->lineCount; i++) {
+         Line *l = as->lines[i];
+         if(l->section == SECTION_DATA) {
+             dataBytes += (lineDirective(l) == DIR_SPACE) ? parseImmediate(l->operands) : l->codeCount * l->elementSize;
+             continue;
+         }
+         if(l->section != SECTION_TEXT)
+             continue;
+         if(l->label.len)
+             blockCycles = 0;
+         InstructionDef *inst = lineInstruction(l);
+         for (int k = 0; k < l->codeCount && l->elementSize == 2; k++) {
+             int fn = functionAt(fns, count, l->address + 2 * k), control;
+             FunctionReport *f = (fn < 0) ? &outside : &fns[fn];
+             if(fn != current)
+                 blockCycles = 0;
+             current = fn;
+             InstClass c = wordClass(l, inst, k, &control);
+             f->words++;
+             f->mix[c]++;
+             f->cycles += latency[c];
+             blockCycles += latency[c];
+             if(blockCycles > f->block)
+                 f->block = blockCycles;
+             if(control)
+                 blockCycles = 0;
+         }
+     }
+     printf("\n--- Code Size Report ---\n");
+     printf("Latencies:");
+     for (int c = 0; c < CLASS_COUNT; c++)
+         printf(" %s=%d", classNames[c], latency[c]);
+     printf("\n%-16s %6s %7s %7s", "function", "addr", "instrs", "bytes");
+     for (int c = 0; c < CLASS_COUNT; c++)
+         printf(" %5s", classNames[c]);
+     printf(" %8s %6s\n", "cycles", "block");
+     if(outside.words)
+         printFunctionRow(&outside, "(no function)", 0);
+     for (int i = 0; i < count; i++)
+         printFunctionRow(&fns[i], fns[i].name, 1);
+     int functions = count + (outside.words > 0);
+     for (int i = -1; i < count; i++) {
+         const FunctionReport *f = (i < 0) ? &outside : &fns[i];
+         total.words += f->words;
+         for (int c = 0; c < CLASS_COUNT; c++)
+             total.mix[c] += f->mix[c];
+         total.cycles += f->cycles;
+         if(f->block > total.block)
+             total.block = f->block;
+     }
+     printFunctionRow(&total, "total", 0);
+     long used = 2L * total.words + dataBytes;
+     printf("%d functions; .text %d bytes, .data %ld bytes: %ld of 65536 bytes (%.1f%%)\n", functions,
+            2 * total.words, dataBytes, used, 100.0 * used / 65536);
+     for (int c = 0; c < CLASS_COUNT; c++)
+         printf("%s%s %.1f%%", c ? ", " : "Mix: ", classNames[c], total.words ? 100.0 * total.mix[c] / total.words : 0.0);
+     printf("\n");
+     free(fns);
+ }
+ #endif
+ 
+ // -----------------------
+ // Profile-Guided Layout (--profile)
+ // -----------------------
+ 
+ // --profile reads the execution counts that "z16sim --profile" wrote for the image built from
+ // the same source and options without --profile, and reorders the basic blocks of every function
+ // that ran (functions as in the Code Size Report) so that the hot path falls through:
+ //   - a block ends at a branch, j, jr or "ecall 3", or before a label that follows an instruction;
+ //   - after each block comes, if still unplaced, the target of its branch when the branch was
+ //     taken more often than not, else its fall-through, else the target of a jump that ran;
+ //     otherwise the hottest unplaced block. The entry block stays first, and a last block that
+ //     falls out of the function stays last;
+ //   - a branch whose target now follows it is inverted to go to its old fall-through, a jump to
+ //     the next block is dropped, and "j" is added after a block whose fall-through moved away.
+ // Blocks that need a label and have none get one (__layout_N). Branches and jumps are then
+ // relaxed again from their short forms. Functions whose lines are not one run of labels and
+ // instructions (directives, .org, other sections in between) are left as they are; directives
+ // before the first label or instruction of a function stay in front of it.
+ typedef enum { END_FALL, END_BRANCH, END_JUMP, END_STOP } BlockEnd;
+ 
+ typedef struct {
+     int first, last;             // lines of the block (indices in as->lines)
+     int term;                    // its last instruction line, or -1 if it has none
+     BlockEnd end;
+     int target;                  // block of the branch or jump label, -1 if outside the function
+     uint64_t count;              // times the block was entered
+     uint64_t taken, flow;        // branch: times taken; otherwise the times control left the block
+     int placed;
+ } Block;
+ 
+ typedef struct {
+     uint64_t *count, *taken;     // per address, from the profile
+     int labels;                  // labels generated so far
+     int functions, reordered, inverted, jumpsAdded, jumpsRemoved;
+     uint64_t takenBefore, takenAfter;
+ } Layout;
+ 
+ #ifndef Z16ASM_LIBRARY
+ // Read "0x<pc> <executed> <taken>" lines; '#' starts a comment line. Returns 0 if the file
+ // cannot be read.
+ static int loadProfile(const char *filename, Layout *lay) {
+     FILE *fp = fopen(filename, "r");
+     if(!fp)
+         return 0;
+     lay->count = (uint64_t *)calloc(MEM_SIZE, sizeof(uint64_t));
+     lay->taken = (uint64_t *)calloc(MEM_SIZE, sizeof(uint64_t));
+     if(!lay->count || !lay->taken) { perror("calloc"); exit(1); }
+     char buf[128];
+     unsigned pc;
+     unsigned long long executed, taken;
+     while(fgets(buf, sizeof(buf), fp)) {
+         if(buf[0] == '#' || sscanf(buf, "%x %llu %llu", &pc, &executed, &taken) != 3 || pc >= MEM_SIZE)
+             continue;
+         lay->count[pc] = executed;
+         lay->taken[pc] = taken;
+     }
+     fclose(fp);
+     return 1;
+ }
+ 
+ // How a block ending with this line passes control on. jal, jalr and other ecalls return.
+ static BlockEnd lineEnd(const Line *l) {
+     InstructionDef *inst = lineInstruction(l);
+     if(!inst)
+         return END_FALL;
+     if(inst->type == INST_B)
+         return END_BRANCH;
+     if(isMnemonic(inst, "j"))
+         return END_JUMP;
+     if(isMnemonic(inst, "jr") || (inst->type == INST_S && parseImmediate(l->operands) == 3))
+         return END_STOP;
+     return END_FALL;
+ }
+ 
+ // A line that may be moved with its block: a label, an instruction or nothing.
+ static int movableLine(const Line *l) {
+     return l->section == SECTION_TEXT && (!l->mnemonic.len || lineInstruction(l));
+ }
+ 
+ // Label of a block, given to its first line if it has none.
+ static View blockLabel(Layout *lay, const Block *b) {
+     for (int i = b->first; i <= b->last; i++) {
+         if(as->lines[i]->label.len)
+             return as->lines[i]->label;
+         if(lineInstruction(as->lines[i]))
+             break;
+     }
+     Line *l = as->lines[b->first];
+     for (;;) {
+         char *name = (char *)arenaAlloc(&as->lineArena, 24);
+         int n = snprintf(name, 24, "__layout_%d", lay->labels++);
+         l->label = makeView(name, name + n);
+         if(addSymbol(l->label, l->address, SECTION_TEXT) == 0) {
+             // Listed in front of the line, as the branches that now go to it name it.
+             char *listed = (char *)arenaAlloc(&as->lineArena, n + l->original.len + 2);
+             int m = sprintf(listed, "%s:%.*s", name, l->original.len, l->original.ptr);
+             l->original = makeView(listed, listed + m);
+             return l->label;
+         }
+     }
+ }
+ 
+ // A "j label" line after line 'after', for a fall-through that moved away.
+ static Line *jumpLine(const Line *after, View label) {
+     char *text = (char *)arenaAlloc(&as->lineArena, label.len + 32);
+     int n = snprintf(text, label.len + 32, "    j     %.*s    # --profile\n", label.len, label.ptr);
+     Line *l = (Line *)arenaAlloc(&as->lineArena, sizeof(Line));
+     memset(l, 0, sizeof(Line));
+     l->lineNo = after->lineNo;
+     l->file = after->file;
+     l->original = makeView(text, text + n);
+     l->section = SECTION_TEXT;
+     l->address = after->address;
+     l->mnemonic = makeView(text + 4, text + 5);
+     l->keyword = lookupKeyword(l->mnemonic);
+     l->operands = makeView(text + 10, text + 10 + label.len);
+     l->elementSize = 2;
+     return l;
+ }
+ 
+ // Branch on the opposite condition (beq/bne, bz/bnz, blt/bge, bltu/bgeu) to 'label'.
+ static void invertBranch(Line *l, View label) {
+     static const char *inverse[8] = { "bne", "beq", "bnz", "bz", "bge", "blt", "bgeu", "bltu" };
+     const char *mnemonic = inverse[lineInstruction(l)->funct3];
+     View ops = l->operands, reg;
+     nextField(&ops, ", \t", &reg);
+     char *text = (char *)arenaAlloc(&as->lineArena, reg.len + label.len + 3);
+     int n = sprintf(text, "%.*s, %.*s", reg.len, reg.ptr, label.len, label.ptr);
+     // The listing shows the branch that is emitted, and the source line it replaces.
+     int size = l->label.len + reg.len + label.len + l->mnemonic.len + l->operands.len + 48;
+     char *listed = (char *)arenaAlloc(&as->lineArena, size);
+     int m = snprintf(listed, size, "%.*s%s    %-5s %.*s    # --profile, was: %.*s %.*s\n",
+                      l->label.len, l->label.ptr, l->label.len ? ":" : "", mnemonic, n, text,
+                      l->mnemonic.len, l->mnemonic.ptr, l->operands.len, l->operands.ptr);
+     l->original = makeView(listed, listed + m);
+     l->mnemonic = makeView(mnemonic, mnemonic + strlen(mnemonic));
+     l->keyword = lookupKeyword(l->mnemonic);
+     l->operands = makeView(text, text + n);
+     l->rewritten = 2;
+ }
+ 
+ // Index of the block starting at 'address', or -1.
+ static int blockAt(const Block *blocks, int count, int address) {
+     int lo = 0, hi = count - 1;
+     while(lo <= hi) {
+         int mid = (lo + hi) / 2, a = as->lines[blocks[mid].first]->address;
+         if(a == address)
+             return blocks[mid].term >= 0 ? mid : -1;
+         if(a < address)
+             lo = mid + 1;
+         else
+             hi = mid - 1;
+     }
+     return -1;
+ }
+ 
+ // Split lines lo..hi into blocks and read their counts. Returns the number of blocks.
+ static int findBlocks(Layout *lay, int lo, int hi, Block *blocks) {
+     int count = 0, hasInstruction = 0;
+     blocks[0].first = lo;
+     blocks[0].term = -1;
+     for (int i = lo; i <= hi; i++) {
+         Line *l = as->lines[i];
+         if(l->label.len && hasInstruction) {
+             blocks[count].last = i - 1;
+             blocks[++count].first = i;
+             blocks[count].term = -1;
+             hasInstruction = 0;
+         }
+         if(!lineInstruction(l))
+             continue;
+         if(!hasInstruction)
+             blocks[count].count = lay->count[l->address & 0xFFFF];
+         hasInstruction = 1;
+         blocks[count].term = i;
+         if(lineEnd(l) != END_FALL && i < hi) {
+             blocks[count].last = i;
+             blocks[++count].first = i + 1;
+             blocks[count].term = -1;
+             hasInstruction = 0;
+         }
+     }
+     blocks[count++].last = hi;
+     for (int b = 0; b < count; b++) {
+         Block *blk = &blocks[b];
+         blk->placed = 0;
+         blk->target = -1;
+         blk->taken = blk->flow = 0;
+         if(blk->term < 0) {
+             blk->count = 0;
+             blk->end = END_FALL;
+             continue;
+         }
+         Line *t = as->lines[blk->term];
+         int pc = t->address & 0xFFFF;
+         blk->end = lineEnd(t);
+         blk->flow = lay->count[pc];
+         if(blk->end == END_BRANCH) {
+             // A relaxed branch starts with the inverted condition, which is taken when the
+             // branch is not.
+             blk->taken = t->relax ? lay->count[pc] - lay->taken[pc] : lay->taken[pc];
+             blk->flow = lay->count[pc] - blk->taken;
+         }
+         View label;
+         Symbol *sym;
+         if((blk->end == END_BRANCH || blk->end == END_JUMP) && siteLabel(t, blk->end == END_JUMP, &label) &&
+            (sym = findSymbol(label)) && sym->section == SECTION_TEXT)
+             blk->target = blockAt(blocks, count, sym->address);
+     }
+     return count;
+ }
+ 
+ // Whether block b can go at position p of n: the pinned block only goes last.
+ static int canPlace(const Block *blocks, int b, int pinned, int p, int n) {
+     return b >= 0 && b < n && !blocks[b].placed && (b != pinned || p == n - 1);
+ }
+ 
+ // Reorder the blocks of lines lo..hi. Returns the new line sequence (with added jumps) in
+ // *out and its length, or 0 if the order did not change.
+ static int layoutFunction(Layout *lay, int lo, int hi, Line ***out) {
+     int n = hi - lo + 1, count;
+     Block *blocks = (Block *)malloc(n * sizeof(Block));
+     int *order = (int *)malloc(n * sizeof(int));
+     if(!blocks || !order) { perror("malloc"); exit(1); }
+     count = findBlocks(lay, lo, hi, blocks);
+     if(blocks[0].count == 0) {
+         free(blocks);
+         free(order);
+         return 0;
+     }
+     lay->functions++;
+     int pinned = (blocks[count - 1].end == END_FALL || blocks[count - 1].end == END_BRANCH) ? count - 1 : -1;
+     order[0] = 0;
+     blocks[0].placed = 1;
+     int moved = 0;
+     for (int p = 1; p < count; p++) {
+         const Block *prev = &blocks[order[p - 1]];
+         int ft = order[p - 1] + 1, next = -1;
+         if(prev->end == END_BRANCH && prev->taken > prev->flow && canPlace(blocks, prev->target, pinned, p, count))
+             next = prev->target;
+         else if((prev->end == END_BRANCH || prev->end == END_FALL) && canPlace(blocks, ft, pinned, p, count))
+             next = ft;
+         else if((prev->end == END_JUMP || (prev->end == END_BRANCH && prev->taken)) && prev->flow + prev->taken &&
+                 canPlace(blocks, prev->target, pinned, p, count))
+             next = prev->target;
+         // Otherwise the hottest block left, the first one on a tie.
+         for (int b = 1, hottest = next < 0; b < count && hottest; b++)
+             if(canPlace(blocks, b, pinned, p, count) && (next < 0 || blocks[b].count > blocks[next].count))
+                 next = b;
+         order[p] = next;
+         blocks[next].placed = 1;
+         moved |= (next != p);
+     }
+     for (int p = 0; p < count; p++) {
+         const Block *b = &blocks[order[p]];
+         lay->takenBefore += (b->end == END_BRANCH) ? b->taken : (b->end == END_JUMP) ? b->flow : 0;
+     }
+     if(!moved) {
+         for (int p = 0; p < count; p++)
+             lay->takenAfter += (blocks[p].end == END_BRANCH) ? blocks[p].taken : (blocks[p].end == END_JUMP) ? blocks[p].flow : 0;
+         free(blocks);
+         free(order);
+         return 0;
+     }
+     Line **seq = (Line **)malloc((n + count) * sizeof(Line *));
+     if(!seq) { perror("malloc"); exit(1); }
+     int length = 0;
+     for (int p = 0; p < count; p++) {
+         int b = order[p], next = (p + 1 < count) ? order[p + 1] : count, ft = b + 1;
+         Block *blk = &blocks[b];
+         for (int i = blk->first; i <= blk->last; i++)
+             seq[length++] = as->lines[i];
+         Line *t = (blk->term >= 0) ? as->lines[blk->term] : NULL;
+         if(blk->end == END_JUMP) {
+             if(blk->target == next) {
+                 t->mnemonic.len = t->operands.len = 0;
+                 t->keyword = NULL;
+                 t->elementSize = 0;
+                 t->rewritten = 1;
+                 lay->jumpsRemoved++;
+             } else {
+                 lay->takenAfter += blk->flow;
+             }
+         } else if(blk->end == END_BRANCH || blk->end == END_FALL) {
+             if(next == ft) {
+                 lay->takenAfter += blk->taken;
+             } else if(blk->end == END_BRANCH && blk->target == next) {
+                 invertBranch(t, blockLabel(lay, &blocks[ft]));
+                 lay->takenAfter += blk->flow;
+                 lay->inverted++;
+             } else {
+                 seq[length++] = jumpLine(as->lines[blk->last], blockLabel(lay, &blocks[ft]));
+                 lay->takenAfter += blk->taken + blk->flow;
+                 lay->jumpsAdded++;
+             }
+         }
+     }
+     lay->reordered++;
+     free(blocks);
+     free(order);
+     *out = seq;
+     return length;
+ }
+ 
+ typedef struct {
+     int lo, hi;                  // lines replaced
+     Line **seq;
+     int length;
+ } LayoutRun;
+ 
+ static int compareRuns(const void *a, const void *b) {
+     return ((const LayoutRun *)a)->lo - ((const LayoutRun *)b)->lo;
+ }
+ 
+ // Recompute the .text addresses and labels from the line order, as pass 1 assigns them.
+ static void layoutText(void) {
+     int loc = 0;
+     for (int i = 0; i < as->lineCount; i++) {
+         Line *l = as->lines[i];
+         if(l->section != SECTION_TEXT)
+             continue;
+         if(l->label.len) {
+             Symbol *sym = findSymbol(l->label);
+             if(sym && sym->section == SECTION_TEXT)
+                 sym->address = loc;
+         }
+         if(lineDirective(l) == DIR_ORG)
+             loc = parseImmediate(l->operands);
+         l->address = loc;
+         if(lineInstruction(l))
+             loc += 2 * (1 + l->relax);
+     }
+ }
+ 
+ static int textBytes(void) {
+     int bytes = 0;
+     for (int i = 0; i < as->lineCount; i++)
+         if(as->lines[i]->section == SECTION_TEXT && lineInstruction(as->lines[i]))
+             bytes += 2 * (1 + as->lines[i]->relax);
+     return bytes;
+ }
+ 
+ // Reorder the functions that ran, after relaxation, and print what changed.
+ static void layoutFromProfile(Layout *lay) {
+     FunctionReport *fns;
+     int fnCount = findFunctions(&fns), runCount = 0, bytesBefore = textBytes();
+     LayoutRun *runs = (LayoutRun *)malloc((fnCount ? fnCount : 1) * sizeof(LayoutRun));
+     int *first = (int *)malloc((fnCount ? fnCount : 1) * sizeof(int));
+     int *instructions = (int *)calloc(fnCount ? fnCount : 1, sizeof(int));
+     if(!runs || !first || !instructions) { perror("malloc"); exit(1); }
+     for (int f = 0; f < fnCount; f++)
+         first[f] = -1;
+     for (int i = 0; i < as->lineCount; i++) {
+         Line *l = as->lines[i];
+         int f = (l->section == SECTION_TEXT) ? functionAt(fns, fnCount, l->address) : -1;
+         if(f < 0)
+             continue;
+         if(first[f] < 0 && movableLine(l))
+             first[f] = i;
+         instructions[f] += (lineInstruction(l) != NULL);
+     }
+     for (int f = 0; f < fnCount; f++) {
+         if(first[f] < 0 || !instructions[f])
+             continue;
+         int lo = first[f], hi = lo, found = 0;
+         while(hi < as->lineCount && movableLine(as->lines[hi]) && functionAt(fns, fnCount, as->lines[hi]->address) == f) {
+             found += (lineInstruction(as->lines[hi]) != NULL);
+             hi++;
+         }
+         if(found != instructions[f])
+             continue;
+         Line **seq;
+         int length = layoutFunction(lay, lo, hi - 1, &seq);
+         if(length) {
+             runs[runCount].lo = lo;
+             runs[runCount].hi = hi - 1;
+             runs[runCount].seq = seq;
+             runs[runCount++].length = length;
+         }
+     }
+     if(runCount) {
+         qsort(runs, runCount, sizeof(LayoutRun), compareRuns);
+         int total = as->lineCount + lay->jumpsAdded, k = 0, r = 0;
+         Line **lines = (Line **)malloc(total * sizeof(Line *));
+         if(!lines) { perror("malloc"); exit(1); }
+         for (int i = 0; i < as->lineCount; i++) {
+             if(r < runCount && i == runs[r].lo) {
+                 memcpy(lines + k, runs[r].seq, runs[r].length * sizeof(Line *));
+                 k += runs[r].length;
+                 i = runs[r].hi;
+                 free(runs[r++].seq);
+                 continue;
+             }
+             lines[k++] = as->lines[i];
+         }
+         free(as->lines);
+         as->lines = lines;
+         as->lineCount = as->lineCapacity = k;
+         // Size every branch and jump again from its short form.
+         for (int i = 0; i < as->lineCount; i++) {
+             InstructionDef *inst = lineInstruction(as->lines[i]);
+             if(inst && as->lines[i]->section == SECTION_TEXT && (inst->type == INST_B || inst->type == INST_J))
+                 as->lines[i]->relax = 0;
+         }
+         layoutText();
+         relaxBranches();
+     }
+     uint64_t saved = lay->takenBefore - lay->takenAfter;
+     printf("Layout (--profile): %d of %d functions that ran reordered, %d branches inverted, %d jumps added, %d removed\n",
+            lay->reordered, lay->functions, lay->inverted, lay->jumpsAdded, lay->jumpsRemoved);
+     printf("  taken branches and jumps: %llu -> %llu (%.1f%% fewer); .text %d -> %d bytes\n",
+            (unsigned long long)lay->takenBefore, (unsigned long long)lay->takenAfter,
+            lay->takenBefore ? 100.0 * (int64_t)saved / lay->takenBefore : 0.0, bytesBefore, textBytes());
+     free(runs);
+     free(first);
+     free(instructions);
+     free(fns);
+ }
+ #endif
+ 
+ // -----------------------
+ // Assembler Library (z16asm.h)
+ // -----------------------
+ 
+ static Assembler *newAssembler(void) {
+     Assembler *a = (Assembler *)calloc(1, sizeof(Assembler));
+     Image *img = (Image *)calloc(1, sizeof(Image));
+     if(!a || !img) { perror("calloc"); exit(1); }
+     initKeywords();
+     a->memoryImage = img;
+     a->encodeThreads = 1;
+     a->encodeThreadsUsed = 1;
+     a->currentSection = SECTION_NONE;
+     a->relaxScratch = RELAX_SCRATCH;
+     return a;
+ }
+ 
+ // Release everything an assembly holds; 'a' must be the current one.
+ static void freeAssembler(Assembler *a) {
+     freeLines();
+ #ifndef _WIN32
+     freeEncodeWorkers();
+ #endif
+     arenaFree(&a->fixupArena);
+     freeCache();
+     free(a->cacheFilename);
+     freeSymbols();
+     freeSources();
+     freeImage(a->memoryImage);
+     free(a->memoryImage);
+     free(a->debugLines);
+     free(a);
+     as = NULL;
+ }
+ 
+ // Assemble 'size' bytes of source into a memory image, with no files written. Errors are
+ // returned in image->error instead of ending the process. Each call has its own Assembler, so
+ // calls may run on several threads at once.
+ int z16Assemble(const char *name, const char *source, size_t size, int optimize, Z16Image *image) {
+     Assembler *outerAssembler = as;
+     Arena *outerArena = codeArena;
+     EncodeAbort abort, *outerAbort = encodeAbort;
+     memset(image, 0, sizeof(*image));
+     as = newAssembler();
+     as->optimize = optimize;
+     codeArena = &as->lineArena;
+     encodeAbort = &abort;
+     int failed = setjmp(abort.jump);
+     if(!failed) {
+         addSource(name);
+         pass1(source, size);
+         if(as->optimize)
+             peephole();
+         relaxBranches();
+         pass2();
+         for (int i = 0; i < as->lineCount; i++) {
+             Line *l = as->lines[i];
+             emitLine(as->memoryImage, l);
+             if(l->section == SECTION_TEXT && l->codeCount) {
+                 int end = l->address + l->codeCount * l->elementSize;
+                 if(image->textEnd == 0 || l->address < image->textStart)
+                     image->textStart = l->address;
+                 if(end > image->textEnd)
+                     image->textEnd = end;
+             }
+         }
+         image->size = as->memoryImage->size;
+         image->bytes = (unsigned char *)malloc(image->size ? image->size : 1);
+         if(!image->bytes) { perror("malloc"); exit(1); }
+         memcpy(image->bytes, as->memoryImage->bytes, image->size);
+         image->entry = entryPoint();
+     } else {
+         snprintf(image->error, sizeof(image->error), "%s", abort.message);
+     }
+     freeAssembler(as);
+     as = outerAssembler;
+     codeArena = outerArena;
+     encodeAbort = outerAbort;
+     errorSource = NULL;
+     return failed ? -1 : 0;
+ }
+ 
+ void z16FreeImage(Z16Image *image) {
+     free(image->bytes);
+     image->bytes = NULL;
+     image->size = 0;
+ }
+ 
+ // Name of a file next to 'filename' with its extension replaced by 'ext' (or 'ext' added).
+ static char *replaceExtension(const char *filename, const char *ext, char *out) {
+     snprintf(out, 250, "%s", filename);
+     char *dot = strrchr(out, '.');
+     if(dot && !strchr(dot, '/'))
+         strcpy(dot, ext);
+     else
+         strcat(out, ext);
+     return out;
+ }
+ 
+ // Peak resident set size of the process so far, in KB (0 where getrusage is not available).
+ static long peakRssKb(void) {
+ #ifndef _WIN32
+     struct rusage ru;
+     if(getrusage(RUSAGE_SELF, &ru) == 0)
+         return ru.ru_maxrss;
+ #endif
+     return 0;
+ }
+ 
+ static void endPhase(Z16Stats *stats, int phase, double *start) {
+     double now = nowSeconds();
+     stats->seconds[phase] = now - *start;
+     stats->peakRssKb[phase] = peakRssKb();
+     *start = now;
+ }
+ 
+ // Assemble a source file into its listing and image as the command line does, without the
+ // "file generated" messages, and time each phase. Errors are returned like z16Assemble's.
+ int z16AssembleFile(const char *sourceFile, const Z16Options *options, Z16Stats *stats, char *error, size_t errorSize) {
+     char outName[256];
+     memset(stats, 0, sizeof(*stats));
+     SourceFile src;
+     if(openSource(sourceFile, &src) != 0) {
+         snprintf(error, errorSize, "Cannot open source file %s: %s\n", sourceFile, strerror(errno));
+         return -1;
+     }
+     Assembler *outerAssembler = as;
+     Arena *outerArena = codeArena;
+     EncodeAbort abort, *outerAbort = encodeAbort;
+     as = newAssembler();
+     as->optimize = options->optimize;
+     as->outputFormat = options->format;
+     as->debugInfo = options->debugInfo;
+     as->encodeThreads = options->threads > 0 ? options->threads : 1;
+     as->quiet = 1;
+     codeArena = &as->lineArena;
+     encodeAbort = &abort;
+     stats->bytes = (long)src.size;
+     int failed = setjmp(abort.jump);
+     if(!failed) {
+         double start = nowSeconds();
+         addSource(sourceFile);
+         pass1(src.data, src.size);
+         stats->lines = as->lineCount;
+         endPhase(stats, Z16_PASS1, &start);
+         if(as->optimize)
+             peephole();
+         relaxBranches();
+         pass2();
+         endPhase(stats, Z16_PASS2, &start);
+         generateListing(sourceFile);
+         endPhase(stats, Z16_LISTING, &start);
+         const char *ext = (as->outputFormat == FORMAT_SEG) ? ".img" : (as->outputFormat == FORMAT_HEX) ? ".hex" : ".bin";
+         dumpBinary(replaceExtension(sourceFile, ext, outName));
+         if(as->debugInfo)
+             writeDebugInfo(replaceExtension(sourceFile, ".dbg", outName));
+         endPhase(stats, Z16_BINARY, &start);
+     } else {
+         snprintf(error, errorSize, "%s", abort.message);
+     }
+     freeAssembler(as);
+     closeSource(&src);
+     as = outerAssembler;
+     codeArena = outerArena;
+     encodeAbort = outerAbort;
+     errorSource = NULL;
+     return failed ? -1 : 0;
+ }
+ 
+ // -----------------------
+ // Batch Assembly (--batch)
+ // -----------------------
+ 
+ // --batch assembles many sources in one process: every .asm, .s or .txt file in a directory,
+ // or every file named in a manifest (one path per line, '#' starts a comment). Each source
+ // gets its own Assembler and is assembled on one of -j pool threads, with the same .bin/.lst
+ // outputs as a single run; the per-file messages are replaced by a summary at the end.
+ typedef struct {
+     char *path;
+     int lines;
+     double seconds;
+     char error[256];         // empty if the source assembled
+ } BatchJob;
+ 
+ typedef struct {
+     BatchJob *jobs;
+     int count;
+     int capacity;
+     Z16Options options;
+ #ifndef _WIN32
+     atomic_int next;         // next job to hand out
+ #else
+     int next;
+ #endif
+ } Batch;
+ 
+ #ifndef Z16ASM_LIBRARY
+ static void addBatchJob(Batch *b, const char *path, size_t len) {
+     if(b->count == b->capacity) {
+         b->capacity = b->capacity ? b->capacity * 2 : 64;
+         b->jobs = (BatchJob *)realloc(b->jobs, b->capacity * sizeof(BatchJob));
+         if(!b->jobs) { perror("realloc"); exit(1); }
+     }
+     BatchJob *job = &b->jobs[b->count++];
+     memset(job, 0, sizeof(*job));
+     job->path = (char *)malloc(len + 1);
+     if(!job->path) { perror("malloc"); exit(1); }
+     memcpy(job->path, path, len);
+     job->path[len] = '\0';
+ }
+ 
+ static int batchSource(const char *name) {
+     const char *dot = strrchr(name, '.');
+     return dot && (strcmp(dot, ".asm") == 0 || strcmp(dot, ".s") == 0 || strcmp(dot, ".txt") == 0);
+ }
+ 
+ static int compareBatchJobs(const void *a, const void *b) {
+     return strcmp(((const BatchJob *)a)->path, ((const BatchJob *)b)->path);
+ }
+ 
+ // Collect the jobs named by 'target', a directory or a manifest file.
+ static void collectBatch(Batch *b, const char *target) {
+ #ifndef _WIN32
+     struct stat st;
+     if(stat(target, &st) == 0 && S_ISDIR(st.st_mode)) {
+         DIR *dir = opendir(target);
+         if(!dir) {
+             perror("Error opening batch directory");
+             exit(1);
+         }
+         size_t base = strlen(target);
+         while(base > 1 && target[base - 1] == '/')
+             base--;
+         char path[1024];
+         struct dirent *ent;
+         while((ent = readdir(dir)) != NULL) {
+             int n = snprintf(path, sizeof(path), "%.*s/%s", (int)base, target, ent->d_name);
+             if(n < (int)sizeof(path) && batchSource(ent->d_name) && stat(path, &st) == 0 && S_ISREG(st.st_mode))
+                 addBatchJob(b, path, (size_t)n);
+         }
+         closedir(dir);
+         qsort(b->jobs, b->count, sizeof(BatchJob), compareBatchJobs);
+         return;
+     }
+ #endif
+     SourceFile manifest;
+     if(openSource(target, &manifest) != 0) {
+         perror("Error opening batch manifest");
+         exit(1);
+     }
+     const char *p = manifest.data, *limit = manifest.data + manifest.size;
+     while(p < limit) {
+         const char *end = memchr(p, '\n', limit - p);
+         if(!end)
+             end = limit;
+         const char *hash = memchr(p, '#', end - p);
+         View path = trimView(makeView(p, hash ? hash : end));
+         if(path.len)
+             addBatchJob(b, path.ptr, path.len);
+         p = end + (end < limit);
+     }
+     closeSource(&manifest);
+ }
+ 
+ static void runBatchJob(Batch *b, BatchJob *job) {
+     Z16Stats stats;
+     double start = nowSeconds();
+     z16AssembleFile(job->path, &b->options, &stats, job->error, sizeof(job->error));
+     job->lines = (int)stats.lines;
+     job->seconds = nowSeconds() - start;
+ }
+ 
+ static void *batchWorkerMain(void *arg) {
+     Batch *b = (Batch *)arg;
+     int i;
+     while((i = b->next++) < b->count)
+         runBatchJob(b, &b->jobs[i]);
+     return NULL;
  }
  
+ // Run --batch on 'threads' pool threads and print the summary. Returns the number of failures.
+ static int assembleBatch(const char *target, int threads, int optimize, int outputFormat, int debugInfo) {
+     Batch b;
+     memset(&b, 0, sizeof(b));
+     b.options.optimize = optimize;
+     b.options.format = outputFormat;
+     b.options.debugInfo = debugInfo;
+     b.options.threads = 1;
+     collectBatch(&b, target);
+     if(threads > b.count)
+         threads = b.count > 0 ? b.count : 1;
+     double start = nowSeconds();
+ #ifndef _WIN32
+     pthread_t *pool = (pthread_t *)malloc(threads * sizeof(pthread_t));
+     if(!pool) { perror("malloc"); exit(1); }
+     for (int t = 1; t < threads; t++) {
+         if(pthread_create(&pool[t], NULL, batchWorkerMain, &b) != 0) {
+             perror("pthread_create");
+             exit(1);
+         }
+     }
+     batchWorkerMain(&b);
+     for (int t = 1; t < threads; t++)
+         pthread_join(pool[t], NULL);
+     free(pool);
+ #else
+     threads = 1;
+     batchWorkerMain(&b);
+ #endif
+     double secs = nowSeconds() - start;
+     long lines = 0;
+     int failed = 0;
+     for (int i = 0; i < b.count; i++) {
+         BatchJob *job = &b.jobs[i];
+         lines += job->lines;
+         if(job->error[0]) {
+             failed++;
+             printf("FAIL %s: %s", job->path, job->error);
+         } else {
+             printf("ok   %s (%d lines, %.3f ms)\n", job->path, job->lines, 1000.0 * job->seconds);
+         }
+         free(job->path);
+     }
+     printf("Batch: %d files, %d failed, %ld lines in %.3f ms (%.0f lines/s) on %d threads\n", b.count, failed,
+            lines, 1000.0 * secs, secs > 0 ? lines / secs : 0.0, threads);
+     free(b.jobs);
+     return failed;
+ }
+ #endif
+ 
  // -----------------------
  // Main Function and Command-Line Argument Parsing
  // -----------------------
  
+ #ifndef Z16ASM_LIBRARY
  int main(int argc, char **argv) {
      int verbose = 0;
      int debugModeFlag = 0;
+     as = newAssembler();
+     codeArena = &as->lineArena;
+ #ifndef _WIN32
+     long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+     as->encodeThreads = cpus > 0 ? (int)cpus : 1;
+ #endif
      char *filename = NULL;
      char *binFilename = NULL;
+     char *batchTarget = NULL;
+     char *profileFilename = NULL;
+     int useCache = 0;
+     int depFile = 0;
+     int report = 0;
+     int latency[CLASS_COUNT];
+     memcpy(latency, defaultLatency, sizeof(latency));
+     char sideFilename[256];
      
      if(argc < 2) {
-         fprintf(stderr, "Usage: %s [-v] [-d] [-o <binary_file>] <sourcefile>\n", argv[0]);
+         fprintf(stderr, "Usage: %s [-v] [-d] [-c] [-O] [--one-pass] [--cache] [--verify-cache] [-g] [-MD] [--report [--latency <class=cycles,...>]] [--profile <file>] [--relax-scratch <reg>] [--format bin|seg|hex] [-j <threads>] [-o <output_file>] <sourcefile>\n"
+                         "       (out-of-range branches, j and jal may be relaxed into lui/addi/jr sequences that clobber t1, or --relax-scratch <reg>)\n"
+                         "       %s --batch <directory|manifest> [-O] [-g] [--format bin|seg|hex] [-j <threads>]\n", argv[0], argv[0]);
          exit(1);
      }
      for (int i = 1; i < argc; i++) {
@@ -841,9 +4701,78 @@
              verbose = 1;
          else if(strcmp(argv[i], "-d") == 0)
              debugModeFlag = 1;
+         else if(strcmp(argv[i], "--one-pass") == 0)
+             as->onePass = 1;
+         else if(strcmp(argv[i], "-c") == 0)
+             as->objectMode = 1;
+         else if(strcmp(argv[i], "-O") == 0)
+             as->optimize = 1;
+         else if(strcmp(argv[i], "-MD") == 0)
+             depFile = 1;
+         else if(strcmp(argv[i], "-g") == 0)
+             as->debugInfo = 1;
+         else if(strcmp(argv[i], "--report") == 0)
+             report = 1;
+         else if(strcmp(argv[i], "--latency") == 0) {
+             if(i + 1 >= argc || !parseLatencies(argv[++i], latency)) {
+                 fprintf(stderr, "Error: --latency expects class=cycles pairs, e.g. L=3,ecall=20 (classes R, I, B, L, J, U, ecall)\n");
+                 exit(1);
+             }
+         }
+         else if(strcmp(argv[i], "--profile") == 0) {
+             if(i + 1 < argc) {
+                 profileFilename = argv[++i];
+             } else {
+                 fprintf(stderr, "Error: --profile requires a profile file written by z16sim --profile\n");
+                 exit(1);
+             }
+         }
+         else if(strcmp(argv[i], "--relax-scratch") == 0) {
+             const char *name = (i + 1 < argc) ? argv[++i] : "";
+             const Keyword *kw = lookupKeyword(makeView(name, name + strlen(name)));
+             if(!kw || kw->kind != KW_REGISTER || kw->value == 1) {
+                 fprintf(stderr, "Error: --relax-scratch expects a register other than ra\n");
+                 exit(1);
+             }
+             as->relaxScratch = kw->value;
+         }
+         else if(strcmp(argv[i], "--format") == 0) {
+             const char *name = (i + 1 < argc) ? argv[++i] : "";
+             if(strcmp(name, "bin") == 0)
+                 as->outputFormat = FORMAT_BIN;
+             else if(strcmp(name, "seg") == 0)
+                 as->outputFormat = FORMAT_SEG;
+             else if(strcmp(name, "hex") == 0)
+                 as->outputFormat = FORMAT_HEX;
+             else {
+                 fprintf(stderr, "Error: --format expects bin, seg or hex\n");
+                 exit(1);
+             }
+         }
+         else if(strcmp(argv[i], "--cache") == 0 || strcmp(argv[i], "--verify-cache") == 0) {
+             useCache = 1;
+             as->verifyCache |= (argv[i][2] == 'v');
+         }
+         else if(strcmp(argv[i], "-j") == 0) {
+             if(i + 1 < argc && atoi(argv[i+1]) > 0) {
+                 as->encodeThreads = atoi(argv[i+1]);
+                 i++;
+             } else {
+                 fprintf(stderr, "Error: -j switch requires a positive thread count\n");
+                 exit(1);
+             }
+         }
+         else if(strcmp(argv[i], "--batch") == 0) {
+             if(i + 1 < argc) {
+                 batchTarget = argv[++i];
+             } else {
+                 fprintf(stderr, "Error: --batch requires a directory or manifest file\n");
+                 exit(1);
+             }
+         }
          else if(strcmp(argv[i], "-o") == 0) {
              if(i + 1 < argc) {
-                 binFilename = argv[i+1];
+                 binFilename = strdup(argv[i+1]);
                  i++;
              } else {
                  fprintf(stderr, "Error: -o switch requires a binary file name\n");
@@ -853,55 +4782,157 @@
              filename = argv[i];
          }
      }
+     if(batchTarget) {
+         if(filename || binFilename || as->onePass || as->objectMode || useCache || depFile || profileFilename) {
+             fprintf(stderr, "Error: --batch cannot be combined with a source file, -o, -c, -MD, --one-pass, --cache or --profile\n");
+             exit(1);
+         }
+         int failed = assembleBatch(batchTarget, as->encodeThreads, as->optimize, as->outputFormat, as->debugInfo);
+         freeAssembler(as);
+         return failed ? 1 : 0;
+     }
      if(filename == NULL) {
          fprintf(stderr, "Error: No source file specified.\n");
          exit(1);
      }
-     // If no binary file name provided, derive it from the source file name by replacing its extension with ".bin".
+     if(as->objectMode && as->onePass) {
+         fprintf(stderr, "Error: -c cannot be combined with --one-pass\n");
+         exit(1);
+     }
+     if(as->optimize && as->onePass) {
+         fprintf(stderr, "Error: -O cannot be combined with --one-pass\n");
+         exit(1);
+     }
+     if(report && as->onePass) {
+         fprintf(stderr, "Error: --report cannot be combined with --one-pass\n");
+         exit(1);
+     }
+     if(profileFilename && (as->onePass || as->objectMode || useCache)) {
+         fprintf(stderr, "Error: --profile cannot be combined with --one-pass, -c or --cache\n");
+         exit(1);
+     }
+     Layout layout;
+     memset(&layout, 0, sizeof(layout));
+     if(profileFilename && !loadProfile(profileFilename, &layout)) {
+         perror("Error opening profile file");
+         exit(1);
+     }
+     if(useCache && (as->objectMode || as->onePass)) {
+         fprintf(stderr, "Error: --cache cannot be combined with -c or --one-pass\n");
+         exit(1);
+     }
+     if(as->objectMode && (as->outputFormat != FORMAT_BIN || as->debugInfo)) {
+         fprintf(stderr, "Error: -c cannot be combined with --format or -g\n");
+         exit(1);
+     }
+     // If no output file name provided, derive it from the source file name by replacing its extension
+     // with ".bin" (".o" with -c, ".img" or ".hex" with --format seg or hex).
      if(binFilename == NULL) {
+         const char *ext = as->objectMode ? ".o" : (as->outputFormat == FORMAT_SEG) ? ".img" :
+                           (as->outputFormat == FORMAT_HEX) ? ".hex" : ".bin";
          char temp[256];
          strcpy(temp, filename);
          char *dot = strrchr(temp, '.');
          if(dot)
-             strcpy(dot, ".bin");
+             strcpy(dot, ext);
          else
-             strcat(temp, ".bin");
+             strcat(temp, ext);
          binFilename = strdup(temp);
      }
+     // The cache sits next to the source: "prog.asm" uses "prog.z16c".
+     if(useCache) {
+         as->cacheFilename = (char *)malloc(strlen(filename) + 6);
+         if(!as->cacheFilename) { perror("malloc"); exit(1); }
+         strcpy(as->cacheFilename, filename);
+         char *dot = strrchr(as->cacheFilename, '.');
+         if(dot && !strchr(dot, '/'))
+             strcpy(dot, ".z16c");
+         else
+             strcat(as->cacheFilename, ".z16c");
+     }
      
-     FILE *fp = fopen(filename, "r");
-     if(!fp) {
+     SourceFile src;
+     if(openSource(filename, &src) != 0) {
          perror("Error opening source file");
          exit(1);
      }
+     addSource(filename);
      
-     currentSection = SECTION_NONE;
-     if(debugModeFlag)
-         printf("Debug: Starting Pass 1\n");
-     pass1(fp);
-     if(debugModeFlag)
-         printf("Debug: Pass 1 complete, %d lines processed\n", lineCount);
-     if(debugModeFlag)
-         printf("Debug: Starting Pass 2\n");
-     pass2();
-     if(debugModeFlag)
-         printf("Debug: Pass 2 complete\n");
-     
-     generateListing(filename);
-     dumpBinary(binFilename);
+     as->currentSection = SECTION_NONE;
+     double start = nowSeconds();
+     if(as->onePass) {
+         if(debugModeFlag)
+             printf("Debug: Starting single pass\n");
+         int count = assembleOnePass(src.data, src.size, filename);
+         if(debugModeFlag) {
+             double secs = nowSeconds() - start;
+             printf("Debug: Single pass complete, %d lines processed (%.3f ms, %.0f lines/s)\n", count,
+                    1000.0 * secs, secs > 0 ? count / secs : 0.0);
+         }
+         writeImage(as->memoryImage, binFilename);
+     } else {
+         if(debugModeFlag)
+             printf("Debug: Starting Pass 1\n");
+         pass1(src.data, src.size);
+         if(debugModeFlag) {
+             double secs = nowSeconds() - start;
+             printf("Debug: Pass 1 complete, %d lines processed (%.3f ms, %.0f lines/s)\n", as->lineCount,
+                    1000.0 * secs, secs > 0 ? as->lineCount / secs : 0.0);
+         }
+         if(as->optimize) {
+             start = nowSeconds();
+             peephole();
+             if(debugModeFlag)
+                 printf("Debug: Peephole complete, %d removed, %d rewritten (%.3f ms)\n", as->peepholeRemoved,
+                        as->peepholeRewritten, 1000.0 * (nowSeconds() - start));
+         }
+         start = nowSeconds();
+         relaxBranches();
+         if(debugModeFlag)
+             printf("Debug: Relaxation complete, %d sites expanded, %d of %d li/la in two words, %d rounds (%.3f ms)\n",
+                    as->relaxedSites, as->loadsExpanded, as->loadSites, as->relaxRounds, 1000.0 * (nowSeconds() - start));
+         if(profileFilename) {
+             start = nowSeconds();
+             layoutFromProfile(&layout);
+             if(debugModeFlag)
+                 printf("Debug: Profile layout complete (%.3f ms)\n", 1000.0 * (nowSeconds() - start));
+         }
+         if(debugModeFlag)
+             printf("Debug: Starting Pass 2\n");
+         start = nowSeconds();
+         if(as->cacheFilename)
+             pass2Cached();
+         else
+             pass2();
+         if(debugModeFlag)
+             printf("Debug: Pass 2 complete (%.3f ms, %d threads)\n", 1000.0 * (nowSeconds() - start),
+                    as->encodeThreadsUsed);
+ 
+         generateListing(filename);
+         if(as->objectMode)
+             writeObject(binFilename);
+         else
+             dumpBinary(binFilename);
+     }
+     // -g: "prog.bin" comes with "prog.dbg".
+     if(as->debugInfo)
+         writeDebugInfo(replaceExtension(binFilename, ".dbg", sideFilename));
+     // -MD: "prog.bin" depends on the source and every file it included, listed in "prog.d".
+     if(depFile)
+         writeDepFile(replaceExtension(binFilename, ".d", sideFilename), binFilename);
      if(verbose)
          dumpVerbose();
+     if(report)
+         printReport(latency);
      
-     for (int i = 0; i < lineCount; i++)
-         freeLine(lines[i]);
-     while(symbolTable) {
-         Symbol *temp = symbolTable;
-         symbolTable = symbolTable->next;
-         free(temp);
-     }
+     free(layout.count);
+     free(layout.taken);
+     freeAssembler(as);
+     closeSource(&src);
      if(binFilename)
          free(binFilename);
      
      return 0;
  }
+ #endif
  
\ No newline at end of file
@@ -0,0 +1,60 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * In-process interface to the Z16 assembler (z16asm.c built with -DZ16ASM_LIBRARY, the
+ * z16asmlib target). A source held in memory is assembled straight into a memory image:
+ * nothing is written to disk and errors are returned, not printed. Each call keeps its own
+ * state, so calls on different threads do not interfere.
+ */
+#ifndef Z16ASM_H
+#define Z16ASM_H
+
+#include <stddef.h>
+
+typedef struct {
+    unsigned char *bytes;   // memory image from address 0 (release with z16FreeImage)
+    int size;               // bytes up to the last byte of code or data
+    int entry;              // address of _start, or 0
+    int textStart, textEnd; // lowest and past-the-highest address of .text code (0, 0 if none)
+    char error[256];        // message of the first error when z16Assemble fails
+} Z16Image;
+
+// Assemble 'size' bytes of source. 'name' is used to find .include files and in error
+// messages; 'optimize' enables the -O peephole pass. Returns 0, or -1 with image->error set.
+int z16Assemble(const char *name, const char *source, size_t size, int optimize, Z16Image *image);
+
+void z16FreeImage(Z16Image *image);
+
+typedef struct {
+    int optimize;           // -O
+    int format;             // 0 = .bin, 1 = segmented .img, 2 = Intel HEX .hex (--format)
+    int debugInfo;          // -g
+    int threads;            // pass-2 threads (-j); 0 means 1
+} Z16Options;
+
+// Phases timed by z16AssembleFile.
+enum { Z16_PASS1, Z16_PASS2, Z16_LISTING, Z16_BINARY, Z16_PHASES };
+
+typedef struct {
+    long lines;                     // source lines
+    long bytes;                     // source bytes
+    double seconds[Z16_PHASES];
+    long peakRssKb[Z16_PHASES];     // peak RSS of the process when the phase ended
+} Z16Stats;
+
+// Assemble a source file into <source>.lst and <source>.bin (or .img/.hex, and .dbg with -g)
+// as the z16asm command does, and time each phase in 'stats'. Pass 2 includes the
+// peephole and relaxation passes. Returns 0, or -1 with the message in 'error'.
+int z16AssembleFile(const char *sourceFile, const Z16Options *options, Z16Stats *stats, char *error, size_t errorSize);
+
+#endif
@@ -0,0 +1,405 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ * Linker for Z16 relocatable object files.
+ *
+ * Combines the .o files written by "z16asm -c" into a flat binary image, the same format
+ * z16asm writes and z16sim loads:
+ *   - The .text sections are placed one after another, in command-line order, from the text
+ *     base (0 unless -Ttext is given); the .data sections follow the last .text section, or
+ *     start at -Tdata. Each section starts on a 2-byte boundary.
+ *   - Symbols named by .globl are visible to every object; all other labels are local to the
+ *     object that defines them. A global symbol may be defined only once.
+ *   - Every relocation is patched with the final address of its symbol (see FixupKind in
+ *     z16asm.c for the fields). Undefined symbols and out-of-range branches are errors.
+ *
+ * Usage:
+ *   z16ld [-v] [-o <binary_file>] [-Ttext <addr>] [-Tdata <addr>] <object> ...
+ *   -v prints the linked symbol table and section sizes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Relocation kinds, as numbered by z16asm (FixupKind).
+enum { FIX_B, FIX_J, FIX_U, FIX_LO, FIX_WORD, FIX_HI };
+
+// Section codes in object files.
+enum { SEC_UNDEF, SEC_TEXT, SEC_DATA, SEC_ABS };
+
+typedef struct {
+    char *name;
+    int section;
+    int global;
+    int value;              // offset in its section (or the absolute value)
+    int address;            // final address once the sections are placed
+} ObjSymbol;
+
+typedef struct {
+    int section;
+    int kind;
+    int offset;
+    unsigned symbol;
+} ObjReloc;
+
+typedef struct {
+    const char *filename;
+    unsigned char *text, *data;
+    unsigned textSize, dataSize;
+    ObjSymbol *symbols;
+    unsigned symbolCount;
+    ObjReloc *relocs;
+    unsigned relocCount;
+    int textBase, dataBase;
+} Object;
+
+Object *objects = NULL;
+int objectCount = 0;
+
+// -----------------------
+// Reading Object Files
+// -----------------------
+
+unsigned char *fileData;
+size_t fileSize, filePos;
+const char *fileName;
+
+void truncated(void) {
+    fprintf(stderr, "Error: %s is truncated or not a Z16 object file\n", fileName);
+    exit(1);
+}
+
+const unsigned char *take(size_t n) {
+    if(fileSize - filePos < n)
+        truncated();
+    const unsigned char *p = fileData + filePos;
+    filePos += n;
+    return p;
+}
+
+unsigned getU8(void) {
+    return *take(1);
+}
+
+unsigned getU16(void) {
+    const unsigned char *p = take(2);
+    return p[0] | (p[1] << 8);
+}
+
+unsigned long getU32(void) {
+    unsigned long lo = getU16();
+    return lo | ((unsigned long)getU16() << 16);
+}
+
+void *copyBytes(size_t n) {
+    unsigned char *p = (unsigned char *)malloc(n ? n : 1);
+    if(!p) { perror("malloc"); exit(1); }
+    memcpy(p, take(n), n);
+    return p;
+}
+
+void readObject(const char *filename, Object *obj) {
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) {
+        perror(filename);
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    fileSize = (size_t)ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    fileData = (unsigned char *)malloc(fileSize ? fileSize : 1);
+    if(!fileData) { perror("malloc"); exit(1); }
+    if(fread(fileData, 1, fileSize, fp) != fileSize) {
+        perror(filename);
+        exit(1);
+    }
+    fclose(fp);
+    fileName = filename;
+    filePos = 0;
+
+    if(memcmp(take(4), "Z16O", 4) != 0)
+        truncated();
+    unsigned version = getU16();
+    if(version != 2) {
+        fprintf(stderr, "Error: %s has unsupported object version %u\n", filename, version);
+        exit(1);
+    }
+    getU16();
+    memset(obj, 0, sizeof(*obj));
+    obj->filename = filename;
+    obj->textSize = getU32();
+    obj->dataSize = getU32();
+    obj->symbolCount = getU32();
+    obj->relocCount = getU32();
+    obj->text = (unsigned char *)copyBytes(obj->textSize);
+    obj->data = (unsigned char *)copyBytes(obj->dataSize);
+    obj->symbols = (ObjSymbol *)calloc(obj->symbolCount + 1, sizeof(ObjSymbol));
+    obj->relocs = (ObjReloc *)calloc(obj->relocCount + 1, sizeof(ObjReloc));
+    if(!obj->symbols || !obj->relocs) { perror("calloc"); exit(1); }
+    for (unsigned i = 0; i < obj->symbolCount; i++) {
+        ObjSymbol *s = &obj->symbols[i];
+        s->section = getU8();
+        s->global = getU8() & 1;
+        s->value = getU16();
+        unsigned len = getU16();
+        s->name = (char *)malloc(len + 1);
+        if(!s->name) { perror("malloc"); exit(1); }
+        memcpy(s->name, take(len), len);
+        s->name[len] = '\0';
+    }
+    for (unsigned i = 0; i < obj->relocCount; i++) {
+        ObjReloc *r = &obj->relocs[i];
+        r->section = getU8();
+        r->kind = getU8();
+        r->offset = getU16();
+        r->symbol = getU32();
+        if(r->symbol >= obj->symbolCount || (r->section != SEC_TEXT && r->section != SEC_DATA))
+            truncated();
+    }
+    free(fileData);
+}
+
+// -----------------------
+// Global Symbol Table
+// -----------------------
+
+// Open-addressing hash table of the global symbols of all objects.
+ObjSymbol **globalSlots = NULL;
+unsigned globalSlotCount = 0;       // always a power of two
+const char **globalOwner = NULL;    // object that defines each slot's symbol
+
+uint32_t hashName(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; name++) {
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+unsigned globalSlot(const char *name) {
+    unsigned mask = globalSlotCount - 1;
+    for (unsigned i = hashName(name) & mask; ; i = (i + 1) & mask)
+        if(!globalSlots[i] || strcmp(globalSlots[i]->name, name) == 0)
+            return i;
+}
+
+ObjSymbol *findGlobal(const char *name) {
+    return globalSlots[globalSlot(name)];
+}
+
+void defineGlobal(ObjSymbol *s, const char *filename) {
+    unsigned i = globalSlot(s->name);
+    if(globalSlots[i]) {
+        fprintf(stderr, "Error: Duplicate symbol '%s' in %s and %s\n", s->name, globalOwner[i], filename);
+        exit(1);
+    }
+    globalSlots[i] = s;
+    globalOwner[i] = filename;
+}
+
+// -----------------------
+// Layout and Relocation
+// -----------------------
+
+// U-type immediate field: bits [14:9] = imm[8:3], bits [5:3] = imm[2:0].
+uint16_t uField(int imm) {
+    return (uint16_t)((((imm >> 3) & 0x3F) << 9) | ((imm & 0x7) << 3));
+}
+
+// Fill in the field of 'word' for a reference from 'site' to 'target' (as z16asm does).
+// Returns 0 if a branch or jump offset is out of range.
+int patchField(int kind, uint16_t *word, int site, int target) {
+    int offset = target - site;
+    switch(kind) {
+    case FIX_B:
+        if(offset < -16 || offset > 14)
+            return 0;
+        *word = (*word & 0x0FFF) | (((offset >> 1) & 0xF) << 12);
+        break;
+    case FIX_J:
+        if(offset < -512 || offset > 510)
+            return 0;
+        *word = (*word & ~0x7E38) | (((offset >> 4) & 0x3F) << 9) | (((offset >> 1) & 0x7) << 3);
+        break;
+    case FIX_U:
+        *word = (*word & ~0x7E38) | uField(target >> 7);
+        break;
+    case FIX_LO:
+        *word = (*word & 0x01FF) | ((target & 0x7F) << 9);
+        break;
+    case FIX_WORD:
+        *word = (uint16_t)target;
+        break;
+    case FIX_HI:
+        *word = (*word & ~0x7E38) | uField((target + 64) >> 7);
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    int verbose = 0;
+    char *binFilename = NULL;
+    long textBase = 0, dataBase = -1;
+
+    objects = (Object *)calloc(argc, sizeof(Object));
+    if(!objects) { perror("calloc"); exit(1); }
+    for (int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-v") == 0)
+            verbose = 1;
+        else if((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-Ttext") == 0 ||
+                 strcmp(argv[i], "-Tdata") == 0) && i + 1 < argc) {
+            if(argv[i][1] == 'o')
+                binFilename = argv[i+1];
+            else if(strcmp(argv[i], "-Ttext") == 0)
+                textBase = strtol(argv[i+1], NULL, 0);
+            else
+                dataBase = strtol(argv[i+1], NULL, 0);
+            i++;
+        } else if(argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [-v] [-o <binary_file>] [-Ttext <addr>] [-Tdata <addr>] <object> ...\n", argv[0]);
+            exit(1);
+        } else {
+            readObject(argv[i], &objects[objectCount++]);
+        }
+    }
+    if(objectCount == 0) {
+        fprintf(stderr, "Error: No object files specified.\n");
+        exit(1);
+    }
+    char derived[256];
+    if(binFilename == NULL) {
+        strncpy(derived, objects[0].filename, sizeof(derived) - 5);
+        derived[sizeof(derived) - 5] = '\0';
+        char *dot = strrchr(derived, '.');
+        if(dot)
+            strcpy(dot, ".bin");
+        else
+            strcat(derived, ".bin");
+        binFilename = derived;
+    }
+
+    // Place the sections.
+    long cursor = textBase;
+    for (int i = 0; i < objectCount; i++) {
+        cursor = (cursor + 1) & ~1L;
+        objects[i].textBase = (int)cursor;
+        cursor += objects[i].textSize;
+    }
+    long textEnd = cursor;
+    cursor = (dataBase >= 0) ? dataBase : textEnd;
+    for (int i = 0; i < objectCount; i++) {
+        cursor = (cursor + 1) & ~1L;
+        objects[i].dataBase = (int)cursor;
+        cursor += objects[i].dataSize;
+    }
+    long dataEnd = cursor;
+    long imageSize = (textEnd > dataEnd) ? textEnd : dataEnd;
+    if(imageSize > 65536) {
+        fprintf(stderr, "Error: Linked program does not fit in 64KB (%ld bytes)\n", imageSize);
+        exit(1);
+    }
+
+    // Assign addresses and collect the global symbols.
+    unsigned globals = 0;
+    for (int i = 0; i < objectCount; i++)
+        for (unsigned j = 0; j < objects[i].symbolCount; j++)
+            globals += objects[i].symbols[j].global;
+    for (globalSlotCount = 16; globalSlotCount < globals * 2; globalSlotCount *= 2)
+        ;
+    globalSlots = (ObjSymbol **)calloc(globalSlotCount, sizeof(ObjSymbol *));
+    globalOwner = (const char **)calloc(globalSlotCount, sizeof(char *));
+    if(!globalSlots || !globalOwner) { perror("calloc"); exit(1); }
+    for (int i = 0; i < objectCount; i++) {
+        Object *obj = &objects[i];
+        for (unsigned j = 0; j < obj->symbolCount; j++) {
+            ObjSymbol *s = &obj->symbols[j];
+            if(s->section == SEC_UNDEF)
+                continue;
+            s->address = (s->section == SEC_TEXT) ? obj->textBase + s->value :
+                         (s->section == SEC_DATA) ? obj->dataBase + s->value : s->value;
+            if(s->global)
+                defineGlobal(s, obj->filename);
+        }
+    }
+
+    // Build the image and patch the relocations.
+    unsigned char *image = (unsigned char *)calloc(imageSize ? imageSize : 1, 1);
+    if(!image) { perror("calloc"); exit(1); }
+    for (int i = 0; i < objectCount; i++) {
+        memcpy(image + objects[i].textBase, objects[i].text, objects[i].textSize);
+        memcpy(image + objects[i].dataBase, objects[i].data, objects[i].dataSize);
+    }
+    for (int i = 0; i < objectCount; i++) {
+        Object *obj = &objects[i];
+        for (unsigned j = 0; j < obj->relocCount; j++) {
+            ObjReloc *r = &obj->relocs[j];
+            ObjSymbol *s = &obj->symbols[r->symbol];
+            if(s->section == SEC_UNDEF) {
+                ObjSymbol *g = findGlobal(s->name);
+                if(!g) {
+                    fprintf(stderr, "Error: Undefined symbol '%s' referenced in %s\n", s->name, obj->filename);
+                    exit(1);
+                }
+                s = g;
+            }
+            int site = ((r->section == SEC_TEXT) ? obj->textBase : obj->dataBase) + r->offset;
+            if(site + 1 >= imageSize) {
+                fprintf(stderr, "Error: Relocation outside its section in %s\n", obj->filename);
+                exit(1);
+            }
+            uint16_t word = image[site] | (image[site+1] << 8);
+            if(!patchField(r->kind, &word, site, s->address)) {
+                fprintf(stderr, "Error: %s offset to '%s' out of range in %s\n",
+                        (r->kind == FIX_B) ? "Branch" : "Jump", s->name, obj->filename);
+                exit(1);
+            }
+            image[site] = word & 0xFF;
+            image[site+1] = (word >> 8) & 0xFF;
+        }
+    }
+
+    FILE *fp = fopen(binFilename, "wb");
+    if(!fp) {
+        perror("Error opening binary file for writing");
+        exit(1);
+    }
+    fwrite(image, 1, imageSize ? imageSize : 1, fp);
+    fclose(fp);
+    printf("Binary file generated: %s\n", binFilename);
+
+    if(verbose) {
+        printf("\n--- Symbol Table ---\n");
+        for (int i = 0; i < objectCount; i++) {
+            for (unsigned j = 0; j < objects[i].symbolCount; j++) {
+                ObjSymbol *s = &objects[i].symbols[j];
+                if(s->section == SEC_UNDEF)
+                    continue;
+                printf("%-10s  0x%04X  %s  %s%s\n", s->name, s->address,
+                       (s->section == SEC_TEXT) ? "TEXT" : (s->section == SEC_DATA) ? "DATA" : "ABS ",
+                       objects[i].filename, s->global ? " (global)" : "");
+            }
+        }
+        printf("\nMemory usage:\n");
+        printf("  Text section: %ld bytes at 0x%04lX\n", textEnd - textBase, textBase);
+        printf("  Data section: %ld bytes at 0x%04X\n", dataEnd - objects[0].dataBase, objects[0].dataBase);
+    }
+    free(image);
+    return 0;
+}
@@ -16,7 +16,9 @@
  * Author: Mohamed Shalan
  *
  * This simulator accepts a Z16 binary machine code file (with a .bin extension) and assumes that
- * the first instruction is located at memory address 0x0000. It decodes each 16-bit instruction into a
+ * the first instruction is located at memory address 0x0000. Segmented images (.img) and Intel
+ * HEX files (.hex) from z16asm --format are also accepted and start at their entry point, and an
+ * assembly source (.asm or .s) is assembled in process (z16asm.h) and run without an output file. It decodes each 16-bit instruction into a
  * human-readable string and prints it, then executes the instruction by updating registers, memory,
  * or performing I/O via ecall.
  *
@@ -26,7 +28,38 @@
  *   - ecall 3: Terminate the simulation.
  *
  * Usage:
- *   z16sim <machine_code_file_name>
+ *   z16sim [--gdb <port|unix-socket>] [--dbg <file>] [trace options] <machine_code_file_name | source.asm>
+ *
+ *   --gdb  Serve the GDB remote serial protocol on a localhost TCP port or a unix-domain socket
+ *          instead of running the program straight away.
+ *
+ * Trace options (every executed instruction is traced when none are given):
+ *   --no-trace               Do not trace at all.
+ *   --trace-start <addr>     Switch tracing on when the PC reaches addr.
+ *   --trace-stop <addr>      Switch tracing off when the PC reaches addr.
+ *                            For both, addr is a number or, with debug information, a .text
+ *                            label with an optional offset ("loop", "rt_mul+4").
+ *   --trace-count <n>        Switch tracing off n instructions after it was switched on.
+ *   --trace-range <lo>:<hi>  Only trace PCs in [lo, hi].
+ *   --trace-reg <reg>        Only trace instructions that change reg (printed with its new value).
+ *   --trace-first <k>        Only trace the first k executions of each PC.
+ *
+ * Checking options:
+ *   --sanitize               Report reads of uninitialised memory, stores into code, and
+ *                            sp-relative accesses below the lowest sp seen.
+ *   --text-range <lo>:<hi>   Declare [lo, hi] as code for --sanitize (the .text lines of the .dbg
+ *                            file or of an assembled source, and fetched bytes, always are).
+ *
+ * Debug information:
+ *   --dbg <file.dbg>         Symbol and line tables from z16asm -g (default: the image name with
+ *                            .dbg, if that file exists). Traces, sanitizer reports and memory
+ *                            faults then show addresses as "label+offset (file:line)".
+ *
+ * Profiling options:
+ *   --heatmap <file.csv>     Count fetches, reads and writes per 256-byte page and the lowest sp;
+ *                            print a table at exit and write the counters to file.csv.
+ *   --profile <file>         Count executions per instruction and taken branches; write them
+ *                            to file at exit (or on SIGINT/SIGTERM) for z16asm --profile.
  *
  *
  *Things to note:
@@ -42,16 +75,463 @@
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <setjmp.h>
+#endif
+#include "z16asm.h"
+#include "z16sim.h"
 
 #define MEM_SIZE 65536  // 64KB memory
 
-// Global simulated memory and register file.
-unsigned char memory[MEM_SIZE];
-int16_t regs[8];       // 8 registers (16-bit each): x0, x1, x2, x3, x4, x5, x6, x7
-uint16_t pc = 0;       // Program counter (16-bit)
+// Global simulated memory and register file. 'memory' points at MEM_SIZE bytes set up by initMemory().
+static unsigned char *memory;
+static int16_t regs[8];       // 8 registers (16-bit each): x0, x1, x2, x3, x4, x5, x6, x7
+static uint16_t pc = 0;       // Program counter (16-bit)
 
+#ifndef Z16SIM_LIBRARY
 // Register ABI names for display (x0 = t0, x1 = ra, x2 = sp, x3 = s0, x4 = s1, x5 = t1, x6 = a0, x7 = a1)
-const char *regNames[8] = {"t0", "ra", "sp", "s0", "s1", "t1", "a0", "a1"};
+static const char *regNames[8] = {"t0", "ra", "sp", "s0", "s1", "t1", "a0", "a1"};
+#endif
+
+static int simExited = 0;     // set once ecall 3 has been executed
+static int minSp = MEM_SIZE;  // lowest non-zero sp seen (tracked under --sanitize and --heatmap)
+static int firstSp = -1;      // first non-zero sp value, taken as the top of the stack
+
+// -----------------------
+// Breakpoints and Watchpoints
+// -----------------------
+//
+// Breakpoints live in a bitmap with one bit per byte address, so checking the current PC is a
+// single load and mask. The run loops only consult it when bpCount is non-zero.
+// Watchpoints are kept in a short list and flattened into a per-byte kind map; loads and stores
+// only look at the map while watchCount is non-zero.
+
+#define WATCH_WRITE 0x1
+#define WATCH_READ  0x2
+#define MAX_WATCHPOINTS 32
+
+typedef struct {
+    uint16_t addr;
+    uint16_t len;
+    uint8_t kind;      // WATCH_WRITE, WATCH_READ, or both
+} Watchpoint;
+
+static Watchpoint watchpoints[MAX_WATCHPOINTS];
+static uint8_t watchMap[MEM_SIZE];
+static int watchCount = 0;
+static int watchHit = 0;        // kind of the watchpoint hit by the last instruction (0 if none)
+static uint16_t watchHitAddr = 0;
+
+#ifndef Z16SIM_LIBRARY
+static uint8_t bpMap[MEM_SIZE / 8];
+static int bpCount = 0;
+
+#define BP_TEST(a) (bpMap[(uint16_t)(a) >> 3] & (1 << ((a) & 7)))
+
+static int setBreakpoint(uint16_t addr) {
+    if(!BP_TEST(addr)) {
+        bpMap[addr >> 3] |= (1 << (addr & 7));
+        bpCount++;
+    }
+    return 0;
+}
+
+static int clearBreakpoint(uint16_t addr) {
+    if(BP_TEST(addr)) {
+        bpMap[addr >> 3] &= ~(1 << (addr & 7));
+        bpCount--;
+    }
+    return 0;
+}
+
+static void rebuildWatchMap(void) {
+    memset(watchMap, 0, sizeof(watchMap));
+    for(int i = 0; i < watchCount; i++)
+        for(int j = 0; j < watchpoints[i].len; j++)
+            watchMap[(uint16_t)(watchpoints[i].addr + j)] |= watchpoints[i].kind;
+}
+
+static int addWatchpoint(uint16_t addr, uint16_t len, uint8_t kind) {
+    if(watchCount >= MAX_WATCHPOINTS)
+        return -1;
+    watchpoints[watchCount].addr = addr;
+    watchpoints[watchCount].len = len ? len : 1;
+    watchpoints[watchCount].kind = kind;
+    watchCount++;
+    rebuildWatchMap();
+    return 0;
+}
+
+static int removeWatchpoint(uint16_t addr, uint16_t len, uint8_t kind) {
+    for(int i = 0; i < watchCount; i++) {
+        if(watchpoints[i].addr == addr && watchpoints[i].len == (len ? len : 1) && watchpoints[i].kind == kind) {
+            watchpoints[i] = watchpoints[--watchCount];
+            rebuildWatchMap();
+            return 0;
+        }
+    }
+    return -1;
+}
+#endif
+
+// Called from the load/store paths; records the first watched access of the instruction.
+static void checkWatch(uint16_t addr, uint8_t kind) {
+    if((watchMap[addr] & kind) && !watchHit) {
+        // The map merges overlapping watchpoints; the stop reply names the kind of the one hit.
+        for(int i = 0; i < watchCount; i++) {
+            const Watchpoint *w = &watchpoints[i];
+            if((w->kind & kind) && (uint16_t)(addr - w->addr) < w->len) {
+                watchHit = w->kind;
+                break;
+            }
+        }
+        watchHitAddr = addr;
+    }
+}
+
+// -----------------------
+// Debug Symbols
+// -----------------------
+//
+// A .dbg file from z16asm -g (loaded from next to the image, or named with --dbg) holds the
+// symbol table and the address range and source line of every .text line. Both are kept as
+// arrays sorted by address, so an address is symbolised as "label+offset (file:line)" with two
+// binary searches. Nothing is looked up unless a .dbg file was loaded.
+
+typedef struct { uint16_t addr; uint8_t section; const char *name; } DbgSymbol;
+typedef struct { uint16_t addr, size, file; uint32_t line; } DbgLine;
+
+static int dbgLoaded = 0;
+static const char **dbgFiles = NULL;
+static DbgSymbol *dbgSymbols = NULL;      // .text and .data symbols, sorted by address
+static DbgLine *dbgLines = NULL;
+static int dbgSymbolCount = 0, dbgLineCount = 0;
+
+#ifndef Z16SIM_LIBRARY
+static char *dbgData = NULL;              // the file contents; names point into it
+static int dbgFileCount = 0;
+
+static unsigned dbgU16(const unsigned char *p) { return p[0] | (p[1] << 8); }
+
+// Loads a .dbg file; returns 0 (and loads nothing) if it is missing or malformed.
+static int loadDebugInfo(const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if(!fp)
+        return 0;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    unsigned char *d = (unsigned char *)malloc(size > 0 ? (size_t)size : 1);
+    if(!d || size < 16 || fread(d, 1, (size_t)size, fp) != (size_t)size || memcmp(d, "Z16D", 4) != 0 ||
+       dbgU16(d + 4) != 1) {
+        fclose(fp);
+        free(d);
+        return 0;
+    }
+    fclose(fp);
+    const unsigned char *p = d + 16, *end = d + size;
+    int files = (int)dbgU16(d + 6);
+    uint32_t syms = dbgU16(d + 8) | (dbgU16(d + 10) << 16), lines = dbgU16(d + 12) | (dbgU16(d + 14) << 16);
+    dbgFiles = (const char **)calloc((size_t)files + 1, sizeof(char *));
+    dbgSymbols = (DbgSymbol *)calloc((size_t)syms + 1, sizeof(DbgSymbol));
+    dbgLines = (DbgLine *)calloc((size_t)lines + 1, sizeof(DbgLine));
+    if(!dbgFiles || !dbgSymbols || !dbgLines) { perror("calloc"); exit(1); }
+    // Each name is moved over its length field and NUL-terminated in place.
+    for(int i = 0; i < files; i++) {
+        if(end - p < 2 || end - p - 2 < (long)dbgU16(p)) goto bad;
+        unsigned n = dbgU16(p);
+        memmove((char *)p, p + 2, n);
+        ((char *)p)[n] = '\0';
+        dbgFiles[dbgFileCount++] = (const char *)p;
+        p += n + 2;
+    }
+    for(uint32_t i = 0; i < syms; i++) {
+        if(end - p < 6 || end - p - 6 < (long)dbgU16(p + 4)) goto bad;
+        unsigned n = dbgU16(p + 4);
+        DbgSymbol *s = &dbgSymbols[dbgSymbolCount];
+        s->addr = (uint16_t)dbgU16(p);
+        s->section = p[2];
+        memmove((char *)p, p + 6, n);
+        ((char *)p)[n] = '\0';
+        s->name = (const char *)p;
+        p += n + 6;
+        // Absolute symbols (.equ) are not addresses.
+        if(s->section == 1 || s->section == 2)
+            dbgSymbolCount++;
+    }
+    for(uint32_t i = 0; i < lines; i++, p += 10) {
+        if(end - p < 10) goto bad;
+        DbgLine *l = &dbgLines[dbgLineCount++];
+        l->addr = (uint16_t)dbgU16(p);
+        l->size = (uint16_t)dbgU16(p + 2);
+        l->file = (uint16_t)dbgU16(p + 4);
+        l->line = dbgU16(p + 6) | ((uint32_t)dbgU16(p + 8) << 16);
+        if(l->file >= dbgFileCount) goto bad;
+    }
+    dbgData = (char *)d;
+    dbgLoaded = 1;
+    return 1;
+bad:
+    fprintf(stderr, "Warning: %s is malformed and was ignored\n", filename);
+    free(d);
+    free(dbgFiles);
+    free(dbgSymbols);
+    free(dbgLines);
+    dbgFileCount = dbgSymbolCount = dbgLineCount = 0;
+    return 0;
+}
+#endif
+
+// Writes "label+offset (file:line)" for addr into buf: the nearest symbol at or below addr in
+// the given section (1 = .text, 2 = .data, 0 = either) and, for .text, the source line. Parts
+// that are unknown are left out; buf is empty without debug information.
+static void symbolize(uint16_t addr, int section, char *buf, size_t size) {
+    buf[0] = '\0';
+    if(!dbgLoaded)
+        return;
+    int lo = 0, hi = dbgSymbolCount;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(dbgSymbols[mid].addr <= addr) lo = mid + 1; else hi = mid;
+    }
+    while(--lo >= 0 && section && dbgSymbols[lo].section != section) ;
+    int n = 0;
+    if(lo >= 0) {
+        n = snprintf(buf, size, "%s", dbgSymbols[lo].name);
+        if(addr != dbgSymbols[lo].addr && n < (int)size)
+            n += snprintf(buf + n, size - n, "+%u", addr - dbgSymbols[lo].addr);
+    }
+    if(section == 2 || n >= (int)size)
+        return;
+    lo = 0, hi = dbgLineCount;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(dbgLines[mid].addr <= addr) lo = mid + 1; else hi = mid;
+    }
+    if(lo > 0 && addr < dbgLines[lo - 1].addr + dbgLines[lo - 1].size)
+        snprintf(buf + n, size - n, "%s(%s:%u)", n ? " " : "", dbgFiles[dbgLines[lo - 1].file], dbgLines[lo - 1].line);
+}
+
+// -----------------------
+// Memory Sanitizer
+// -----------------------
+//
+// With --sanitize the simulator keeps one shadow bit per guest byte in two bitmaps: whether the
+// byte has been initialised (by the image loader or a store) and whether it holds code. Code is
+// marked when the program is loaded, from the .text lines of the .dbg file or of an assembled
+// source, and also by --text-range and by every instruction fetch. Loads of uninitialised bytes,
+// stores into code, and sp-relative accesses below the lowest sp seen so far are reported once
+// per PC. Ranges are marked a shadow byte (8 guest bytes) at a time; an access tests all of its
+// bytes with one mask over the 16-bit shadow word that holds them.
+
+static int sanitize = 0;
+static uint8_t shadowInit[MEM_SIZE / 8];
+static uint8_t shadowText[MEM_SIZE / 8];
+static uint8_t sanReported[MEM_SIZE / 8];     // PCs that already produced a report
+static long sanUninitReads = 0, sanTextStores = 0, sanStackAccesses = 0;
+
+#define SHADOW_TEST(map, a) ((map)[(uint16_t)(a) >> 3] & (1 << ((a) & 7)))
+#define SHADOW_SET(map, a)  ((map)[(uint16_t)(a) >> 3] |= (uint8_t)(1 << ((a) & 7)))
+
+#ifndef Z16SIM_LIBRARY
+// Marks [lo, hi) in a shadow map, filling whole shadow bytes where possible.
+static void shadowMarkRange(uint8_t *map, int lo, int hi) {
+    if(hi > MEM_SIZE) hi = MEM_SIZE;
+    while(lo < hi && (lo & 7)) { SHADOW_SET(map, lo); lo++; }
+    if(lo < (hi & ~7)) {
+        memset(map + (lo >> 3), 0xFF, (size_t)(((hi & ~7) - lo) >> 3));
+        lo = hi & ~7;
+    }
+    while(lo < hi) { SHADOW_SET(map, lo); lo++; }
+}
+#endif
+
+// The 16 shadow bits from the shadow byte of addr on (wrapping at the end of memory), and their
+// update with a mask such as ((1 << size) - 1) << (addr & 7).
+static inline unsigned shadowWord(const uint8_t *map, uint16_t addr) {
+    return map[addr >> 3] | (map[((addr >> 3) + 1) & (MEM_SIZE / 8 - 1)] << 8);
+}
+
+static inline void shadowSetWord(uint8_t *map, uint16_t addr, unsigned mask) {
+    map[addr >> 3] |= (uint8_t)mask;
+    map[((addr >> 3) + 1) & (MEM_SIZE / 8 - 1)] |= (uint8_t)(mask >> 8);
+}
+
+static void sanitizeReport(const char *what, uint16_t addr) {
+    if(SHADOW_TEST(sanReported, pc))
+        return;
+    SHADOW_SET(sanReported, pc);
+    fflush(stdout);
+    if(dbgLoaded) {
+        char data[96], code[160];
+        symbolize(addr, 0, data, sizeof(data));
+        symbolize(pc, 1, code, sizeof(code));
+        fprintf(stderr, "sanitize: %s 0x%04X <%s> at pc 0x%04X <%s>\n", what, addr, data, pc, code);
+        return;
+    }
+    fprintf(stderr, "sanitize: %s 0x%04X at pc 0x%04X\n", what, addr, pc);
+}
+
+// Called for every load and store of 'size' bytes (1 or 2) while --sanitize is on.
+static inline void sanitizeAccess(uint16_t addr, int size, int baseReg, int isStore) {
+    unsigned mask = ((1u << size) - 1) << (addr & 7);
+    if(baseReg == 2 && addr < minSp) {
+        sanStackAccesses++;
+        sanitizeReport(isStore ? "stack store below lowest sp at" : "stack load below lowest sp at", addr);
+    }
+    if(isStore) {
+        if(shadowWord(shadowText, addr) & mask) {
+            sanTextStores++;
+            sanitizeReport("store into text at", addr);
+        }
+        shadowSetWord(shadowInit, addr, mask);
+    } else if((shadowWord(shadowInit, addr) & mask) != mask) {
+        sanUninitReads++;
+        sanitizeReport("read of uninitialised byte", addr);
+    }
+}
+
+static inline void trackSp(void) {
+    if(regs[2] != 0 && (uint16_t)regs[2] < minSp) {
+        minSp = (uint16_t)regs[2];
+        if(firstSp < 0)
+            firstSp = minSp;
+    }
+}
+
+// Called before each instruction: records the fetched bytes as code and tracks the lowest sp.
+static inline void sanitizeFetch(void) {
+    shadowSetWord(shadowText, pc, 3u << (pc & 7));
+    trackSp();
+}
+
+#ifndef Z16SIM_LIBRARY
+static void sanitizeSummary(void) {
+    fflush(stdout);
+    fprintf(stderr, "sanitize: %ld uninitialised read(s), %ld store(s) into text, %ld stack access(es) below sp\n",
+            sanUninitReads, sanTextStores, sanStackAccesses);
+}
+#endif
+
+// -----------------------
+// Memory Heatmap
+// -----------------------
+//
+// With --heatmap the simulator counts instruction fetches, loads and stores per 256-byte page
+// and tracks the lowest sp reached. At exit it prints a table of the touched pages and writes
+// the same counters to a CSV file, to guide .org placement and stack sizing.
+
+#define HEAT_PAGE_SHIFT 8
+#define HEAT_PAGES (MEM_SIZE >> HEAT_PAGE_SHIFT)
+
+static int heatmap = 0;
+#ifndef Z16SIM_LIBRARY
+static const char *heatmapCsv = NULL;
+#endif
+static uint64_t heatFetch[HEAT_PAGES], heatRead[HEAT_PAGES], heatWrite[HEAT_PAGES];
+
+static inline void heatmapFetch(void) {
+    heatFetch[pc >> HEAT_PAGE_SHIFT]++;
+    trackSp();
+}
+
+#ifndef Z16SIM_LIBRARY
+static void heatmapReport(void) {
+    static const char shades[] = " .:-=+*#%@";
+    uint64_t peak = 0;
+    for(int p = 0; p < HEAT_PAGES; p++) {
+        uint64_t total = heatFetch[p] + heatRead[p] + heatWrite[p];
+        if(total > peak) peak = total;
+    }
+    fflush(stdout);
+    fprintf(stderr, "\n--- Memory Heatmap (%d-byte pages) ---\n", 1 << HEAT_PAGE_SHIFT);
+    fprintf(stderr, "Page range         Fetches        Reads       Writes  Heat\n");
+    for(int p = 0; p < HEAT_PAGES; p++) {
+        uint64_t total = heatFetch[p] + heatRead[p] + heatWrite[p];
+        if(total == 0)
+            continue;
+        int level = (int)((total * 9 + peak - 1) / peak);
+        char bar[11];
+        memset(bar, shades[level], (size_t)level + 1);
+        bar[level + 1] = '\0';
+        fprintf(stderr, "0x%04X-0x%04X %12llu %12llu %12llu  %s\n",
+                p << HEAT_PAGE_SHIFT, ((p + 1) << HEAT_PAGE_SHIFT) - 1,
+                (unsigned long long)heatFetch[p], (unsigned long long)heatRead[p],
+                (unsigned long long)heatWrite[p], bar);
+    }
+    if(firstSp < 0)
+        fprintf(stderr, "Stack: sp was never set\n");
+    else
+        fprintf(stderr, "Stack: initial sp 0x%04X, lowest sp 0x%04X (%d bytes used)\n",
+                firstSp, minSp, firstSp - minSp);
+
+    if(heatmapCsv) {
+        FILE *csv = fopen(heatmapCsv, "w");
+        if(!csv) {
+            perror("Error opening heatmap CSV file");
+            return;
+        }
+        fprintf(csv, "page_start,page_end,fetches,reads,writes\n");
+        for(int p = 0; p < HEAT_PAGES; p++)
+            fprintf(csv, "%d,%d,%llu,%llu,%llu\n", p << HEAT_PAGE_SHIFT, ((p + 1) << HEAT_PAGE_SHIFT) - 1,
+                    (unsigned long long)heatFetch[p], (unsigned long long)heatRead[p],
+                    (unsigned long long)heatWrite[p]);
+        fprintf(csv, "# min_sp,%d\n", firstSp < 0 ? -1 : minSp);
+        fclose(csv);
+        fprintf(stderr, "Heatmap CSV written: %s\n", heatmapCsv);
+    }
+}
+#endif
+
+#ifndef Z16SIM_LIBRARY
+// -----------------------
+// Execution Profile
+// -----------------------
+//
+// With --profile the simulator counts the executions of every instruction address and, for
+// branches, how many of them were taken. At exit it writes one "<pc> <executed> <taken>" line
+// per executed address (pc in hex), the input of z16asm --profile (profile-guided layout).
+// SIGINT and SIGTERM stop the run and still write the profile, so programs that never reach
+// ecall 3 can be profiled under timeout(1) or with Ctrl-C.
+
+static int profiling = 0;
+static const char *profileFilename = NULL;
+static uint64_t profileCount[MEM_SIZE], profileTaken[MEM_SIZE];
+static volatile sig_atomic_t profileStop = 0;
+
+static void profileSignal(int sig) {
+    (void)sig;
+    profileStop = 1;
+}
+
+static inline void profileStep(uint16_t instPc, uint16_t inst) {
+    profileCount[instPc]++;
+    if((inst & 0x7) == 0x2 && pc != (uint16_t)(instPc + 2))
+        profileTaken[instPc]++;
+}
+
+static void writeProfile(void) {
+    FILE *fp = fopen(profileFilename, "w");
+    if(!fp) {
+        perror("Error opening profile file");
+        return;
+    }
+    fprintf(fp, "# z16sim profile: pc executed taken\n");
+    for(int a = 0; a < MEM_SIZE; a++)
+        if(profileCount[a])
+            fprintf(fp, "0x%04X %llu %llu\n", a, (unsigned long long)profileCount[a], (unsigned long long)profileTaken[a]);
+    fclose(fp);
+    fprintf(stderr, "Profile written: %s\n", profileFilename);
+}
 
 // -----------------------
 // Disassembly Function
@@ -61,7 +541,7 @@ const char *regNames[8] = {"t0", "ra", "sp", "s0", "s1", "t1", "a0", "a1"};
 // string to 'buf' (of size bufSize). This decoder uses the opcode (bits [2:0]) to distinguish
 // among R‑, I‑, B‑, L‑, J‑, U‑, and System instructions.
 
-void disassemble(uint16_t inst, uint16_t pc, char *buf, size_t bufSize) {
+static void disassemble(uint16_t inst, uint16_t pc, char *buf, size_t bufSize) {
     uint8_t opcode = inst & 0x7;
     switch(opcode) {
         case 0x0: { // R-type: [15:12] funct4 | [11:9] rs2 | [8:6] rd/rs1 | [5:3] funct3 | [2:0] opcode
@@ -202,7 +682,6 @@ void disassemble(uint16_t inst, uint16_t pc, char *buf, size_t bufSize) {
         }
         case 0x5: { // J-type (jump): [15] f | [14:9] offset[9:4] | [8:6] rd | [5:3] offset[3:1] | [2:0] opcode
             uint8_t imm4_9 = (inst >> 9) & 0x3F;
-            uint8_t rd     = (inst >> 6) & 0x7;  // rd is not printed
             uint8_t f      = (inst >> 15) & 0x1;
             uint8_t imm1_3 = (inst >> 3) & 0x7;
             int16_t imm = (imm4_9 << 4) | (imm1_3 << 1);
@@ -275,14 +754,36 @@ void disassemble(uint16_t inst, uint16_t pc, char *buf, size_t bufSize) {
         }
     }
 }
+#endif
 
 // -----------------------
 // Instruction Execution
 // -----------------------
 //
+// The interpreter is compiled twice from executeWith(): executeInstruction() is the plain
+// version, and executeInstrumented() also calls the watchpoint, --sanitize and --heatmap hooks
+// on every load and store. The caller picks one once, so the default run has no per-access
+// tests of those modes.
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// Hooks on a load or store of 'size' bytes at 'addr' through base register 'baseReg'.
+static ALWAYS_INLINE void instrumentAccess(uint16_t addr, int size, int baseReg, int isStore) {
+    if(watchCount)
+        checkWatch(addr, isStore ? WATCH_WRITE : WATCH_READ);
+    if(sanitize)
+        sanitizeAccess(addr, size, baseReg, isStore);
+    if(heatmap)
+        (isStore ? heatWrite : heatRead)[addr >> HEAT_PAGE_SHIFT]++;
+}
+
 // Executes the instruction 'inst' (a 16-bit word) by updating registers, memory, and PC.
 // Returns 1 to continue simulation or 0 to terminate (if ecall 3 is executed).
-int executeInstruction(uint16_t inst) {
+static ALWAYS_INLINE int executeWith(uint16_t inst, const int instrumented) {
     //anding with 7 to get the last three bits -> opcode
     uint8_t opcode = inst & 0x7;
     // if(memory[pc] == 0) {
@@ -352,7 +853,7 @@ int executeInstruction(uint16_t inst) {
                     regs[rd_rs1] = regs[rd_rs1] << shamt;
                 }
                 else if(differentiator==0x2) {
-                    regs[rd_rs1] = regs[rd_rs1] >> shamt;
+                    regs[rd_rs1] = (uint16_t)regs[rd_rs1] >> shamt;
                 }
                 else if(differentiator==0x4) {
                     regs[rd_rs1] = (int16_t)regs[rd_rs1] >> shamt;
@@ -391,8 +892,6 @@ int executeInstruction(uint16_t inst) {
             else if(funct3==0x2 && regs[rs1] == 0)//bz
             {
                 pcUpdated=1;
-                printf("The immediate is: ");
-                printf("%d\n", imm);
                 pc+=imm;
             }
             else if(funct3==0x3 && regs[rs1] != 0)//bnz
@@ -428,10 +927,14 @@ int executeInstruction(uint16_t inst) {
             uint8_t rs2     = (inst >> 9) & 0x7;
             uint8_t rs1  = (inst >> 6) & 0x7;
             uint8_t funct3  = (inst >> 3) & 0x7;
+            if(instrumented)
+                instrumentAccess((uint16_t)(regs[rs1] + imm), funct3 == 0x1 ? 2 : 1, rs1, 1);
             if(funct3==0x0)
-                memory[regs[rs1] + imm] = (uint8_t)(regs[rs2]); //stores only the first 8 bits
-            else if(funct3 == 0x1)
-                memory[regs[rs1] + imm] = (regs[rs2]);
+                memory[(uint16_t)(regs[rs1] + imm)] = (uint8_t)(regs[rs2]); //stores only the first 8 bits
+            else if(funct3 == 0x1) { // little-endian word
+                memory[(uint16_t)(regs[rs1] + imm)] = (uint8_t)regs[rs2];
+                memory[(uint16_t)(regs[rs1] + imm + 1)] = (uint8_t)((uint16_t)regs[rs2] >> 8);
+            }
             break;
         }
         case 0x4: { // L-type (load)
@@ -440,20 +943,22 @@ int executeInstruction(uint16_t inst) {
             uint8_t rs2     = (inst >> 9) & 0x7;
             uint8_t rd  = (inst >> 6) & 0x7;
             uint8_t funct3  = (inst >> 3) & 0x7;
+            if(instrumented)
+                instrumentAccess((uint16_t)(regs[rs2] + imm), funct3 == 0x1 ? 2 : 1, rs2, 0);
 
             if(funct3==0x0)
-                regs[rd] = (int8_t)(memory[regs[rs2] + imm]);
+                regs[rd] = (int8_t)(memory[(uint16_t)(regs[rs2] + imm)]);
             else if(funct3 == 0x1)
-                regs[rd] = (int8_t)(memory[regs[rs2] + imm]);
+                regs[rd] = (int16_t)(memory[(uint16_t)(regs[rs2] + imm)] |
+                                     (memory[(uint16_t)(regs[rs2] + imm + 1)] << 8));
             else if(funct3 == 0x4)
-                regs[rd] = (uint8_t)memory[(regs[rs2] + imm)]; //the memory is unsigned by default
+                regs[rd] = (uint8_t)memory[(uint16_t)(regs[rs2] + imm)]; //the memory is unsigned by default
             break;
         }
         //note that there is a typo in the instructions table on github, I[8:4] should be 6 bits instead
         case 0x5: { // J-type (jump)
 
             uint8_t imm4_9 = (inst >> 9) & 0x3F;
-            uint8_t rd     = (inst >> 6) & 0x7;  // rd is not printed
             uint8_t f      = (inst >> 15) & 0x1;
             uint8_t imm1_3 = (inst >> 3) & 0x7;
             int16_t imm = (imm4_9 << 4) | (imm1_3 << 1);
@@ -543,7 +1048,7 @@ int executeInstruction(uint16_t inst) {
                     // printf("String: %s\n", str);
 
                     // Check that regs[6] (a0) is a valid address in memory
-                    if (regs[6] < 0 || regs[6] >= MEM_SIZE) {
+                    if (regs[6] < 0) {
                         printf("Invalid memory address.\n");
                         return 0;
                     }
@@ -556,7 +1061,7 @@ int executeInstruction(uint16_t inst) {
                     }
 
                     // Print the rest of the string
-                    while (addr < MEM_SIZE && memory[addr] != '\0') {
+                    while (memory[addr] != '\0') {
                         printf("%c", memory[addr]);
                         addr++;
                     }
@@ -566,7 +1071,8 @@ int executeInstruction(uint16_t inst) {
 
                 else if (service == 3) { // Terminate simulation
                     printf("Simulation terminated.\n");
-                    exit(0);
+                    simExited = 1;
+                    return 0;
                 }
                 else {
                     printf("Unknown ecall: %d\n", service);
@@ -584,51 +1090,1010 @@ int executeInstruction(uint16_t inst) {
     return 1;
 }
 
+static int executeInstruction(uint16_t inst) {
+    return executeWith(inst, 0);
+}
+
+#ifndef Z16SIM_LIBRARY
+static int executeInstrumented(uint16_t inst) {
+    return executeWith(inst, 1);
+}
+#endif
+
+// -----------------------
+// Guest Memory
+// -----------------------
+//
+// Guest memory is a MEM_SIZE mapping with a PROT_NONE guard page on either side. Every guest
+// address is truncated to 16 bits before it indexes memory, so normal accesses cannot leave the
+// mapping and need no bounds checks. Anything that still strays outside (an instruction fetch at
+// 0xFFFF, or a host-side bug) hits a guard page; the SIGSEGV handler turns that into a report
+// with the guest PC and instruction instead of a crash.
+
+#ifndef _WIN32
+
+static size_t guardSize = 0;
+static sigjmp_buf faultJmp;              // where the GDB stub resumes after a guest fault
+static volatile sig_atomic_t faultJmpArmed = 0;
+
+static void memoryFaultHandler(int sig, siginfo_t *info, void *ctx) {
+    (void)ctx;
+    unsigned char *a = (unsigned char *)info->si_addr;
+    if(a < memory - guardSize || a >= memory + MEM_SIZE + guardSize) {
+        // Not a guest access: fall back to the default action.
+        signal(sig, SIG_DFL);
+        return;
+    }
+    // Guest faults are raised synchronously from the engine, never from inside stdio, so
+    // flushing the trace written so far is safe here.
+    fflush(stdout);
+    long off = (long)(a - memory);
+    char msg[320], where[160];
+    symbolize(pc, 1, where, sizeof(where));
+    int n = snprintf(msg, sizeof(msg),
+                     "Guest memory fault: access to %s0x%lX outside 0x0000-0x%04X at pc 0x%04X%s%s%s (inst byte %02X)\n",
+                     off < 0 ? "-" : "", off < 0 ? -off : off, MEM_SIZE - 1, pc,
+                     where[0] ? " <" : "", where, where[0] ? ">" : "", memory[pc]);
+    if(n > 0)
+        write(STDERR_FILENO, msg, (size_t)n);
+    if(faultJmpArmed)
+        siglongjmp(faultJmp, 1);
+    _exit(1);
+}
+
+static void initMemory(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    guardSize = (page > 0) ? (size_t)page : 4096;
+    unsigned char *base = (unsigned char *)mmap(NULL, MEM_SIZE + 2 * guardSize, PROT_NONE,
+                                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if(mprotect(base + guardSize, MEM_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        perror("mprotect");
+        exit(1);
+    }
+    memory = base + guardSize;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = memoryFaultHandler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+#else
+
+static void initMemory(void) {
+    // No guard pages here; one spare byte keeps a fetch at 0xFFFF inside the array.
+    static unsigned char backing[MEM_SIZE + 1];
+    memory = backing;
+}
+
+#endif
+
 // -----------------------
 // Memory Loading
 // -----------------------
 //
-// Loads the binary machine code image from the specified file into simulated memory.
-void loadMemoryFromFile(const char *filename) {
+// Three image formats are accepted, as written by z16asm --format:
+//   bin  the whole image from address 0 (the default)
+//   seg  "Z16S" header, then only the live segments and zero-fill ranges (see writeSegments
+//        in z16asm.c); only the live segments are copied and the program starts at its entry
+//   hex  Intel HEX (a file named *.hex); data records, start address (type 05) and end record
+
+#ifndef Z16SIM_LIBRARY
+static uint32_t readU32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void loadFail(const char *filename, const char *what) {
+    fprintf(stderr, "Error: %s: %s\n", filename, what);
+    exit(1);
+}
+
+// Segmented image; the 12-byte header has been read already.
+static size_t loadSegments(FILE *fp, const char *filename, const unsigned char *header) {
+    if((header[4] | (header[5] << 8)) != 1)
+        loadFail(filename, "unsupported segmented image version");
+    int count = header[6] | (header[7] << 8);
+    pc = (uint16_t)readU32(header + 8);
+    size_t loaded = 0;
+    for(int i = 0; i < count; i++) {
+        unsigned char seg[9];
+        if(fread(seg, 1, 9, fp) != 9)
+            loadFail(filename, "truncated segment table");
+        uint32_t addr = readU32(seg), len = readU32(seg + 4);
+        if(addr > MEM_SIZE || len > MEM_SIZE - addr)
+            loadFail(filename, "segment outside memory");
+        // Memory starts zeroed, so zero-fill segments are only recorded for --sanitize.
+        if(seg[8] == 1) {
+            if(fread(memory + addr, 1, len, fp) != len)
+                loadFail(filename, "truncated segment");
+            loaded += len;
+        }
+        if(sanitize)
+            shadowMarkRange(shadowInit, (int)addr, (int)(addr + len));
+    }
+    return loaded;
+}
+
+static size_t loadHex(FILE *fp, const char *filename) {
+    char rec[600];
+    uint32_t upper = 0;
+    size_t loaded = 0;
+    while(fgets(rec, sizeof(rec), fp)) {
+        if(rec[0] != ':')
+            continue;
+        unsigned char b[256];
+        int n = 0, sum = 0;
+        for(const char *p = rec + 1; isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1]) && n < 256; p += 2) {
+            char hex[3] = { p[0], p[1], 0 };
+            b[n] = (unsigned char)strtol(hex, NULL, 16);
+            sum += b[n++];
+        }
+        if(n < 5 || n != b[0] + 5 || (sum & 0xFF) != 0)
+            loadFail(filename, "bad Intel HEX record");
+        uint32_t addr = upper + ((b[1] << 8) | b[2]);
+        switch(b[3]) {
+        case 0:
+            if(addr + b[0] > MEM_SIZE)
+                loadFail(filename, "record outside memory");
+            memcpy(memory + addr, b + 4, b[0]);
+            if(sanitize)
+                shadowMarkRange(shadowInit, (int)addr, (int)(addr + b[0]));
+            loaded += b[0];
+            break;
+        case 1:
+            return loaded;
+        case 4:
+            upper = (uint32_t)((b[4] << 8) | b[5]) << 16;
+            break;
+        case 5:
+            pc = (uint16_t)((b[6] << 8) | b[7]);
+            break;
+        }
+    }
+    return loaded;
+}
+
+// Loads the machine code image from the specified file into simulated memory and sets the
+// starting pc (0 unless the image names an entry point).
+// Assemble a .asm/.s source in process with the z16asm library and load the resulting image.
+static size_t loadSource(FILE *fp, const char *filename) {
+    size_t cap = 1 << 16, size = 0, n;
+    char *buf = (char *)malloc(cap);
+    while(buf && (n = fread(buf + size, 1, cap - size, fp)) > 0) {
+        size += n;
+        if(size == cap)
+            buf = (char *)realloc(buf, cap *= 2);
+    }
+    if(!buf) { perror("malloc"); exit(1); }
+    Z16Image image;
+    if(z16Assemble(filename, buf, size, 0, &image) != 0) {
+        fputs(image.error, stderr);
+        exit(1);
+    }
+    free(buf);
+    n = image.size < MEM_SIZE ? (size_t)image.size : MEM_SIZE;
+    memcpy(memory, image.bytes, n);
+    if(sanitize) {
+        shadowMarkRange(shadowInit, 0, (int)n);
+        shadowMarkRange(shadowText, image.textStart, image.textEnd);
+    }
+    pc = (uint16_t)image.entry;
+    z16FreeImage(&image);
+    return n;
+}
+
+static void loadMemoryFromFile(const char *filename) {
     //rb -> read binary mode
     FILE *fp = fopen(filename, "rb");
     if(!fp) {
         perror("Error opening binary file");
         exit(1);
     }
-    //fread -> reads from the file byte by byte and stores the read data into the memory
-    //It also ensures that the read data doesn't exceed the actual memory size. i.e. it reads up to 65536 bytes only.
-    // Finally, it stores the no of read bytes in 'n'
-    size_t n = fread(memory, 1, MEM_SIZE, fp);
+    pc = 0;
+    size_t n, len = strlen(filename);
+    unsigned char header[12];
+    if((len > 4 && strcmp(filename + len - 4, ".asm") == 0) || (len > 2 && strcmp(filename + len - 2, ".s") == 0)) {
+        n = loadSource(fp, filename);
+    } else if(len > 4 && strcmp(filename + len - 4, ".hex") == 0) {
+        n = loadHex(fp, filename);
+    } else if(fread(header, 1, 12, fp) == 12 && memcmp(header, "Z16S", 4) == 0) {
+        n = loadSegments(fp, filename, header);
+    } else {
+        //fread -> reads from the file byte by byte and stores the read data into the memory
+        //It also ensures that the read data doesn't exceed the actual memory size. i.e. it reads up to 65536 bytes only.
+        // Finally, it stores the no of read bytes in 'n'
+        rewind(fp);
+        n = fread(memory, 1, MEM_SIZE, fp);
+        if(sanitize)
+            shadowMarkRange(shadowInit, 0, (int)n);
+    }
     fclose(fp);
     printf("Loaded %zu bytes into memory\n", n);
 }
+#endif
+
+// Instruction fetch (little-endian). A fetch at 0xFFFF straddles the end of guest memory; its
+// second byte lands in the guard page and is reported as a guest memory fault.
+static inline uint16_t fetchInstruction(void) {
+    return memory[pc] | (memory[pc + 1] << 8);
+}
+
+#ifndef Z16SIM_LIBRARY
+// -----------------------
+// Trace Triggers
+// -----------------------
+//
+// By default every executed instruction is traced. The --trace-* options narrow that down:
+// tracing can be switched on at a start address and off at a stop address or after a number of
+// instructions, and individual instructions can be filtered by PC range, by whether they changed
+// a given register, or by how often their PC has already been traced. Instructions that are not
+// traced are never disassembled or formatted.
+
+static int traceOn = 1;                  // tracing currently switched on
+static int traceStartAddr = -1;          // switch on whenever the PC reaches this address (-1: none)
+static int traceStopAddr = -1;           // switch off whenever the PC reaches this address (-1: none)
+static long traceCount = -1;             // switch off after this many instructions (-1: unlimited)
+static long traceLeft = -1;
+static uint16_t traceLo = 0, traceHi = 0xFFFF;  // only trace PCs in [traceLo, traceHi]
+static int traceReg = -1;                // only trace instructions that change this register (-1: any)
+static uint32_t traceFirst = 0;          // only trace the first K executions of each PC (0: all)
+static uint32_t *traceHits = NULL;       // per-halfword trace counts used by traceFirst
+
+// Decides whether the instruction about to execute at 'addr' is traced, firing the on/off triggers.
+static inline int traceSelect(uint16_t addr) {
+    if(!traceOn) {
+        if(addr != traceStartAddr)
+            return 0;
+        traceOn = 1;
+        traceLeft = traceCount;
+    }
+    if(addr == traceStopAddr || traceLeft == 0) {
+        traceOn = 0;
+        return 0;
+    }
+    if(traceLeft > 0)
+        traceLeft--;
+    if(addr < traceLo || addr > traceHi)
+        return 0;
+    if(traceFirst) {
+        if(traceHits[addr >> 1] >= traceFirst)
+            return 0;
+        traceHits[addr >> 1]++;
+    }
+    return 1;
+}
+
+// Accepts x0..x7 or an ABI register name.
+static int parseRegName(const char *name) {
+    if((name[0] == 'x' || name[0] == 'X') && name[1] >= '0' && name[1] <= '7' && name[2] == '\0')
+        return name[1] - '0';
+    for(int i = 0; i < 8; i++)
+        if(strcmp(name, regNames[i]) == 0)
+            return i;
+    return -1;
+}
+
+// -----------------------
+// GDB Remote Serial Protocol Stub
+// -----------------------
+//
+// With --gdb the simulator waits for a GDB or LLDB client on a local TCP port (numeric argument)
+// or a unix-domain socket (any other argument) and serves the remote serial protocol:
+// register and memory access, single-step, continue, Z0/Z1 breakpoints and Z2/Z3/Z4 watchpoints.
+// Registers are numbered x0..x7 followed by pc, each 16 bits little-endian.
+
+#ifndef _WIN32
+
+#define GDB_PACKET_SIZE 4096
+#define GDB_POLL_INTERVAL 0x10000   // instructions between checks for a ^C from the client
+
+static int gdbFd = -1;
+static int gdbNoAck = 0;
+static unsigned char gdbInBuf[GDB_PACKET_SIZE];
+static int gdbInLen = 0, gdbInPos = 0;
+
+static const char hexDigits[] = "0123456789abcdef";
+
+static int hexValue(int c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static unsigned long parseHex(const char **p) {
+    unsigned long v = 0;
+    int d;
+    while((d = hexValue(**p)) >= 0) {
+        v = (v << 4) | d;
+        (*p)++;
+    }
+    return v;
+}
+
+static int gdbGetChar(void) {
+    if(gdbInPos == gdbInLen) {
+        ssize_t n = recv(gdbFd, gdbInBuf, sizeof(gdbInBuf), 0);
+        if(n <= 0)
+            return -1;
+        gdbInLen = (int)n;
+        gdbInPos = 0;
+    }
+    return gdbInBuf[gdbInPos++];
+}
+
+static void gdbWrite(const char *data, size_t len) {
+    while(len > 0) {
+        ssize_t n = send(gdbFd, data, len, 0);
+        if(n <= 0)
+            return;
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+static void gdbSendPacket(const char *payload) {
+    size_t len = strlen(payload);
+    char *pkt = (char *)malloc(len + 5);
+    if(!pkt) { perror("malloc"); exit(1); }
+    unsigned char sum = 0;
+    pkt[0] = '$';
+    for(size_t i = 0; i < len; i++) {
+        pkt[i + 1] = payload[i];
+        sum += (unsigned char)payload[i];
+    }
+    pkt[len + 1] = '#';
+    pkt[len + 2] = hexDigits[sum >> 4];
+    pkt[len + 3] = hexDigits[sum & 0xF];
+    for(;;) {
+        gdbWrite(pkt, len + 4);
+        if(gdbNoAck)
+            break;
+        int c = gdbGetChar();
+        if(c != '-')
+            break;  // '+' or a closed connection
+    }
+    free(pkt);
+}
+
+// Reads one packet into buf. Returns its length, -1 on disconnect, or -2 for a bare ^C.
+static int gdbReadPacket(char *buf, int size) {
+    int c;
+    for(;;) {
+        do {
+            c = gdbGetChar();
+            if(c < 0) return -1;
+            if(c == 0x03) return -2;
+        } while(c != '$');
+        int len = 0;
+        unsigned char sum = 0;
+        while((c = gdbGetChar()) >= 0 && c != '#') {
+            if(len < size - 1)
+                buf[len++] = (char)c;
+            sum += (unsigned char)c;
+        }
+        if(c < 0) return -1;
+        int h = gdbGetChar(), l = gdbGetChar();
+        if(h < 0 || l < 0) return -1;
+        buf[len] = '\0';
+        if(gdbNoAck)
+            return len;
+        if(((hexValue(h) << 4) | hexValue(l)) == sum) {
+            gdbWrite("+", 1);
+            return len;
+        }
+        gdbWrite("-", 1);
+    }
+}
+
+// Non-blocking check for an interrupt request while the target is running.
+static int gdbInterrupted(void) {
+    struct pollfd pfd = { gdbFd, POLLIN, 0 };
+    if(gdbInPos == gdbInLen && poll(&pfd, 1, 0) <= 0)
+        return 0;
+    int c = gdbGetChar();
+    return c == 0x03 || c < 0;
+}
+
+enum { STOP_STEP, STOP_BREAK, STOP_WATCH, STOP_INTERRUPT, STOP_EXIT, STOP_FAULT, STOP_SEGV };
+
+// Executes one instruction, with the same fetch and execution hooks as runProgram(1), and
+// classifies the result.
+static int gdbStep(void) {
+    if(simExited)
+        return STOP_EXIT;
+    watchHit = 0;
+    uint16_t inst = fetchInstruction(), instPc = pc;
+    if(sanitize)
+        sanitizeFetch();
+    if(heatmap)
+        heatmapFetch();
+    if(!executeInstrumented(inst)) {
+        if(profiling)
+            profileCount[instPc]++;
+        return simExited ? STOP_EXIT : STOP_FAULT;
+    }
+    if(profiling)
+        profileStep(instPc, inst);
+    return watchHit ? STOP_WATCH : STOP_STEP;
+}
+
+// Runs until something stops the target. The loop without breakpoints, watchpoints, --sanitize,
+// --heatmap or --profile is the plain fetch/execute loop plus one counter decrement per instruction.
+static int gdbContinue(void) {
+    int budget = GDB_POLL_INTERVAL;
+    if(simExited)
+        return STOP_EXIT;
+    if(BP_TEST(pc)) {
+        int r = gdbStep();   // step off the breakpoint we are stopped on
+        if(r != STOP_STEP) return r;
+    }
+    if(bpCount == 0 && watchCount == 0 && !sanitize && !heatmap && !profiling) {
+        for(;;) {
+            if(!executeInstruction(fetchInstruction()))
+                return simExited ? STOP_EXIT : STOP_FAULT;
+            if(--budget == 0) {
+                if(gdbInterrupted()) return STOP_INTERRUPT;
+                budget = GDB_POLL_INTERVAL;
+            }
+        }
+    }
+    for(;;) {
+        if(BP_TEST(pc))
+            return STOP_BREAK;
+        int r = gdbStep();
+        if(r != STOP_STEP)
+            return r;
+        if(--budget == 0) {
+            if(gdbInterrupted()) return STOP_INTERRUPT;
+            budget = GDB_POLL_INTERVAL;
+        }
+    }
+}
+
+// Steps or continues with guest memory faults routed back here as a SIGSEGV stop.
+static int gdbResume(int cont) {
+    if(sigsetjmp(faultJmp, 1)) {
+        faultJmpArmed = 0;
+        return STOP_SEGV;
+    }
+    faultJmpArmed = 1;
+    int r = cont ? gdbContinue() : gdbStep();
+    faultJmpArmed = 0;
+    return r;
+}
+
+static void gdbStopReply(int reason, char *out, size_t size) {
+    switch(reason) {
+        case STOP_EXIT:      snprintf(out, size, "W00"); break;
+        case STOP_FAULT:     snprintf(out, size, "S04"); break;
+        case STOP_SEGV:      snprintf(out, size, "S0b"); break;
+        case STOP_INTERRUPT: snprintf(out, size, "S02"); break;
+        case STOP_BREAK:     snprintf(out, size, "T05swbreak:;"); break;
+        case STOP_WATCH:
+            snprintf(out, size, "T05%s:%x;", watchHit == WATCH_WRITE ? "watch" : watchHit == WATCH_READ ? "rwatch" : "awatch",
+                     watchHitAddr);
+            break;
+        default:             snprintf(out, size, "S05"); break;
+    }
+}
+
+static uint16_t gdbReadReg(int n) {
+    return n < 8 ? (uint16_t)regs[n] : pc;
+}
+
+static void gdbWriteReg(int n, uint16_t v) {
+    if(n < 8) regs[n] = (int16_t)v;
+    else pc = v;
+}
+
+static const char gdbTargetXml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\"><feature name=\"org.z16.core\">"
+    "<reg name=\"x0\" bitsize=\"16\" type=\"int\" regnum=\"0\"/>"
+    "<reg name=\"x1\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "<reg name=\"x2\" bitsize=\"16\" type=\"data_ptr\"/>"
+    "<reg name=\"x3\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"x4\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"x5\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"x6\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"x7\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "</feature></target>";
+
+// Handles a breakpoint/watchpoint insert (Z) or remove (z) packet.
+static const char *gdbBreakpointPacket(const char *p) {
+    int insert = (*p++ == 'Z');
+    int type = *p++ - '0';
+    if(*p++ != ',') return "E01";
+    uint16_t addr = (uint16_t)parseHex(&p);
+    if(*p++ != ',') return "E01";
+    uint16_t len = (uint16_t)parseHex(&p);
+    if(type == 0 || type == 1) {
+        if(insert) setBreakpoint(addr);
+        else clearBreakpoint(addr);
+        return "OK";
+    }
+    uint8_t kind;
+    if(type == 2) kind = WATCH_WRITE;
+    else if(type == 3) kind = WATCH_READ;
+    else if(type == 4) kind = WATCH_READ | WATCH_WRITE;
+    else return "";
+    if(insert)
+        return addWatchpoint(addr, len, kind) == 0 ? "OK" : "E02";
+    return removeWatchpoint(addr, len, kind) == 0 ? "OK" : "E02";
+}
+
+// Serves one connected client. Returns 1 if the client detached and the program should keep running.
+static int gdbSession(void) {
+    static char pkt[GDB_PACKET_SIZE], out[GDB_PACKET_SIZE];
+    int lastStop = STOP_STEP;
+    for(;;) {
+        int n = gdbReadPacket(pkt, sizeof(pkt));
+        if(n == -1) return 0;
+        if(n == -2) {
+            gdbStopReply(STOP_INTERRUPT, out, sizeof(out));
+            gdbSendPacket(out);
+            continue;
+        }
+        const char *p = pkt + 1;
+        out[0] = '\0';
+        switch(pkt[0]) {
+            case '?':
+                gdbStopReply(lastStop == STOP_EXIT ? STOP_EXIT : STOP_STEP, out, sizeof(out));
+                break;
+            case 'g': {
+                char *o = out;
+                for(int r = 0; r < 9; r++) {
+                    uint16_t v = gdbReadReg(r);
+                    *o++ = hexDigits[(v >> 4) & 0xF]; *o++ = hexDigits[v & 0xF];
+                    *o++ = hexDigits[(v >> 12) & 0xF]; *o++ = hexDigits[(v >> 8) & 0xF];
+                }
+                *o = '\0';
+                break;
+            }
+            case 'G':
+                for(int r = 0; r < 9 && strlen(p) >= 4; r++, p += 4)
+                    gdbWriteReg(r, (uint16_t)((hexValue(p[0]) << 4 | hexValue(p[1])) |
+                                              (hexValue(p[2]) << 12 | hexValue(p[3]) << 8)));
+                strcpy(out, "OK");
+                break;
+            case 'p': {
+                int r = (int)parseHex(&p);
+                if(r > 8) { strcpy(out, "E01"); break; }
+                uint16_t v = gdbReadReg(r);
+                snprintf(out, sizeof(out), "%02x%02x", v & 0xFF, v >> 8);
+                break;
+            }
+            case 'P': {
+                int r = (int)parseHex(&p);
+                if(r > 8 || *p++ != '=' || strlen(p) < 4) { strcpy(out, "E01"); break; }
+                gdbWriteReg(r, (uint16_t)((hexValue(p[0]) << 4 | hexValue(p[1])) |
+                                          (hexValue(p[2]) << 12 | hexValue(p[3]) << 8)));
+                strcpy(out, "OK");
+                break;
+            }
+            case 'm': {
+                uint16_t addr = (uint16_t)parseHex(&p);
+                if(*p++ != ',') { strcpy(out, "E01"); break; }
+                unsigned long len = parseHex(&p);
+                if(len > (sizeof(out) - 1) / 2) len = (sizeof(out) - 1) / 2;
+                char *o = out;
+                for(unsigned long i = 0; i < len; i++) {
+                    unsigned char b = memory[(uint16_t)(addr + i)];
+                    *o++ = hexDigits[b >> 4];
+                    *o++ = hexDigits[b & 0xF];
+                }
+                *o = '\0';
+                break;
+            }
+            case 'M': {
+                uint16_t addr = (uint16_t)parseHex(&p);
+                if(*p++ != ',') { strcpy(out, "E01"); break; }
+                unsigned long len = parseHex(&p);
+                if(*p++ != ':') { strcpy(out, "E01"); break; }
+                for(unsigned long i = 0; i < len && p[0] && p[1]; i++, p += 2)
+                    memory[(uint16_t)(addr + i)] = (unsigned char)(hexValue(p[0]) << 4 | hexValue(p[1]));
+                strcpy(out, "OK");
+                break;
+            }
+            case 'c':
+            case 's':
+                if(*p) pc = (uint16_t)parseHex(&p);
+                lastStop = gdbResume(pkt[0] == 'c');
+                gdbStopReply(lastStop, out, sizeof(out));
+                break;
+            case 'v':
+                if(strncmp(pkt, "vCont?", 6) == 0)
+                    strcpy(out, "vCont;c;C;s;S");
+                else if(strncmp(pkt, "vCont;", 6) == 0) {
+                    char action = pkt[6];
+                    lastStop = gdbResume(action == 'c' || action == 'C');
+                    gdbStopReply(lastStop, out, sizeof(out));
+                } else if(strncmp(pkt, "vKill", 5) == 0) {
+                    gdbSendPacket("OK");
+                    return 0;
+                }
+                break;
+            case 'Z':
+            case 'z':
+                strcpy(out, gdbBreakpointPacket(pkt));
+                break;
+            case 'H':
+            case 'T':
+                strcpy(out, "OK");
+                break;
+            case 'k':
+                return 0;
+            case 'D':
+                gdbSendPacket("OK");
+                return 1;
+            case 'q':
+                if(strncmp(pkt, "qSupported", 10) == 0)
+                    snprintf(out, sizeof(out), "PacketSize=%x;qXfer:features:read+;QStartNoAckMode+;swbreak+;hwbreak+",
+                             GDB_PACKET_SIZE - 1);
+                else if(strcmp(pkt, "qAttached") == 0)
+                    strcpy(out, "1");
+                else if(strcmp(pkt, "qC") == 0)
+                    strcpy(out, "QC1");
+                else if(strcmp(pkt, "qfThreadInfo") == 0)
+                    strcpy(out, "m1");
+                else if(strcmp(pkt, "qsThreadInfo") == 0)
+                    strcpy(out, "l");
+                else if(strncmp(pkt, "qXfer:features:read:target.xml:", 32) == 0) {
+                    p = pkt + 32;
+                    unsigned long off = parseHex(&p);
+                    p++;
+                    unsigned long len = parseHex(&p);
+                    unsigned long total = sizeof(gdbTargetXml) - 1;
+                    if(len > sizeof(out) - 2) len = sizeof(out) - 2;
+                    if(off >= total)
+                        strcpy(out, "l");
+                    else {
+                        unsigned long chunk = (total - off < len) ? total - off : len;
+                        out[0] = (off + chunk < total) ? 'm' : 'l';
+                        memcpy(out + 1, gdbTargetXml + off, chunk);
+                        out[chunk + 1] = '\0';
+                    }
+                } else if(strncmp(pkt, "qRegisterInfo", 13) == 0) {
+                    // LLDB discovers registers one at a time instead of reading target.xml.
+                    p = pkt + 13;
+                    int r = (int)parseHex(&p);
+                    if(r > 8)
+                        strcpy(out, "E45");
+                    else
+                        snprintf(out, sizeof(out),
+                                 "name:%s;alt-name:%s;bitsize:16;offset:%d;encoding:uint;format:hex;"
+                                 "set:General Purpose Registers;%s",
+                                 r < 8 ? (const char *[]){"x0","x1","x2","x3","x4","x5","x6","x7"}[r] : "pc",
+                                 r < 8 ? regNames[r] : "pc", r * 2,
+                                 r == 8 ? "generic:pc;" : r == 2 ? "generic:sp;" : r == 1 ? "generic:ra;" : "");
+                }
+                break;
+            case 'Q':
+                if(strcmp(pkt, "QStartNoAckMode") == 0) {
+                    gdbSendPacket("OK");
+                    gdbNoAck = 1;
+                    continue;
+                }
+                break;
+            default:
+                break;   // unsupported packets get an empty reply
+        }
+        gdbSendPacket(out);
+    }
+}
+
+// Opens the listening socket, accepts a single client and runs the session.
+static int gdbServe(const char *target) {
+    int listenFd;
+    int isPort = (*target != '\0');
+    for(const char *c = target; *c; c++)
+        if(!isdigit((unsigned char)*c)) isPort = 0;
+
+    if(isPort) {
+        struct sockaddr_in sa;
+        int one = 1;
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if(listenFd < 0) { perror("socket"); exit(1); }
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons((uint16_t)atoi(target));
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if(bind(listenFd, (struct sockaddr *)&sa, sizeof(sa)) < 0) { perror("bind"); exit(1); }
+    } else {
+        struct sockaddr_un sa;
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(listenFd < 0) { perror("socket"); exit(1); }
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strncpy(sa.sun_path, target, sizeof(sa.sun_path) - 1);
+        unlink(sa.sun_path);
+        if(bind(listenFd, (struct sockaddr *)&sa, sizeof(sa)) < 0) { perror("bind"); exit(1); }
+    }
+    if(listen(listenFd, 1) < 0) { perror("listen"); exit(1); }
+    fprintf(stderr, "Waiting for GDB connection on %s%s\n", isPort ? "localhost:" : "", target);
+
+    gdbFd = accept(listenFd, NULL, NULL);
+    if(gdbFd < 0) { perror("accept"); exit(1); }
+    close(listenFd);
+    if(isPort) {
+        int one = 1;
+        setsockopt(gdbFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    fprintf(stderr, "GDB connected\n");
+
+    int detached = gdbSession();
+    close(gdbFd);
+    if(!isPort)
+        unlink(target);
+    if(detached) {
+        // Run the rest of the program without the debugger attached, unless it already ended.
+        int r = STOP_STEP;
+        while(r == STOP_STEP || r == STOP_WATCH)
+            r = gdbStep();
+    }
+    return 0;
+}
+
+#else
+
+static int gdbServe(const char *target) {
+    (void)target;
+    fprintf(stderr, "Error: --gdb is not supported on this platform\n");
+    return 1;
+}
+
+#endif
+#endif
 
+// -----------------------
+// Library Use
+// -----------------------
+//
+// Built with -DZ16SIM_LIBRARY (the z16simlib target), this file provides the calls of z16sim.h
+// in place of main(), so harnesses such as bench/z16rtbench run code on this very decoder.
+
+void z16SimInit(void) {
+    initMemory();
+}
+
+unsigned char *z16SimMemory(void) {
+    return memory;
+}
+
+int16_t *z16SimRegs(void) {
+    return regs;
+}
+
+long z16SimCall(uint16_t entry, uint16_t stop, long limit) {
+    long steps = 0;
+    pc = entry;
+    while(pc != stop) {
+        if(steps == limit || !executeInstruction(fetchInstruction()))
+            return -1;
+        steps++;
+    }
+    return steps;
+}
+
+#ifndef Z16SIM_LIBRARY
 // -----------------------
 // Main Simulation Loop
 // -----------------------
+
+// Runs the program with tracing. Like executeWith(), the loop exists twice: with the fetch and
+// execution hooks of --sanitize, --heatmap and --profile, and without any of them.
+static ALWAYS_INLINE void runProgram(const int instrumented) {
+    char disasmBuf[128], whereBuf[160];
+    while(!(instrumented && profileStop)) {
+        // Fetch a 16-bit instruction from memory (little-endian)
+        uint16_t inst = fetchInstruction();
+        uint16_t instPc = pc;
+        if(instrumented && sanitize)
+            sanitizeFetch();
+        if(instrumented && heatmap)
+            heatmapFetch();
+        int traced = traceSelect(pc);
+        if(traced && traceReg < 0) {
+            disassemble(inst, pc, disasmBuf, sizeof(disasmBuf));
+            if(dbgLoaded) {
+                symbolize(pc, 1, whereBuf, sizeof(whereBuf));
+                printf("0x%04X: %04X    %-24s <%s>\n", pc, inst, disasmBuf, whereBuf);
+            } else {
+                printf("0x%04X: %04X    %s\n", pc, inst, disasmBuf);
+            }
+        }
+        int16_t before = (traceReg >= 0) ? regs[traceReg] : 0;
+        if(!executeWith(inst, instrumented)) {
+            if(instrumented && profiling)
+                profileCount[instPc]++;
+            break;
+        }
+        if(instrumented && profiling)
+            profileStep(instPc, inst);
+        // With --trace-reg the line is printed after execution, together with the new value.
+        if(traced && traceReg >= 0 && regs[traceReg] != before) {
+            disassemble(inst, instPc, disasmBuf, sizeof(disasmBuf));
+            symbolize(instPc, 1, whereBuf, sizeof(whereBuf));
+            printf("0x%04X: %04X    %-24s %s = %d%s%s%s\n", instPc, inst, disasmBuf, regNames[traceReg], regs[traceReg],
+                   dbgLoaded ? "    <" : "", whereBuf, dbgLoaded ? ">" : "");
+        }
+    }
+}
+
+// The address of a --trace-start or --trace-stop argument: a number, or a .text label of the
+// debug information with an optional "+offset" (as traces print them). Exits on an unknown label.
+static int traceAddress(const char *opt, const char *arg) {
+    char *end;
+    long value = strtol(arg, &end, 0);
+    if(end != arg && *end == '\0')
+        return (int)(value & 0xFFFF);
+    const char *plus = strchr(arg, '+');
+    size_t len = plus ? (size_t)(plus - arg) : strlen(arg);
+    long offset = 0;
+    if(plus) {
+        offset = strtol(plus + 1, &end, 0);
+        if(end == plus + 1 || *end != '\0') {
+            fprintf(stderr, "Error: %s expects an address or <label>[+<offset>], not '%s'\n", opt, arg);
+            exit(1);
+        }
+    }
+    for(int i = 0; i < dbgSymbolCount; i++)
+        if(dbgSymbols[i].section == 1 && strlen(dbgSymbols[i].name) == len && strncmp(dbgSymbols[i].name, arg, len) == 0)
+            return (int)((dbgSymbols[i].addr + offset) & 0xFFFF);
+    if(dbgLoaded)
+        fprintf(stderr, "Error: %s: no .text label '%.*s' in the debug information\n", opt, (int)len, arg);
+    else
+        fprintf(stderr, "Error: %s: label '%.*s' needs debug information (z16asm -g, or --dbg <file>)\n", opt, (int)len, arg);
+    exit(1);
+}
+
 int main(int argc, char **argv) {
     printf("main called");
+    char *filename = NULL;
+    char *gdbTarget = NULL;
+    const char *dbgFilename = NULL;
+    const char *traceStartArg = NULL, *traceStopArg = NULL;
+    for(int i = 1; i < argc; i++) {
+        const char *opt = argv[i];
+        const char *arg = (i + 1 < argc) ? argv[i+1] : NULL;
+        if(strcmp(opt, "--no-trace") == 0) {
+            traceOn = 0;
+            continue;
+        }
+        if(strcmp(opt, "--sanitize") == 0) {
+            sanitize = 1;
+            continue;
+        }
+        if(strncmp(opt, "--", 2) == 0 && arg == NULL) {
+            fprintf(stderr, "Error: %s requires an argument\n", opt);
+            exit(1);
+        }
+        if(strcmp(opt, "--gdb") == 0) {
+            gdbTarget = argv[++i];
+        } else if(strcmp(opt, "--trace-start") == 0) {
+            traceStartArg = arg;
+            i++;
+        } else if(strcmp(opt, "--trace-stop") == 0) {
+            traceStopArg = arg;
+            i++;
+        } else if(strcmp(opt, "--trace-count") == 0) {
+            traceCount = strtol(arg, NULL, 0);
+            i++;
+        } else if(strcmp(opt, "--trace-range") == 0) {
+            char *end;
+            traceLo = (uint16_t)strtol(arg, &end, 0);
+            if(*end != ':') {
+                fprintf(stderr, "Error: --trace-range expects <lo>:<hi>\n");
+                exit(1);
+            }
+            traceHi = (uint16_t)strtol(end + 1, NULL, 0);
+            i++;
+        } else if(strcmp(opt, "--trace-reg") == 0) {
+            traceReg = parseRegName(arg);
+            if(traceReg < 0) {
+                fprintf(stderr, "Error: Unknown register '%s'\n", arg);
+                exit(1);
+            }
+            i++;
+        } else if(strcmp(opt, "--dbg") == 0) {
+            dbgFilename = arg;
+            i++;
+        } else if(strcmp(opt, "--heatmap") == 0) {
+            heatmap = 1;
+            heatmapCsv = arg;
+            i++;
+        } else if(strcmp(opt, "--profile") == 0) {
+            profiling = 1;
+            profileFilename = arg;
+            i++;
+        } else if(strcmp(opt, "--text-range") == 0) {
+            char *end;
+            int lo = (int)strtol(arg, &end, 0);
+            if(*end != ':') {
+                fprintf(stderr, "Error: --text-range expects <lo>:<hi>\n");
+                exit(1);
+            }
+            shadowMarkRange(shadowText, lo, (int)strtol(end + 1, NULL, 0) + 1);
+            i++;
+        } else if(strcmp(opt, "--trace-first") == 0) {
+            traceFirst = (uint32_t)strtoul(arg, NULL, 0);
+            i++;
+        } else {
+            filename = argv[i];
+        }
+    }
     //This if condition checks whether the machine code file is actually passed as an argument or not
-    if(argc != 2) {
-        fprintf(stderr, "Usage: %s <machine_code_file>\n", argv[0]);
+    if(filename == NULL) {
+        fprintf(stderr, "Usage: %s [--gdb <port|unix-socket>] [--sanitize] [--heatmap <csv>] [--profile <file>] [--dbg <file>] [trace options] <machine_code_file|source.asm>\n", argv[0]);
         exit(1);
     }
-    loadMemoryFromFile(argv[1]);
+    traceLeft = traceCount;
+    if(traceFirst) {
+        traceHits = (uint32_t *)calloc(MEM_SIZE / 2, sizeof(uint32_t));
+        if(!traceHits) { perror("calloc"); exit(1); }
+    }
+    initMemory();
+    loadMemoryFromFile(filename);
+    // Debug information: --dbg <file>, or prog.dbg next to prog.bin if there is one.
+    if(dbgFilename) {
+        if(!loadDebugInfo(dbgFilename)) {
+            fprintf(stderr, "Error: Cannot load debug information from %s\n", dbgFilename);
+            exit(1);
+        }
+    } else {
+        char name[1024];
+        snprintf(name, sizeof(name) - 4, "%s", filename);
+        char *dot = strrchr(name, '.');
+        if(dot && !strchr(dot, '/'))
+            *dot = '\0';
+        strcat(name, ".dbg");
+        loadDebugInfo(name);
+    }
+    // Labels in --trace-start and --trace-stop need the symbols, so they are resolved only now.
+    if(traceStartArg)
+        traceStartAddr = traceAddress("--trace-start", traceStartArg);
+    if(traceStopArg)
+        traceStopAddr = traceAddress("--trace-stop", traceStopArg);
+    if(traceStartAddr >= 0)
+        traceOn = 0;
+    if(sanitize)
+        for(int i = 0; i < dbgLineCount; i++)
+            shadowMarkRange(shadowText, dbgLines[i].addr, dbgLines[i].addr + dbgLines[i].size);
     //memset is a functino that sets a block of memory to a specific value
     memset(regs, 0, sizeof(regs)); // initialize registers to 0
-    pc = 0;  // starting at address 0
-    char disasmBuf[128];
-    while(pc < MEM_SIZE) {
-        // Fetch a 16-bit instruction from memory (little-endian)
-        uint16_t inst = memory[pc] | (memory[pc+1] << 8);
-        disassemble(inst, pc, disasmBuf, sizeof(disasmBuf));
-        printf("0x%04X: %04X    %s\n", pc, inst, disasmBuf);
-        if(!executeInstruction(inst)) {
-            break;
+    // pc was set by the loader: address 0, or the entry point of a segmented or HEX image
+    int status = 0;
+    if(gdbTarget) {
+        status = gdbServe(gdbTarget);
+        if(status != 0)
+            return status;
+    } else {
+        if(profiling) {
+            signal(SIGINT, profileSignal);
+            signal(SIGTERM, profileSignal);
         }
-        // Terminate if PC goes out of bounds
-        if(pc >= MEM_SIZE) break;
+        if(sanitize || heatmap || profiling)
+            runProgram(1);
+        else
+            runProgram(0);
     }
-    return 0;
+    if(sanitize)
+        sanitizeSummary();
+    if(heatmap)
+        heatmapReport();
+    if(profiling)
+        writeProfile();
+    return status;
 }
+#endif
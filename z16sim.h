@@ -0,0 +1,34 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * In-process interface to the Z16 simulator (z16sim.c built with -DZ16SIM_LIBRARY, the
+ * z16simlib target). There is one machine per process, decoded and executed exactly as the
+ * z16sim command does, without tracing.
+ */
+#ifndef Z16SIM_H
+#define Z16SIM_H
+
+#include <stdint.h>
+
+// Map the 64 KB of guest memory (zeroed). Call once before anything else.
+void z16SimInit(void);
+
+// Guest memory (64 KB from address 0) and the registers x0..x7.
+unsigned char *z16SimMemory(void);
+int16_t *z16SimRegs(void);
+
+// Run from 'entry' until the pc reaches 'stop'. Returns the instructions executed, or -1 if
+// the program exits (ecall 3), meets an unknown instruction or runs 'limit' instructions first.
+long z16SimCall(uint16_t entry, uint16_t stop, long limit);
+
+#endif